@@ -0,0 +1,451 @@
+// Benchmark suite: microbenchmarks of the intersection routines and Vect,
+// plus full renders of every data/example*.scene. Prints JSON so results from
+// different builds can be compared by script.
+#include "configfile/parser.h"
+#include "raytracer/raytracer.h"
+#include "raytracer/renderoptions.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Small deterministic generator so every build benchmarks the same rays.
+struct Random {
+  uint32_t state;
+  explicit Random(uint32_t seed) : state(seed) {}
+  float next(float min, float max) {
+    state = state * 1664525u + 1013904223u;
+    return min + (max - min) * ((state >> 8) / 16777216.0f);
+  }
+};
+
+// Keeps results alive so the compiler cannot drop the work being timed.
+volatile float sink;
+
+struct MicroResult {
+  std::string name;
+  double ns_per_op;
+  uint64_t ops;
+  uint64_t hits;
+};
+
+// Runs `batch` (which performs `ops_per_batch` operations and returns a hit
+// count) until at least min_seconds have passed.
+template <class F>
+MicroResult runMicro(const std::string &name, uint64_t ops_per_batch, double min_seconds, F batch) {
+  batch();  // warm caches
+  uint64_t ops = 0;
+  uint64_t hits = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed;
+  do {
+    hits += batch();
+    ops += ops_per_batch;
+  } while ((elapsed = secondsSince(start)) < min_seconds);
+  return {name, elapsed * 1e9 / ops, ops, hits};
+}
+
+struct SceneResult {
+  std::string scene;
+  uint32_t spheres;
+  uint32_t triangles;
+  // The SceneFeature combination the frames were rendered with.
+  std::string features;
+  double parse_ms;
+  double parse_mb_per_second;
+  double build_ms;
+  int frames;
+  double ms_per_frame;
+  double min_ms;
+  RayStats rays_per_frame;
+  double mrays_per_second;
+};
+
+struct ParseResult {
+  uint64_t bytes;
+  uint32_t triangles;
+  double ms;
+  double mb_per_second;
+};
+
+struct ScalingResult {
+  int threads;
+  double ms_per_frame;
+};
+
+std::string jsonString(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') { out += '\\'; }
+    out += c;
+  }
+  return out + "\"";
+}
+
+// SceneFeature flags as e.g. "shadows+mirrors+spheres".
+std::string featureNames(unsigned features) {
+  static const char *const names[] = {"shadows", "dir_light", "mirrors", "spheres", "triangles", "instances"};
+  std::string out;
+  for (int i = 0; i < 6; i++) {
+    if (!(features & (1u << i))) { continue; }
+    if (!out.empty()) { out += '+'; }
+    out += names[i];
+  }
+  return out.empty() ? "none" : out;
+}
+
+std::vector<std::string> exampleScenes(const std::string &data_dir) {
+  std::vector<std::string> scenes;
+  for (int i = 1;; i++) {
+    std::string path = data_dir + "/example" + std::to_string(i) + ".scene";
+    if (!std::ifstream(path).good()) { break; }
+    scenes.push_back(path);
+  }
+  return scenes;
+}
+
+uint64_t fileSize(const std::string &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  return file.good() ? (uint64_t)file.tellg() : 0;
+}
+
+// Parses a generated scene of `triangles` triangles from memory, so parser
+// throughput is measured without disk I/O.
+ParseResult benchmarkParser(uint32_t triangles) {
+  std::string text =
+      "global ambient:0.2 shadows:1\n"
+      "material $name:\"wall\" ->col:(0.8, 0.8, 0.8) gloss:0.1 p:100\n"
+      "light ->pos:(0.0, 4.0, -10.0) i:30\n";
+  Random random(777);
+  char line[256];
+  for (uint32_t i = 0; i < triangles; i++) {
+    float x = random.next(-7.0f, 7.0f), y = random.next(-5.0f, 5.0f), z = random.next(-24.0f, -5.0f);
+    snprintf(line, sizeof(line), "triangle ->p0:(%.4f, %.4f, %.4f) ->p1:(%.4f, %.4f, %.4f) ->p2:(%.4f, %.4f, %.4f) $mat:\"wall\"\n",
+             x, y, z, x + 0.1f, y, z + 0.05f, x, y + 0.1f, z - 0.05f);
+    text += line;
+  }
+
+  Parser parser;
+  Clock::time_point start = Clock::now();
+  std::unique_ptr<RenderingInfo> info = parser.parseBuffer(text.data(), text.size());
+  double seconds = secondsSince(start);
+  sink = info->triangles.back()->p2.z;
+  return {text.size(), triangles, seconds * 1000.0, text.size() / seconds / 1e6};
+}
+
+std::unique_ptr<RenderingInfo> parseScene(const std::string &path) {
+  Parser parser;
+  try {
+    return parser.parseFile(path);
+  } catch (const std::string &error) {
+    std::cerr << path << ": " << error << std::endl;
+    return nullptr;
+  }
+}
+}  // namespace
+
+// Friend of Raytracer, so the private intersection routines can be timed on
+// their own.
+class RaytracerBenchmark {
+ public:
+  static std::vector<MicroResult> run(const std::string &shadow_scene, double min_seconds) {
+    std::vector<MicroResult> results;
+
+    // One sphere and one triangle in front of the camera; rays fan out from
+    // the origin so roughly half of them hit.
+    RenderingInfo info;
+    Material *material = new Material{{1.0f, 1.0f, 1.0f}, 0.0f, 1.0f, 0.0f, "m"};
+    info.materials.push_back(material);
+    info.spheres.push_back(new Sphere{{0.0f, 0.0f, -5.0f}, 1.5f, material, "m", ""});
+    info.triangles.push_back(new Triangle{{-2.0f, -2.0f, -4.0f}, {2.0f, -2.0f, -4.0f}, {0.0f, 2.0f, -4.0f}, material, "m"});
+    CompiledScene scene(&info);
+    Raytracer raytracer({0.0f, 0.0f, 0.0f}, &scene, 1);
+
+    const int RAYS = 4096;
+    Random random(12345);
+    std::vector<Vect> origins(RAYS), directions(RAYS);
+    for (int i = 0; i < RAYS; i++) {
+      origins[i] = Vect{random.next(-0.5f, 0.5f), random.next(-0.5f, 0.5f), 0.0f};
+      directions[i] = Vect{random.next(-0.6f, 0.6f), random.next(-0.6f, 0.6f), -1.0f};
+    }
+
+    results.push_back(runMicro("hitsSphere", RAYS, min_seconds, [&]() {
+      uint64_t hits = 0;
+      float t;
+      for (int i = 0; i < RAYS; i++) {
+        hits += raytracer.hitsSphere(origins[i], directions[i], 0, 0.0f, 1e30f, t);
+      }
+      return hits;
+    }));
+    results.push_back(runMicro("hitsTriangle", RAYS, min_seconds, [&]() {
+      uint64_t hits = 0;
+      float t;
+      for (int i = 0; i < RAYS; i++) {
+        hits += raytracer.hitsTriangle(origins[i], directions[i], 0, 0.0f, 1e30f, t);
+      }
+      return hits;
+    }));
+
+    // Shadow queries against a real scene: random points inside the room
+    // towards each point light, and along the directional light.
+    std::unique_ptr<RenderingInfo> shadow_info = parseScene(shadow_scene);
+    if (shadow_info) {
+      CompiledScene shadow_compiled(shadow_info.get());
+      Raytracer shadow_raytracer({0.0f, 0.0f, 0.0f}, &shadow_compiled, 1);
+      std::vector<Vect> points(RAYS), to_light(RAYS);
+      std::vector<float> t_max(RAYS);
+      uint32_t lights = shadow_compiled.lightCount();
+      for (int i = 0; i < RAYS; i++) {
+        points[i] = Vect{random.next(-6.0f, 6.0f), random.next(-4.5f, 4.5f), random.next(-23.0f, -5.0f)};
+        uint32_t light = lights == 0 ? 0 : (uint32_t)(i % lights);
+        if (lights == 0) {
+          to_light[i] = Vect{0.0f, 1.0f, 0.0f};
+          t_max[i] = 1e30f;
+        } else {
+          to_light[i] = Vect{shadow_compiled.light_x[light], shadow_compiled.light_y[light],
+                             shadow_compiled.light_z[light]} - points[i];
+          t_max[i] = 1.0f;
+        }
+      }
+      for (int accelerated = 1; accelerated >= 0; accelerated--) {
+        shadow_raytracer.setAccelerated(accelerated != 0);
+        results.push_back(runMicro(accelerated ? "inShadow" : "inShadowLinear", RAYS, min_seconds, [&]() {
+          uint64_t hits = 0;
+          for (int i = 0; i < RAYS; i++) {
+            hits += shadow_raytracer.inShadow(points[i], to_light[i], t_max[i]);
+          }
+          return hits;
+        }));
+      }
+    }
+
+    // Vect operators over arrays large enough to defeat constant folding.
+    std::vector<Vect> a(RAYS), b(RAYS);
+    for (int i = 0; i < RAYS; i++) {
+      a[i] = Vect{random.next(-1.0f, 1.0f), random.next(-1.0f, 1.0f), random.next(-1.0f, 1.0f)};
+      b[i] = Vect{random.next(-1.0f, 1.0f), random.next(-1.0f, 1.0f), random.next(-1.0f, 1.0f)};
+    }
+    results.push_back(runMicro("Vect::operator+", RAYS, min_seconds, [&]() {
+      Vect sum;
+      for (int i = 0; i < RAYS; i++) { sum = sum + (a[i] + b[i]); }
+      sink = sum.x + sum.y + sum.z;
+      return (uint64_t)0;
+    }));
+    results.push_back(runMicro("Vect::operator-", RAYS, min_seconds, [&]() {
+      Vect sum;
+      for (int i = 0; i < RAYS; i++) { sum = sum + (a[i] - b[i]); }
+      sink = sum.x + sum.y + sum.z;
+      return (uint64_t)0;
+    }));
+    results.push_back(runMicro("Vect::dot", RAYS, min_seconds, [&]() {
+      float sum = 0.0f;
+      for (int i = 0; i < RAYS; i++) { sum += a[i] * b[i]; }
+      sink = sum;
+      return (uint64_t)0;
+    }));
+    results.push_back(runMicro("Vect::scale", RAYS, min_seconds, [&]() {
+      Vect sum;
+      for (int i = 0; i < RAYS; i++) { sum = sum + a[i] * b[i].x; }
+      sink = sum.x + sum.y + sum.z;
+      return (uint64_t)0;
+    }));
+    results.push_back(runMicro("Vect::normalize", RAYS, min_seconds, [&]() {
+      Vect sum;
+      for (int i = 0; i < RAYS; i++) { sum = sum + a[i].normalize(); }
+      sink = sum.x + sum.y + sum.z;
+      return (uint64_t)0;
+    }));
+    return results;
+  }
+};
+
+namespace {
+bool renderScene(const std::string &path, const RenderOptions &options, int frames, SceneResult &result) {
+  Clock::time_point start = Clock::now();
+  std::unique_ptr<RenderingInfo> info = parseScene(path);
+  if (!info) { return false; }
+  result.parse_ms = secondsSince(start) * 1000.0;
+  result.parse_mb_per_second = fileSize(path) / (result.parse_ms / 1000.0) / 1e6;
+
+  start = Clock::now();
+  CompiledScene scene(info.get());
+  Raytracer raytracer({0.0f, 0.0f, 0.0f}, &scene, options.threads);
+  applyRenderOptions(raytracer, options);
+  result.build_ms = secondsSince(start) * 1000.0;
+
+  result.scene = path.substr(path.find_last_of("/\\") + 1);
+  result.spheres = scene.sphereCount();
+  result.triangles = scene.triangleCount();
+  result.features = featureNames(raytracer.sceneFeatures());
+  result.frames = frames;
+
+  Frame frame;
+  raytracer.render(frame);  // warm-up
+  raytracer.resetRayStats();
+
+  double total = 0.0;
+  result.min_ms = 1e30;
+  for (int i = 0; i < frames; i++) {
+    start = Clock::now();
+    raytracer.render(frame);
+    double ms = secondsSince(start) * 1000.0;
+    total += ms;
+    result.min_ms = std::min(result.min_ms, ms);
+  }
+  RayStats rays = raytracer.rayStats();
+  result.ms_per_frame = total / frames;
+  result.rays_per_frame.primary = rays.primary / frames;
+  result.rays_per_frame.shadow = rays.shadow / frames;
+  result.rays_per_frame.reflection = rays.reflection / frames;
+  result.mrays_per_second = rays.total() / (total / 1000.0) / 1e6;
+  return true;
+}
+
+void usage(const char *program) {
+  std::cout << "Usage: " << program << " [--data DIR] [--frames N] [--min-time SECONDS] [--micro-only]"
+            << " [--macro-only] [--scaling] [-o results.json] " << RENDER_OPTIONS_USAGE << std::endl;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  RenderOptions options;
+  std::string data_dir = "data";
+  std::string output;
+  int frames = 3;
+  double min_seconds = 0.25;
+  bool micro = true;
+  bool macro = true;
+  bool scaling = false;
+  for (int i = 1; i < argc; i++) {
+    if (parseRenderOption(argc, argv, i, options)) {
+      continue;
+    } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+      data_dir = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      min_seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--micro-only") == 0) {
+      macro = false;
+    } else if (strcmp(argv[i], "--macro-only") == 0) {
+      micro = false;
+    } else if (strcmp(argv[i], "--scaling") == 0) {
+      scaling = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      std::cout << "Unknown option: " << argv[i] << std::endl;
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<std::string> scenes = exampleScenes(data_dir);
+  if (scenes.empty()) {
+    std::cerr << "No example*.scene files in " << data_dir << " (use --data)" << std::endl;
+    return 1;
+  }
+
+  std::vector<MicroResult> micro_results;
+  if (micro) {
+    std::cerr << "microbenchmarks..." << std::endl;
+    micro_results = RaytracerBenchmark::run(scenes.back(), min_seconds);
+  }
+
+  std::vector<SceneResult> scene_results;
+  if (macro) {
+    for (const std::string &path : scenes) {
+      SceneResult result;
+      if (!renderScene(path, options, frames, result)) { return 1; }
+      std::cerr << result.scene << ": " << result.ms_per_frame << " ms/frame, " << result.mrays_per_second
+                << " Mrays/s" << std::endl;
+      scene_results.push_back(result);
+    }
+  }
+
+  // Whole suite at 1, 2, 4, ... threads up to the hardware count.
+  ParseResult parse_result = {0, 0, 0.0, 0.0};
+  if (micro) {
+    parse_result = benchmarkParser(100000);
+    std::cerr << "parser: " << parse_result.mb_per_second << " MB/s" << std::endl;
+  }
+
+  std::vector<ScalingResult> scaling_results;
+  if (scaling) {
+    int hardware = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int threads = 1;; threads = std::min(threads * 2, hardware)) {
+      RenderOptions scaled = options;
+      scaled.threads = threads;
+      double total = 0.0;
+      for (const std::string &path : scenes) {
+        SceneResult result;
+        if (!renderScene(path, scaled, frames, result)) { return 1; }
+        total += result.ms_per_frame;
+      }
+      std::cerr << threads << " threads: " << total << " ms for all scenes" << std::endl;
+      scaling_results.push_back({threads, total});
+      if (threads == hardware) { break; }
+    }
+  }
+
+  std::ostringstream json;
+  json << "{\n";
+  json << "  \"threads\": " << options.threads << ",\n";
+  json << "  \"simd\": " << jsonString(options.simd) << ",\n";
+  json << "  \"bvh\": " << (options.accelerated ? "true" : "false") << ",\n";
+  json << "  \"micro\": [";
+  for (size_t i = 0; i < micro_results.size(); i++) {
+    const MicroResult &r = micro_results[i];
+    json << (i ? "," : "") << "\n    {\"name\": " << jsonString(r.name) << ", \"ns_per_op\": " << r.ns_per_op
+         << ", \"ops\": " << r.ops << ", \"hits\": " << r.hits << "}";
+  }
+  json << (micro_results.empty() ? "" : "\n  ") << "],\n";
+  json << "  \"parse\": {\"bytes\": " << parse_result.bytes << ", \"triangles\": " << parse_result.triangles
+       << ", \"ms\": " << parse_result.ms << ", \"mb_per_second\": " << parse_result.mb_per_second << "},\n";
+  json << "  \"scenes\": [";
+  for (size_t i = 0; i < scene_results.size(); i++) {
+    const SceneResult &r = scene_results[i];
+    json << (i ? "," : "") << "\n    {\"scene\": " << jsonString(r.scene) << ", \"spheres\": " << r.spheres
+         << ", \"triangles\": " << r.triangles << ", \"features\": " << jsonString(r.features)
+         << ", \"parse_ms\": " << r.parse_ms
+         << ", \"parse_mb_per_second\": " << r.parse_mb_per_second << ", \"build_ms\": " << r.build_ms
+         << ", \"frames\": " << r.frames << ", \"ms_per_frame\": " << r.ms_per_frame << ", \"min_ms\": " << r.min_ms
+         << ", \"mrays_per_second\": " << r.mrays_per_second << ", \"rays_per_frame\": {\"primary\": "
+         << r.rays_per_frame.primary << ", \"shadow\": " << r.rays_per_frame.shadow << ", \"reflection\": "
+         << r.rays_per_frame.reflection << "}}";
+  }
+  json << (scene_results.empty() ? "" : "\n  ") << "],\n";
+  json << "  \"scaling\": [";
+  for (size_t i = 0; i < scaling_results.size(); i++) {
+    json << (i ? ", " : "") << "{\"threads\": " << scaling_results[i].threads
+         << ", \"ms_per_frame\": " << scaling_results[i].ms_per_frame << "}";
+  }
+  json << "]\n}\n";
+
+  if (output.empty()) {
+    std::cout << json.str();
+  } else {
+    std::ofstream file(output);
+    file << json.str();
+    if (!file.good()) {
+      std::cerr << "Failed to write " << output << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,573 @@
+#include "meshloader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+const size_t CHUNK_SIZE = 1 << 20;
+
+// Reads a file through a CHUNK_SIZE buffer, which only grows for a single
+// line longer than that.
+class ChunkReader
+{
+private:
+	FILE *file;
+	std::vector<char> buffer;
+	size_t begin = 0;
+	size_t end = 0;
+	bool at_eof = false;
+
+	// Moves the unread bytes to the front and reads more after them.
+	// Returns false once the file is exhausted.
+	bool refill()
+	{
+		if (at_eof)
+		{
+			return false;
+		}
+		memmove(buffer.data(), buffer.data() + begin, end - begin);
+		end -= begin;
+		begin = 0;
+		if (end == buffer.size())
+		{
+			buffer.resize(buffer.size() * 2);
+		}
+		size_t wanted = buffer.size() - end;
+		size_t got = fread(buffer.data() + end, 1, wanted, file);
+		end += got;
+		at_eof = got < wanted;
+		return got != 0;
+	}
+
+	ChunkReader(const ChunkReader &) = delete;
+	ChunkReader &operator=(const ChunkReader &) = delete;
+
+public:
+	explicit ChunkReader(const std::string &filename) : file(fopen(filename.c_str(), "rb")), buffer(CHUNK_SIZE) {}
+	~ChunkReader()
+	{
+		if (file != nullptr)
+		{
+			fclose(file);
+		}
+	}
+
+	bool isOpen() const { return file != nullptr; }
+
+	// The next line, without its line break. Every line is followed by a
+	// '\n' in the buffer (one is added after an unterminated last line), so
+	// numbers can be converted in place with strtof and strtol. The line is
+	// valid until the next read.
+	bool readLine(const char *&line, const char *&line_end)
+	{
+		size_t searched = begin;
+		for (;;)
+		{
+			const char *newline = (const char *)memchr(buffer.data() + searched, '\n', end - searched);
+			if (newline != nullptr)
+			{
+				line = buffer.data() + begin;
+				line_end = newline;
+				if (line_end != line && line_end[-1] == '\r')
+				{
+					line_end--;
+				}
+				begin = newline - buffer.data() + 1;
+				return true;
+			}
+
+			size_t pending = end - begin;
+			if (!refill())
+			{
+				if (pending == 0)
+				{
+					return false;
+				}
+				if (end == buffer.size())
+				{
+					buffer.resize(buffer.size() + 1);
+				}
+				buffer[end++] = '\n';
+			}
+			searched = begin + pending;
+		}
+	}
+
+	bool read(void *out, size_t size)
+	{
+		while (end - begin < size)
+		{
+			if (!refill())
+			{
+				return false;
+			}
+		}
+		memcpy(out, buffer.data() + begin, size);
+		begin += size;
+		return true;
+	}
+};
+
+bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+const char *skipBlanks(const char *p, const char *end)
+{
+	while (p != end && isBlank(*p))
+	{
+		p++;
+	}
+	return p;
+}
+
+bool hasExtension(const std::string &filename, const char *extension)
+{
+	size_t length = strlen(extension);
+	if (filename.size() < length)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < length; i++)
+	{
+		if (tolower((unsigned char)filename[filename.size() - length + i]) != extension[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string lineError(const char *problem, const std::string &filename, size_t line_number)
+{
+	return std::string(problem) + " in " + filename + " line " + std::to_string(line_number);
+}
+
+void loadOBJ(ChunkReader &reader, const std::string &filename, Mesh *mesh)
+{
+	std::vector<uint32_t> polygon;
+	size_t line_number = 0;
+	const char *line;
+	const char *line_end;
+	while (reader.readLine(line, line_end))
+	{
+		line_number++;
+		const char *p = skipBlanks(line, line_end);
+		if (line_end - p < 2 || !isBlank(p[1]))
+		{
+			continue;
+		}
+
+		if (p[0] == 'v')
+		{
+			p++;
+			for (int i = 0; i < 3; i++)
+			{
+				char *next;
+				float value = strtof(p, &next);
+				if (next == p || next > line_end)
+				{
+					throw lineError("Invalid vertex", filename, line_number);
+				}
+				mesh->vertices.push_back(value);
+				p = next;
+			}
+		}
+		else if (p[0] == 'f')
+		{
+			// Indices count from 1, negative ones back from the last vertex.
+			size_t vertex_count = mesh->vertices.size() / 3;
+			polygon.clear();
+			p++;
+			for (;;)
+			{
+				p = skipBlanks(p, line_end);
+				if (p == line_end)
+				{
+					break;
+				}
+				char *next;
+				long long index = strtoll(p, &next, 10);
+				if (next == p || next > line_end || index == 0)
+				{
+					throw lineError("Invalid face", filename, line_number);
+				}
+				index = index < 0 ? index + (long long)vertex_count : index - 1;
+				if (index < 0 || (unsigned long long)index >= vertex_count || index > UINT32_MAX)
+				{
+					throw lineError("Face refers to a missing vertex", filename, line_number);
+				}
+				polygon.push_back((uint32_t)index);
+				// Skip any /texture/normal references.
+				p = next;
+				while (p != line_end && !isBlank(*p))
+				{
+					p++;
+				}
+			}
+			if (polygon.size() < 3)
+			{
+				throw lineError("Face with fewer than 3 vertices", filename, line_number);
+			}
+			for (size_t i = 2; i < polygon.size(); i++)
+			{
+				mesh->indices.push_back(polygon[0]);
+				mesh->indices.push_back(polygon[i - 1]);
+				mesh->indices.push_back(polygon[i]);
+			}
+		}
+	}
+}
+
+enum PlyType
+{
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64
+};
+
+struct PlyProperty
+{
+	std::string name;
+	PlyType type;
+	bool is_list;
+	PlyType count_type;
+};
+
+struct PlyElement
+{
+	std::string name;
+	uint64_t count;
+	std::vector<PlyProperty> properties;
+};
+
+bool parsePlyType(const std::string &name, PlyType &type)
+{
+	static const char *names[][2] = {{"char", "int8"},   {"uchar", "uint8"}, {"short", "int16"},  {"ushort", "uint16"},
+									 {"int", "int32"},   {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+	for (int i = 0; i <= PLY_FLOAT64; i++)
+	{
+		if (name == names[i][0] || name == names[i][1])
+		{
+			type = (PlyType)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads binary PLY values of any type, swapping bytes when the file's byte
+// order differs from ours.
+class PlyReader
+{
+private:
+	ChunkReader &reader;
+	const std::string &filename;
+	bool swap;
+
+public:
+	PlyReader(ChunkReader &reader, const std::string &filename, bool swap)
+		: reader(reader), filename(filename), swap(swap) {}
+
+	double value(PlyType type)
+	{
+		static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+		unsigned char bytes[8];
+		size_t size = sizes[type];
+		if (!reader.read(bytes, size))
+		{
+			throw "Unexpected end of file in " + filename;
+		}
+		if (swap)
+		{
+			std::reverse(bytes, bytes + size);
+		}
+		switch (type)
+		{
+		case PLY_INT8:
+			return (int8_t)bytes[0];
+		case PLY_UINT8:
+			return bytes[0];
+		case PLY_INT16:
+		{
+			int16_t v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		case PLY_UINT16:
+		{
+			uint16_t v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		case PLY_INT32:
+		{
+			int32_t v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		case PLY_UINT32:
+		{
+			uint32_t v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		case PLY_FLOAT32:
+		{
+			float v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		default:
+		{
+			double v;
+			memcpy(&v, bytes, sizeof(v));
+			return v;
+		}
+		}
+	}
+};
+
+std::vector<PlyElement> readPlyHeader(ChunkReader &reader, const std::string &filename, bool &big_endian)
+{
+	std::vector<PlyElement> elements;
+	bool has_format = false;
+	size_t line_number = 0;
+	const char *line;
+	const char *line_end;
+	while (reader.readLine(line, line_end))
+	{
+		line_number++;
+		std::istringstream stream(std::string(line, line_end));
+		std::vector<std::string> words;
+		std::string word;
+		while (stream >> word)
+		{
+			words.push_back(word);
+		}
+
+		if (line_number == 1)
+		{
+			if (words.size() != 1 || words[0] != "ply")
+			{
+				throw filename + " is not a PLY file";
+			}
+		}
+		else if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+		{
+			continue;
+		}
+		else if (words[0] == "format" && words.size() == 3)
+		{
+			if (words[1] != "binary_little_endian" && words[1] != "binary_big_endian")
+			{
+				throw "Only binary PLY files are supported: " + filename;
+			}
+			big_endian = words[1] == "binary_big_endian";
+			has_format = true;
+		}
+		else if (words[0] == "element" && words.size() == 3)
+		{
+			elements.push_back({words[1], strtoull(words[2].c_str(), nullptr, 10), {}});
+		}
+		else if (words[0] == "property" && !elements.empty())
+		{
+			PlyProperty property;
+			property.is_list = words.size() == 5 && words[1] == "list";
+			property.count_type = PLY_UINT8;
+			bool valid = property.is_list ? parsePlyType(words[2], property.count_type) &&
+												parsePlyType(words[3], property.type)
+										  : words.size() == 3 && parsePlyType(words[1], property.type);
+			if (!valid)
+			{
+				throw lineError("Invalid property", filename, line_number);
+			}
+			property.name = words.back();
+			elements.back().properties.push_back(property);
+		}
+		else if (words[0] == "end_header")
+		{
+			if (!has_format)
+			{
+				throw "Missing format in " + filename;
+			}
+			return elements;
+		}
+		else
+		{
+			throw lineError("Invalid header", filename, line_number);
+		}
+	}
+	throw "Missing end_header in " + filename;
+}
+
+void loadPLY(ChunkReader &reader, const std::string &filename, Mesh *mesh)
+{
+	bool big_endian = false;
+	std::vector<PlyElement> elements = readPlyHeader(reader, filename, big_endian);
+
+	uint16_t probe = 1;
+	bool little_endian_host = *(uint8_t *)&probe == 1;
+	PlyReader values(reader, filename, big_endian == little_endian_host);
+
+	uint64_t vertex_count = 0;
+	for (const PlyElement &element : elements)
+	{
+		if (element.name == "vertex")
+		{
+			vertex_count = element.count;
+		}
+		else if (element.name == "face")
+		{
+			mesh->indices.reserve(std::min<uint64_t>(element.count, UINT32_MAX) * 3);
+		}
+	}
+	if (vertex_count > UINT32_MAX)
+	{
+		throw "Too many vertices in " + filename;
+	}
+	mesh->vertices.reserve(vertex_count * 3);
+
+	std::vector<uint32_t> polygon;
+	for (const PlyElement &element : elements)
+	{
+		bool is_vertex = element.name == "vertex";
+		bool is_face = element.name == "face";
+		// Position of x, y and z (or of the index list) among the properties.
+		int slots[3] = {-1, -1, -1};
+		for (size_t i = 0; i < element.properties.size(); i++)
+		{
+			const PlyProperty &property = element.properties[i];
+			if (is_vertex && !property.is_list && property.name.size() == 1 && property.name[0] >= 'x' &&
+				property.name[0] <= 'z')
+			{
+				slots[property.name[0] - 'x'] = (int)i;
+			}
+			else if (is_face && property.is_list &&
+					 (property.name == "vertex_indices" || property.name == "vertex_index"))
+			{
+				slots[0] = (int)i;
+			}
+		}
+		if (is_vertex && (slots[0] < 0 || slots[1] < 0 || slots[2] < 0))
+		{
+			throw "No x, y and z vertex properties in " + filename;
+		}
+		if (is_face && slots[0] < 0)
+		{
+			throw "No vertex_indices face property in " + filename;
+		}
+
+		for (uint64_t record = 0; record < element.count; record++)
+		{
+			float position[3] = {0.0f, 0.0f, 0.0f};
+			for (size_t i = 0; i < element.properties.size(); i++)
+			{
+				const PlyProperty &property = element.properties[i];
+				if (!property.is_list)
+				{
+					double value = values.value(property.type);
+					for (int axis = 0; axis < 3; axis++)
+					{
+						if (slots[axis] == (int)i)
+						{
+							position[axis] = (float)value;
+						}
+					}
+					continue;
+				}
+
+				uint64_t count = (uint64_t)values.value(property.count_type);
+				bool wanted = is_face && slots[0] == (int)i;
+				polygon.clear();
+				for (uint64_t j = 0; j < count; j++)
+				{
+					double index = values.value(property.type);
+					if (!wanted)
+					{
+						continue;
+					}
+					if (index < 0 || index >= (double)vertex_count)
+					{
+						throw "Face refers to a missing vertex in " + filename;
+					}
+					polygon.push_back((uint32_t)index);
+				}
+				if (!wanted)
+				{
+					continue;
+				}
+				if (polygon.size() < 3)
+				{
+					throw "Face with fewer than 3 vertices in " + filename;
+				}
+				for (size_t k = 2; k < polygon.size(); k++)
+				{
+					mesh->indices.push_back(polygon[0]);
+					mesh->indices.push_back(polygon[k - 1]);
+					mesh->indices.push_back(polygon[k]);
+				}
+			}
+			if (is_vertex)
+			{
+				mesh->vertices.insert(mesh->vertices.end(), position, position + 3);
+			}
+		}
+	}
+}
+}  // namespace
+
+std::string resolveScenePath(const std::string &scene_filename, const std::string &path)
+{
+	bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	size_t slash = scene_filename.find_last_of("/\\");
+	if (absolute || slash == std::string::npos)
+	{
+		return path;
+	}
+	return scene_filename.substr(0, slash + 1) + path;
+}
+
+void loadMesh(const std::string &filename, Mesh *mesh)
+{
+	bool obj = hasExtension(filename, ".obj");
+	if (!obj && !hasExtension(filename, ".ply"))
+	{
+		throw "Unknown mesh format: " + filename + " (use .obj or .ply)";
+	}
+	ChunkReader reader(filename);
+	if (!reader.isOpen())
+	{
+		throw "Mesh file " + filename + " failed to open";
+	}
+
+	mesh->vertices.clear();
+	mesh->indices.clear();
+	if (obj)
+	{
+		loadOBJ(reader, filename, mesh);
+	}
+	else
+	{
+		loadPLY(reader, filename, mesh);
+	}
+	if (mesh->indices.empty())
+	{
+		throw "No triangles in " + filename;
+	}
+	mesh->vertices.shrink_to_fit();
+	mesh->indices.shrink_to_fit();
+}
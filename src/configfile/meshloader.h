@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+#include "scenedata.h"
+
+// Resolves a file named in a scene: relative paths start from the directory
+// of the scene file.
+std::string resolveScenePath(const std::string &scene_filename, const std::string &path);
+
+// Streams a Wavefront OBJ or binary PLY file, chosen by extension, into
+// mesh->vertices and mesh->indices. The file is read through a fixed-size
+// buffer in one pass, never held in memory as a whole.
+//
+// OBJ: `v` and `f` records; polygons are split into triangle fans and
+// texture/normal references are ignored.
+// PLY: x, y, z of the vertex element and the vertex_indices (or
+// vertex_index) list of the face element; other elements are skipped.
+//
+// Throws a std::string describing the problem if the file can't be used.
+void loadMesh(const std::string &filename, Mesh *mesh);
@@ -1,130 +1,330 @@
 #include "parser.h"
 
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <regex>
-#include <sstream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 
+#include "meshloader.h"
 #include "scenedata.h"
 
-static std::unordered_map<std::string, Material *> material_map;
+// A piece of the file buffer (or of a condensed attribute). Tokens are never
+// copied unless they end up in the scene or in an error message.
+struct Span
+{
+	const char *begin;
+	const char *end;
+
+	size_t size() const { return end - begin; }
+	std::string str() const { return std::string(begin, end); }
+};
+
+bool operator==(const Span &span, const char *text)
+{
+	size_t length = strlen(text);
+	return span.size() == length && memcmp(span.begin, text, length) == 0;
+}
+
+std::string operator+(const char *prefix, const Span &span)
+{
+	return prefix + span.str();
+}
+
+// The character classes below are the ASCII ones the old std::regex patterns
+// used, so the accepted grammar is unchanged.
+bool isIdentifierStart(char c)
+{
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-int getIntegerAttributeValue(const std::string &token)
+bool isIdentifierChar(char c)
 {
-	std::regex pattern{R"(:(-?\d+))"};
-	std::smatch match;
-	if (!std::regex_search(token, match, pattern))
+	return isIdentifierStart(c) || (c >= '0' && c <= '9');
+}
+
+bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// The characters operator>> skips between tokens.
+bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// [_a-zA-Z][_a-zA-Z0-9]*; returns the end of the match or nullptr.
+const char *matchIdentifier(const char *p, const char *end)
+{
+	if (p == end || !isIdentifierStart(*p))
 	{
-		throw "Invalid integer attribute: " + token;
+		return nullptr;
 	}
-	if (match.size() < 2)
+	p++;
+	while (p != end && isIdentifierChar(*p))
 	{
-		throw "Invalid integer attribute: " + token;
+		p++;
 	}
-	std::string m = match[1];
-	return std::stoi(m);
+	return p;
 }
 
-bool startsNumericAttribute(const std::string &token)
+// -?\d+ ; returns the end of the match or nullptr.
+const char *matchInteger(const char *p, const char *end)
 {
-	std::regex pattern{"^[_a-zA-Z][_a-zA-Z0-9]*:.*"};
-	return std::regex_match(token, pattern);
+	if (p != end && *p == '-')
+	{
+		p++;
+	}
+	if (p == end || !isDigit(*p))
+	{
+		return nullptr;
+	}
+	while (p != end && isDigit(*p))
+	{
+		p++;
+	}
+	return p;
 }
 
-bool startsVectorAttribute(const std::string &token)
+// -?\d+(?:\.\d+)? ; returns the end of the match or nullptr.
+const char *matchNumber(const char *p, const char *end)
 {
-	std::regex pattern{"^->[_a-zA-Z][_a-zA-Z0-9]*:.*"};
-	return std::regex_match(token, pattern);
+	p = matchInteger(p, end);
+	if (p == nullptr)
+	{
+		return nullptr;
+	}
+	if (p + 1 < end && *p == '.' && isDigit(p[1]))
+	{
+		p++;
+		while (p != end && isDigit(*p))
+		{
+			p++;
+		}
+	}
+	return p;
 }
 
-bool startsStringAttribute(const std::string &token)
+// Converts text matched by matchNumber exactly as std::stof would, but
+// reports numbers out of float range as a parse error. Numbers with at most 2^24 as digits and at most ten decimals are one correctly
+// rounded float division (both operands are exact floats); anything longer
+// goes through strtof.
+float toFloat(const char *begin, const char *end)
 {
-	std::regex pattern{"^\\$[_a-zA-Z][_a-zA-Z0-9]*:.*"};
-	return std::regex_match(token, pattern);
-}
+	static const float powers_of_ten[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
 
-bool startsAttribute(const std::string &token)
-{
-	return startsNumericAttribute(token) || startsStringAttribute(token) ||
-		   startsVectorAttribute(token);
+	const char *p = begin;
+	bool negative = *p == '-';
+	if (negative)
+	{
+		p++;
+	}
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int decimals = 0;
+	bool fraction = false;
+	for (; p != end; p++)
+	{
+		if (*p == '.')
+		{
+			fraction = true;
+			continue;
+		}
+		if (++digits > 18)
+		{
+			break;
+		}
+		mantissa = mantissa * 10 + (*p - '0');
+		decimals += fraction;
+	}
+	if (p == end && mantissa <= (1u << 24) && decimals <= 10)
+	{
+		float value = (float)mantissa / powers_of_ten[decimals];
+		return negative ? -value : value;
+	}
+
+	std::string text(begin, end);
+	errno = 0;
+	float value = strtof(text.c_str(), nullptr);
+	if (errno == ERANGE)
+	{
+		throw "Number out of range: " + text;
+	}
+	return value;
 }
 
-std::string getAttributeName(const std::string &token)
+// Converts text matched by matchInteger exactly as std::stoi would, but
+// reports numbers out of int range as a parse error.
+int toInt(const char *begin, const char *end)
 {
-	std::regex pattern{R"(^((?:\$|->)?[_a-zA-Z][_a-zA-Z0-9]*))"};
-	std::smatch match;
-	if (!std::regex_search(token, match, pattern))
+	const char *p = begin;
+	bool negative = *p == '-';
+	if (negative)
 	{
-		throw "Invalid attribute: " + token;
+		p++;
 	}
-	if (match.size() < 2)
+	uint64_t limit = negative ? 2147483648u : 2147483647u;
+	uint64_t value = 0;
+	for (; p != end; p++)
 	{
-		throw "Invalid attribute: " + token;
+		value = value * 10 + (*p - '0');
+		if (value > limit)
+		{
+			throw "Number out of range: " + std::string(begin, end);
+		}
 	}
-	return match[1];
+	return negative ? (int)(0 - value) : (int)value;
 }
 
-float getNumericAttributeValue(const std::string &token)
+int getIntegerAttributeValue(const Span &token)
 {
-	std::regex pattern{R"(:(-?\d+(?:\.\d+)?))"};
-	std::smatch match;
-	if (!std::regex_search(token, match, pattern))
+	for (const char *p = token.begin; p != token.end; p++)
 	{
-		throw "Invalid numeric attribute: " + token;
+		const char *match_end;
+		if (*p == ':' && (match_end = matchInteger(p + 1, token.end)) != nullptr)
+		{
+			return toInt(p + 1, match_end);
+		}
 	}
-	if (match.size() < 2)
+	throw "Invalid integer attribute: " + token;
+}
+
+bool startsNumericAttribute(const Span &token)
+{
+	const char *p = matchIdentifier(token.begin, token.end);
+	return p != nullptr && p != token.end && *p == ':';
+}
+
+bool startsVectorAttribute(const Span &token)
+{
+	if (token.size() < 2 || token.begin[0] != '-' || token.begin[1] != '>')
+	{
+		return false;
+	}
+	return startsNumericAttribute({token.begin + 2, token.end});
+}
+
+bool startsStringAttribute(const Span &token)
+{
+	if (token.size() < 1 || token.begin[0] != '$')
 	{
-		throw "Invalid numeric attribute: " + token;
+		return false;
 	}
-	std::string m = match[1];
-	return std::stof(m);
+	return startsNumericAttribute({token.begin + 1, token.end});
+}
+
+bool startsAttribute(const Span &token)
+{
+	return startsNumericAttribute(token) || startsStringAttribute(token) ||
+		   startsVectorAttribute(token);
 }
 
-std::string getStringAttributeValue(const std::string &token)
+// The name including its $ or -> prefix.
+Span getAttributeName(const Span &token)
 {
-	std::regex pattern{":\"(.*?)\"$"};
-	std::smatch match;
-	if (!std::regex_search(token, match, pattern))
+	const char *p = token.begin;
+	if (p != token.end && *p == '$')
 	{
-		throw "Invalid string attribute: " + token;
+		p++;
 	}
-	if (match.size() < 2)
+	else if (token.size() >= 2 && p[0] == '-' && p[1] == '>')
 	{
-		throw "Invalid string attribute: " + token;
+		p += 2;
+	}
+	const char *name_end = matchIdentifier(p, token.end);
+	if (name_end == nullptr)
+	{
+		throw "Invalid attribute: " + token;
 	}
-	std::string m = match[1];
-	return m;
+	return {token.begin, name_end};
 }
 
-Vect getVectorAttributeValue(const std::string &token)
+float getNumericAttributeValue(const Span &token)
 {
-	std::regex pattern(R"(:\((-?\d+(?:\.\d+)?), *(-?\d+(?:\.\d+)?), *(-?\d+(?:\.\d+)?)\))");
-	std::smatch match;
+	for (const char *p = token.begin; p != token.end; p++)
+	{
+		const char *match_end;
+		if (*p == ':' && (match_end = matchNumber(p + 1, token.end)) != nullptr)
+		{
+			return toFloat(p + 1, match_end);
+		}
+	}
+	throw "Invalid numeric attribute: " + token;
+}
 
-	if (!std::regex_search(token, match, pattern))
+// Everything between the first :" and a closing quote that ends the token.
+std::string getStringAttributeValue(const Span &token)
+{
+	for (const char *p = token.begin; p + 1 < token.end; p++)
 	{
-		throw "Invalid vector attribute: " + token;
+		if (p[0] == ':' && p[1] == '"')
+		{
+			if (p + 2 < token.end && token.end[-1] == '"')
+			{
+				return std::string(p + 2, token.end - 1);
+			}
+			break;
+		}
 	}
-	if (match.size() < 4)
+	throw "Invalid string attribute: " + token;
+}
+
+// :(x, y, z) anywhere in the token, spaces allowed after the commas.
+Vect getVectorAttributeValue(const Span &token)
+{
+	const char *end = token.end;
+	for (const char *p = token.begin; p != end; p++)
 	{
-		throw "Invalid vector attribute: " + token;
+		if (*p != ':' || p + 1 == end || p[1] != '(')
+		{
+			continue;
+		}
+		const char *begins[3];
+		const char *ends[3];
+		const char *q = p + 2;
+		int i = 0;
+		for (; i < 3; i++)
+		{
+			if (i > 0)
+			{
+				if (q == end || *q != ',')
+				{
+					break;
+				}
+				q++;
+				while (q != end && *q == ' ')
+				{
+					q++;
+				}
+			}
+			begins[i] = q;
+			ends[i] = q = matchNumber(q, end);
+			if (q == nullptr)
+			{
+				break;
+			}
+		}
+		if (i == 3 && q != end && *q == ')')
+		{
+			return Vect(toFloat(begins[0], ends[0]), toFloat(begins[1], ends[1]), toFloat(begins[2], ends[2]));
+		}
 	}
-	std::string p0 = match[1];
-	std::string p1 = match[2];
-	std::string p2 = match[3];
-	return Vect(std::stof(p0), std::stof(p1), std::stof(p2));
+	throw "Invalid vector attribute: " + token;
 }
 
-void parseLight(std::vector<std::string> attributes, RenderingInfo *rinfo)
+void parseLight(const std::vector<Span> &attributes, RenderingInfo *rinfo)
 {
-	Light *light = new Light();
+	std::unique_ptr<Light> light(new Light());
 	for (auto attribute : attributes)
 	{
 		if (startsVectorAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "->pos")
 			{
 				light->position = getVectorAttributeValue(attribute);
@@ -136,7 +336,7 @@ void parseLight(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsNumericAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "i")
 			{
 				light->intensity = getNumericAttributeValue(attribute);
@@ -151,17 +351,17 @@ void parseLight(std::vector<std::string> attributes, RenderingInfo *rinfo)
 			throw "Unrecognized attribute: " + attribute;
 		}
 	}
-	rinfo->point_lights.push_back(light);
+	rinfo->point_lights.push_back(light.release());
 }
 
-void parseDirection(std::vector<std::string> attributes, RenderingInfo *rinfo)
+void parseDirection(const std::vector<Span> &attributes, RenderingInfo *rinfo)
 {
-	DirectionalLight *dlight = new DirectionalLight();
+	std::unique_ptr<DirectionalLight> dlight(new DirectionalLight());
 	for (auto attribute : attributes)
 	{
 		if (startsVectorAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "->d")
 			{
 				dlight->direction = getVectorAttributeValue(attribute);
@@ -173,7 +373,7 @@ void parseDirection(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsNumericAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "h")
 			{
 				dlight->h_intensity = getNumericAttributeValue(attribute);
@@ -188,16 +388,18 @@ void parseDirection(std::vector<std::string> attributes, RenderingInfo *rinfo)
 			throw "Unrecognized attribute: " + attribute;
 		}
 	}
-	rinfo->dir_light = dlight;
+	// A later direction line replaces an earlier one.
+	delete rinfo->dir_light;
+	rinfo->dir_light = dlight.release();
 }
 
-void parseGlobal(std::vector<std::string> attributes, RenderingInfo *rinfo)
+void parseGlobal(const std::vector<Span> &attributes, RenderingInfo *rinfo)
 {
 	for (auto attribute : attributes)
 	{
 		if (startsNumericAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "ambient")
 			{
 				rinfo->ambient = getNumericAttributeValue(attribute);
@@ -222,14 +424,14 @@ void parseGlobal(std::vector<std::string> attributes, RenderingInfo *rinfo)
 	}
 }
 
-void parseSphere(std::vector<std::string> attributes, RenderingInfo *rinfo)
+void parseSphere(const std::vector<Span> &attributes, RenderingInfo *rinfo)
 {
-	Sphere *sphere = new Sphere();
+	std::unique_ptr<Sphere> sphere(new Sphere());
 	for (auto attribute : attributes)
 	{
 		if (startsNumericAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 
 			if (name == "radius")
 			{
@@ -242,7 +444,7 @@ void parseSphere(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsVectorAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 
 			if (name == "->center")
 			{
@@ -255,11 +457,15 @@ void parseSphere(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsStringAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "$mat")
 			{
 				sphere->materialName = getStringAttributeValue(attribute);
 			}
+			else if (name == "$name")
+			{
+				sphere->name = getStringAttributeValue(attribute);
+			}
 			else
 			{
 				throw "Unrecognized string attribute: " + name;
@@ -270,17 +476,17 @@ void parseSphere(std::vector<std::string> attributes, RenderingInfo *rinfo)
 			throw "Unrecognized attribute: " + attribute;
 		}
 	}
-	rinfo->spheres.push_back(sphere);
+	rinfo->spheres.push_back(sphere.release());
 }
 
-void parseTriangle(std::vector<std::string> attributes, RenderingInfo *rinfo)
+void parseTriangle(const std::vector<Span> &attributes, RenderingInfo *rinfo)
 {
-	Triangle *triangle = new Triangle();
+	std::unique_ptr<Triangle> triangle(new Triangle());
 	for (auto attribute : attributes)
 	{
 		if (startsVectorAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "->p0")
 			{
 				triangle->p0 = getVectorAttributeValue(attribute);
@@ -300,7 +506,7 @@ void parseTriangle(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsStringAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "$mat")
 			{
 				triangle->materialName = getStringAttributeValue(attribute);
@@ -315,17 +521,239 @@ void parseTriangle(std::vector<std::string> attributes, RenderingInfo *rinfo)
 			throw "Unrecognized attribute: " + attribute;
 		}
 	}
-	rinfo->triangles.push_back(triangle);
+	rinfo->triangles.push_back(triangle.release());
 }
 
-void parseMaterial(std::vector<std::string> attributes, RenderingInfo *rinfo)
+// $file, $mat and, for objects, $name of a mesh or object line.
+std::unique_ptr<Mesh> parseMeshAttributes(const std::vector<Span> &attributes, bool named)
 {
-	Material *mat = new Material();
+	std::unique_ptr<Mesh> mesh(new Mesh());
+	for (auto attribute : attributes)
+	{
+		if (startsStringAttribute(attribute))
+		{
+			Span name = getAttributeName(attribute);
+			if (name == "$file")
+			{
+				mesh->filename = getStringAttributeValue(attribute);
+			}
+			else if (name == "$mat")
+			{
+				mesh->materialName = getStringAttributeValue(attribute);
+			}
+			else if (named && name == "$name")
+			{
+				mesh->name = getStringAttributeValue(attribute);
+			}
+			else
+			{
+				throw "Unrecognized string attribute: " + name;
+			}
+		}
+		else
+		{
+			throw "Unrecognized attribute: " + attribute;
+		}
+	}
+	if (mesh->filename.empty())
+	{
+		throw std::string("Mesh without a $file attribute");
+	}
+	return mesh;
+}
+
+// mesh $file:"model.obj" $mat:"name". The file is loaded once the whole
+// scene has been read.
+void parseMesh(const std::vector<Span> &attributes, RenderingInfo *rinfo)
+{
+	rinfo->meshes.push_back(parseMeshAttributes(attributes, false).release());
+}
+
+// object $name:"chair" $file:"chair.obj" $mat:"name". Like a mesh, but only
+// rendered where an instance places it.
+void parseObject(const std::vector<Span> &attributes, RenderingInfo *rinfo)
+{
+	std::unique_ptr<Mesh> object = parseMeshAttributes(attributes, true);
+	if (object->name.empty())
+	{
+		throw std::string("Object without a $name attribute");
+	}
+	rinfo->objects.push_back(object.release());
+}
+
+// ->pos, ->rot, ->scale and scale of an instance or keyframe line; false
+// for any other attribute. Sets the flag of each value it reads.
+bool parsePlacement(const Span &attribute, Vect &position, Vect &rotation, Vect &scale, bool set[3])
+{
+	if (startsVectorAttribute(attribute))
+	{
+		Span name = getAttributeName(attribute);
+		if (name == "->pos")
+		{
+			position = getVectorAttributeValue(attribute);
+			set[0] = true;
+		}
+		else if (name == "->rot")
+		{
+			rotation = getVectorAttributeValue(attribute);
+			set[1] = true;
+		}
+		else if (name == "->scale")
+		{
+			scale = getVectorAttributeValue(attribute);
+			set[2] = true;
+		}
+		else
+		{
+			throw "Unrecognized vector attribute: " + name;
+		}
+		return true;
+	}
+	if (startsNumericAttribute(attribute) && getAttributeName(attribute) == "scale")
+	{
+		float s = getNumericAttributeValue(attribute);
+		scale = Vect(s, s, s);
+		set[2] = true;
+		return true;
+	}
+	return false;
+}
+
+// The tracer needs the inverse of every instance transform.
+void checkScale(const Vect &scale, const std::string &what)
+{
+	if (scale.x == 0.0f || scale.y == 0.0f || scale.z == 0.0f)
+	{
+		throw what + " has a zero scale";
+	}
+}
+
+// instance $object:"chair" ->pos:(x, y, z) ->rot:(x, y, z) ->scale:(x, y, z)
+// $mat:"name" $name:"name". Everything but $object is optional; scale:s
+// scales uniformly.
+void parseInstance(const std::vector<Span> &attributes, RenderingInfo *rinfo)
+{
+	std::unique_ptr<Instance> instance(new Instance());
+	instance->scale = Vect(1.0f, 1.0f, 1.0f);
+	bool set[3] = {false, false, false};
+	for (auto attribute : attributes)
+	{
+		if (parsePlacement(attribute, instance->position, instance->rotation, instance->scale, set))
+		{
+			continue;
+		}
+		else if (startsNumericAttribute(attribute))
+		{
+			throw "Unrecognized numeric attribute: " + getAttributeName(attribute);
+		}
+		else if (startsStringAttribute(attribute))
+		{
+			Span name = getAttributeName(attribute);
+			if (name == "$object")
+			{
+				instance->objectName = getStringAttributeValue(attribute);
+			}
+			else if (name == "$mat")
+			{
+				instance->materialName = getStringAttributeValue(attribute);
+			}
+			else if (name == "$name")
+			{
+				instance->name = getStringAttributeValue(attribute);
+			}
+			else
+			{
+				throw "Unrecognized string attribute: " + name;
+			}
+		}
+		else
+		{
+			throw "Unrecognized attribute: " + attribute;
+		}
+	}
+	if (instance->objectName.empty())
+	{
+		throw std::string("Instance without an $object attribute");
+	}
+	checkScale(instance->scale, "Instance of " + instance->objectName);
+	rinfo->instances.push_back(instance.release());
+}
+
+// key $sphere:"name" t:0.5 ->pos:(x, y, z)
+// key $instance:"name" t:0.5 ->pos:(x, y, z) ->rot:(x, y, z) ->scale:(x, y, z)
+// Where a named sphere (its center) or instance is at time t, in seconds.
+void parseKey(const std::vector<Span> &attributes, RenderingInfo *rinfo)
+{
+	std::unique_ptr<Keyframe> key(new Keyframe());
+	bool set[3] = {false, false, false};
+	bool has_time = false;
+	for (auto attribute : attributes)
+	{
+		if (parsePlacement(attribute, key->position, key->rotation, key->scale, set))
+		{
+			continue;
+		}
+		else if (startsNumericAttribute(attribute))
+		{
+			Span name = getAttributeName(attribute);
+			if (name == "t")
+			{
+				key->time = getNumericAttributeValue(attribute);
+				has_time = true;
+			}
+			else
+			{
+				throw "Unrecognized numeric attribute: " + name;
+			}
+		}
+		else if (startsStringAttribute(attribute))
+		{
+			Span name = getAttributeName(attribute);
+			if (name == "$sphere")
+			{
+				key->sphereName = getStringAttributeValue(attribute);
+			}
+			else if (name == "$instance")
+			{
+				key->instanceName = getStringAttributeValue(attribute);
+			}
+			else
+			{
+				throw "Unrecognized string attribute: " + name;
+			}
+		}
+		else
+		{
+			throw "Unrecognized attribute: " + attribute;
+		}
+	}
+	if (key->sphereName.empty() == key->instanceName.empty())
+	{
+		throw std::string("Keyframe needs one $sphere or $instance attribute");
+	}
+	if (!has_time)
+	{
+		throw std::string("Keyframe without a t attribute");
+	}
+	if (!key->sphereName.empty() && (set[1] || set[2]))
+	{
+		throw "Keyframe of sphere " + key->sphereName + " can only set ->pos";
+	}
+	key->has_position = set[0];
+	key->has_rotation = set[1];
+	key->has_scale = set[2];
+	rinfo->keyframes.push_back(key.release());
+}
+
+void parseMaterial(const std::vector<Span> &attributes, std::unordered_map<std::string, Material *> &material_map,
+				   RenderingInfo *rinfo)
+{
+	std::unique_ptr<Material> mat(new Material());
 	for (auto attribute : attributes)
 	{
 		if (startsNumericAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "gloss")
 			{
 				mat->glossiness = getNumericAttributeValue(attribute);
@@ -345,7 +773,7 @@ void parseMaterial(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsVectorAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "->col")
 			{
 				Vect v = getVectorAttributeValue(attribute);
@@ -359,12 +787,12 @@ void parseMaterial(std::vector<std::string> attributes, RenderingInfo *rinfo)
 		}
 		else if (startsStringAttribute(attribute))
 		{
-			std::string name = getAttributeName(attribute);
+			Span name = getAttributeName(attribute);
 			if (name == "$name")
 			{
 				std::string value = getStringAttributeValue(attribute);
 				mat->name = value;
-				material_map[value] = mat;
+				material_map[value] = mat.get();
 			}
 			else
 			{
@@ -376,57 +804,84 @@ void parseMaterial(std::vector<std::string> attributes, RenderingInfo *rinfo)
 			throw "Unrecognized attribute: " + attribute;
 		}
 	}
-	rinfo->materials.push_back(mat);
+	rinfo->materials.push_back(mat.release());
 }
 
-void parseLine(std::string line, RenderingInfo *rinfo)
+// Scratch space reused from line to line, so steady-state parsing does not
+// allocate. Condensed attributes are the attribute token with the tokens that
+// follow it (up to the next attribute) appended without whitespace.
+struct LineScratch
 {
+	std::string text;
+	std::vector<size_t> offsets;
+	std::vector<Span> attributes;
+	// Every $name given to a material so far, as it was parsed. It lives for
+	// one parse, so a process parsing several scenes never resolves a name to
+	// a material of another one.
+	std::unordered_map<std::string, Material *> material_map;
+};
 
-	// first parse file
-	std::stringstream ss(line);
-	std::string token;
-	std::vector<std::string> raw_tokens;
-	std::vector<std::string> attributes;
-
-	while (ss >> token)
-	{
-		raw_tokens.push_back(std::string(token));
-	}
+void parseLine(const Span &line, LineScratch &scratch, RenderingInfo *rinfo)
+{
+	scratch.text.clear();
+	scratch.offsets.clear();
+	scratch.attributes.clear();
 
-	std::string object_type;
-	std::string current_attribute = "NOT_STARTED";
+	Span object_type = {line.begin, line.begin};
+	bool started = false;
 
-	// we want to condense some tokens.
-	for (int i = 0; i < raw_tokens.size(); i++)
+	const char *p = line.begin;
+	for (int i = 0;; i++)
 	{
-		auto rtoken = raw_tokens[i];
+		while (p != line.end && isSpace(*p))
+		{
+			p++;
+		}
+		if (p == line.end)
+		{
+			break;
+		}
+		Span token = {p, p};
+		while (token.end != line.end && !isSpace(*token.end))
+		{
+			token.end++;
+		}
+		p = token.end;
+
 		if (i == 0)
 		{
-			object_type = rtoken;
+			object_type = token;
+		}
+		else if (startsAttribute(token))
+		{
+			scratch.offsets.push_back(scratch.text.size());
+			scratch.text.append(token.begin, token.end);
+			started = true;
 		}
 		else
 		{
-			if (startsAttribute(rtoken))
-			{
-				if (current_attribute != "NOT_STARTED")
-				{
-					attributes.push_back(current_attribute);
-				}
-				current_attribute = rtoken;
-			}
-			else
+			// Values before the first attribute stick to a placeholder and
+			// later fail as an unrecognized attribute.
+			if (!started)
 			{
-				current_attribute += rtoken;
+				scratch.offsets.push_back(scratch.text.size());
+				scratch.text += "NOT_STARTED";
+				started = true;
 			}
+			scratch.text.append(token.begin, token.end);
 		}
 	}
-	if (current_attribute != "NOT_STARTED")
+	const char *text = scratch.text.data();
+	for (size_t i = 0; i < scratch.offsets.size(); i++)
 	{
-		attributes.push_back(current_attribute);
+		size_t end = i + 1 < scratch.offsets.size() ? scratch.offsets[i + 1] : scratch.text.size();
+		scratch.attributes.push_back({text + scratch.offsets[i], text + end});
 	}
+
+	const std::vector<Span> &attributes = scratch.attributes;
 	if (object_type == "material")
 	{
-		parseMaterial(attributes, rinfo);
+		parseMaterial(attributes, scratch.material_map, rinfo);
 	}
 	else if (object_type == "light")
 	{
@@ -444,6 +899,22 @@ void parseLine(std::string line, RenderingInfo *rinfo)
 	{
 		parseTriangle(attributes, rinfo);
 	}
+	else if (object_type == "mesh")
+	{
+		parseMesh(attributes, rinfo);
+	}
+	else if (object_type == "object")
+	{
+		parseObject(attributes, rinfo);
+	}
+	else if (object_type == "instance")
+	{
+		parseInstance(attributes, rinfo);
+	}
+	else if (object_type == "key")
+	{
+		parseKey(attributes, rinfo);
+	}
 	else if (object_type == "global")
 	{
 		parseGlobal(attributes, rinfo);
@@ -454,37 +925,50 @@ void parseLine(std::string line, RenderingInfo *rinfo)
 	}
 }
 
-RenderingInfo *Parser::parseFile(std::string filename)
+std::unique_ptr<RenderingInfo> Parser::parseFile(std::string filename)
 {
-	RenderingInfo *rinfo = new RenderingInfo();
+	std::ifstream file(filename);
+	if (!file.is_open())
+	{
+		std::cout << "File " << filename << " failed to open" << std::endl;
+		return nullptr;
+	}
+	// Text mode, as before, so line endings are translated the same way.
+	file.seekg(0, std::ios::end);
+	std::streamoff size = file.tellg();
+	file.seekg(0, std::ios::beg);
+	std::string buffer(size > 0 ? (size_t)size : 0, '\0');
+	file.read(&buffer[0], buffer.size());
+	buffer.resize((size_t)file.gcount());
+	return parseBuffer(buffer.data(), buffer.size(), filename);
+}
+
+std::unique_ptr<RenderingInfo> Parser::parseBuffer(const char *data, size_t size, const std::string &filename)
+{
+	// Freed with everything parsed so far if an error is thrown.
+	std::unique_ptr<RenderingInfo> rinfo(new RenderingInfo());
 	rinfo->ambient = 0.0;
 	rinfo->focal_length = -1.25;
 	rinfo->dir_light = nullptr;
-	std::ifstream file(filename);
-	if (file.is_open())
+
+	LineScratch scratch;
+	const char *end = data + size;
+	for (const char *line = data; line < end;)
 	{
-		std::string line;
-		while (getline(file, line))
+		const char *line_end = (const char *)memchr(line, '\n', end - line);
+		if (line_end == nullptr)
 		{
-			if (line.empty())
-			{
-				continue;
-			}
-			else if (line[0] == '#')
-			{
-				continue;
-			}
-			else
-			{
-				parseLine(line, rinfo);
-			}
+			line_end = end;
 		}
+		if (line_end != line && line[0] != '#')
+		{
+			parseLine({line, line_end}, scratch, rinfo.get());
+		}
+		line = line_end + 1;
 	}
-	else
-	{
-		std::cout << "File " << filename << " failed to open" << std::endl;
-		return nullptr;
-	}
+
+	std::unordered_map<std::string, Material *> &material_map = scratch.material_map;
+
 	for (auto sphere : rinfo->spheres)
 	{
 		if (material_map.find(sphere->materialName) == material_map.end())
@@ -501,5 +985,97 @@ RenderingInfo *Parser::parseFile(std::string filename)
 		}
 		triangle->material = material_map[triangle->materialName];
 	}
+	for (auto mesh : rinfo->meshes)
+	{
+		if (material_map.find(mesh->materialName) == material_map.end())
+		{
+			throw "Material " + mesh->materialName + " not found";
+		}
+		mesh->material = material_map[mesh->materialName];
+		loadMesh(resolveScenePath(filename, mesh->filename), mesh);
+	}
+	std::unordered_map<std::string, Mesh *> object_map;
+	for (auto object : rinfo->objects)
+	{
+		if (material_map.find(object->materialName) == material_map.end())
+		{
+			throw "Material " + object->materialName + " not found";
+		}
+		if (!object_map.insert({object->name, object}).second)
+		{
+			throw "Object " + object->name + " defined twice";
+		}
+		object->material = material_map[object->materialName];
+		loadMesh(resolveScenePath(filename, object->filename), object);
+	}
+	for (auto instance : rinfo->instances)
+	{
+		if (object_map.find(instance->objectName) == object_map.end())
+		{
+			throw "Object " + instance->objectName + " not found";
+		}
+		instance->object = object_map[instance->objectName];
+		instance->material = instance->object->material;
+		if (!instance->materialName.empty())
+		{
+			if (material_map.find(instance->materialName) == material_map.end())
+			{
+				throw "Material " + instance->materialName + " not found";
+			}
+			instance->material = material_map[instance->materialName];
+		}
+	}
+
+	// Keyframes name their target; what they leave out, the target keeps.
+	std::unordered_map<std::string, Sphere *> sphere_map;
+	std::unordered_map<std::string, Instance *> instance_map;
+	for (auto sphere : rinfo->spheres)
+	{
+		if (!sphere->name.empty() && !sphere_map.insert({sphere->name, sphere}).second)
+		{
+			throw "Sphere " + sphere->name + " defined twice";
+		}
+	}
+	for (auto instance : rinfo->instances)
+	{
+		if (!instance->name.empty() && !instance_map.insert({instance->name, instance}).second)
+		{
+			throw "Instance " + instance->name + " defined twice";
+		}
+	}
+	for (auto key : rinfo->keyframes)
+	{
+		if (!key->sphereName.empty())
+		{
+			if (sphere_map.find(key->sphereName) == sphere_map.end())
+			{
+				throw "Sphere " + key->sphereName + " not found";
+			}
+			key->sphere = sphere_map[key->sphereName];
+			if (!key->has_position)
+			{
+				key->position = key->sphere->center;
+			}
+			continue;
+		}
+		if (instance_map.find(key->instanceName) == instance_map.end())
+		{
+			throw "Instance " + key->instanceName + " not found";
+		}
+		key->instance = instance_map[key->instanceName];
+		if (!key->has_position)
+		{
+			key->position = key->instance->position;
+		}
+		if (!key->has_rotation)
+		{
+			key->rotation = key->instance->rotation;
+		}
+		if (!key->has_scale)
+		{
+			key->scale = key->instance->scale;
+		}
+		checkScale(key->scale, "Keyframe of instance " + key->instanceName);
+	}
 	return rinfo;
-}
\ No newline at end of file
+}
@@ -1,8 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
 #include <string>
 
 #include "scenedata.h"
 
 class Parser {
  public:
-  RenderingInfo* parseFile(std::string filename);
+  // Throws a std::string describing the first error; nullptr if the file
+  // does not open.
+  std::unique_ptr<RenderingInfo> parseFile(std::string filename);
+  // Parses scene text already in memory. Mesh files it names are looked up
+  // relative to `filename`, the scene file the text came from.
+  std::unique_ptr<RenderingInfo> parseBuffer(const char *data, size_t size, const std::string &filename = "");
 };
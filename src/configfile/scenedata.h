@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,7 @@ struct Sphere
   float radius;
   Material *material;
   std::string materialName;
+  std::string name;  // optional, for keyframes
 };
 
 struct Triangle
@@ -34,6 +36,54 @@ struct Triangle
   std::string materialName;
 };
 
+// Triangles streamed from a mesh file by the `mesh` directive. Vertices are
+// shared and each triangle is three indices into them, so a triangle costs
+// 12 bytes plus its share of the vertices rather than a whole Triangle.
+// CompiledScene keeps them that way, with one material per mesh, and the
+// Mesh is freed with the RenderingInfo once that is built.
+struct Mesh
+{
+  std::vector<float> vertices;    // x, y, z per vertex
+  std::vector<uint32_t> indices;  // three per triangle
+  Material *material;
+  std::string materialName;
+  std::string filename;  // as written in the scene, relative to it
+  std::string name;      // for `object` lines, what instances refer to
+};
+
+// A placement of an `object` mesh. The mesh is stored once however many
+// instances refer to it. The object is scaled, then rotated about x, y and
+// z (degrees), then moved to `position`.
+struct Instance
+{
+  Vect position;
+  Vect rotation;
+  Vect scale;
+  Mesh *object;
+  std::string objectName;
+  Material *material;        // the object's unless the instance names one
+  std::string materialName;  // empty for the object's
+  std::string name;          // optional, for keyframes
+};
+
+// Where a named sphere or instance is at `time`. Keyframes of one target
+// form its animation track; values a `key` line leaves out are the
+// target's own. Spheres only use position, as their center.
+struct Keyframe
+{
+  float time;
+  Vect position;
+  Vect rotation;
+  Vect scale;
+  Sphere *sphere;  // exactly one of these is set
+  Instance *instance;
+  std::string sphereName;
+  std::string instanceName;
+  bool has_position;
+  bool has_rotation;
+  bool has_scale;
+};
+
 struct Light
 {
   Vect position;
@@ -46,6 +96,7 @@ struct DirectionalLight
   float h_intensity;
 };
 
+// Owns every object it points to, which it deletes with itself.
 struct RenderingInfo
 {
   float ambient;
@@ -54,6 +105,36 @@ struct RenderingInfo
   DirectionalLight *dir_light;
   std::vector<Light *> point_lights;
   std::vector<Triangle *> triangles;
+  std::vector<Mesh *> meshes;
+  std::vector<Mesh *> objects;
+  std::vector<Instance *> instances;
+  std::vector<Keyframe *> keyframes;
   std::vector<Sphere *> spheres;
   std::vector<Material *> materials;
+
+  RenderingInfo() : ambient(0.0f), focal_length(0.0f), shadows(false), dir_light(nullptr) {}
+  RenderingInfo(const RenderingInfo &) = delete;
+  ~RenderingInfo()
+  {
+    delete dir_light;
+    deleteAll(point_lights);
+    deleteAll(triangles);
+    deleteAll(meshes);
+    deleteAll(objects);
+    deleteAll(instances);
+    deleteAll(keyframes);
+    deleteAll(spheres);
+    deleteAll(materials);
+  }
+  RenderingInfo &operator=(const RenderingInfo &) = delete;
+
+  template <typename T>
+  static void deleteAll(std::vector<T *> &items)
+  {
+    for (T *item : items)
+    {
+      delete item;
+    }
+    items.clear();
+  }
 };
@@ -0,0 +1,320 @@
+// Render server for preview services: keeps scenes loaded, with their BVH,
+// light tree and worker threads, and renders on request over a Unix socket,
+// so a repeat request starts tracing without parsing or building anything.
+//
+// Requests are lines of words; every request gets one line of JSON back.
+//
+//   load <name> <scene file>        load (or reload) a scene under a name
+//   render <name> [theta=DEG] [time=T] [width=W] [height=H] [output=FILE]
+//   unload <name>
+//   list
+//   shutdown
+//
+// render takes a loaded name or a scene file, which is loaded under its own
+// path on first use. Without output= the frame is rendered but not written.
+#include "distributed/connection.h"
+#include "image/imagewriter.h"
+#include "raytracer/raytracer.h"
+#include "raytracer/renderoptions.h"
+#include "raytracer/scenecache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+// Frames are held whole; larger images go through the headless renderer's
+// --band mode.
+const int MAX_PIXELS = 64 * 1024 * 1024;
+
+double msSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+std::string jsonString(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') { out += '\\'; }
+    out += c;
+  }
+  return out + "\"";
+}
+
+std::string errorReply(const std::string &message) { return "{\"ok\": false, \"error\": " + jsonString(message) + "}"; }
+
+// A scene ready to trace: everything a render needs stays resident.
+struct WarmScene {
+  std::string path;
+  LoadedScene scene;
+  std::unique_ptr<Raytracer> raytracer;
+  double load_ms = 0.0;
+  // Scene time the raytracer was last brought to, for animated scenes.
+  bool moved = false;
+  float time = 0.0f;
+  uint64_t renders = 0;
+};
+
+class Daemon {
+ private:
+  struct Client {
+    Connection connection;
+    std::string input;
+  };
+
+  RenderOptions options;
+  Listener listener;
+  std::vector<Client> clients;
+  std::map<std::string, std::unique_ptr<WarmScene>> scenes;
+  Frame frame;
+  bool stopping = false;
+
+  WarmScene *load(const std::string &name, const std::string &path, std::string &error);
+  std::string render(const std::vector<std::string> &words);
+  std::string list() const;
+
+ public:
+  explicit Daemon(const RenderOptions &options) : options(options) {}
+  bool listen(const std::string &address) { return listener.open(address); }
+  // Carries out one request line and returns the reply, without newline.
+  std::string handle(const std::string &line);
+  void run();
+};
+
+WarmScene *Daemon::load(const std::string &name, const std::string &path, std::string &error) {
+  Clock::time_point start = Clock::now();
+  std::unique_ptr<WarmScene> warm(new WarmScene());
+  warm->path = path;
+  if (!warm->scene.load(path, options.use_cache)) {
+    error = "failed to load " + path;
+    return nullptr;
+  }
+  warm->raytracer.reset(
+      new Raytracer({0.0f, 0.0f, 0.0f}, warm->scene.getScene(), options.threads, warm->scene.getBVH()));
+  applyRenderOptions(*warm->raytracer, options);
+  warm->load_ms = msSince(start);
+  std::unique_ptr<WarmScene> &slot = scenes[name];
+  slot = std::move(warm);
+  return slot.get();
+}
+
+std::string Daemon::render(const std::vector<std::string> &words) {
+  Clock::time_point start = Clock::now();
+  if (words.size() < 2) { return errorReply("render needs a scene"); }
+
+  float theta = 0.0f;
+  float time = 0.0f;
+  int width = WIDTH;
+  int height = HEIGHT;
+  std::string output;
+  for (size_t i = 2; i < words.size(); i++) {
+    size_t equals = words[i].find('=');
+    std::string key = words[i].substr(0, equals);
+    std::string value = equals == std::string::npos ? "" : words[i].substr(equals + 1);
+    if (key == "theta") {
+      theta = (float)atof(value.c_str());
+    } else if (key == "time") {
+      time = (float)atof(value.c_str());
+    } else if (key == "width") {
+      width = atoi(value.c_str());
+    } else if (key == "height") {
+      height = atoi(value.c_str());
+    } else if (key == "output") {
+      output = value;
+    } else {
+      return errorReply("unknown render parameter " + words[i]);
+    }
+  }
+  if (width < 1 || height < 1 || (long long)width * height > MAX_PIXELS) {
+    return errorReply("bad image size " + std::to_string(width) + "x" + std::to_string(height));
+  }
+
+  const std::string &name = words[1];
+  auto found = scenes.find(name);
+  WarmScene *warm = found == scenes.end() ? nullptr : found->second.get();
+  bool loaded = warm == nullptr;
+  if (loaded) {
+    std::string error;
+    warm = load(name, name, error);
+    if (warm == nullptr) { return errorReply(error); }
+  }
+
+  // From here to the first ray is all a warm scene costs before tracing.
+  Clock::time_point setup_start = Clock::now();
+  Raytracer &raytracer = *warm->raytracer;
+  double update_ms = 0.0;
+  CompiledScene *compiled = warm->scene.getScene();
+  if (compiled->animated() && (!warm->moved || time != warm->time)) {
+    Clock::time_point update_start = Clock::now();
+    compiled->animate(time);
+    raytracer.updateScene();
+    warm->moved = true;
+    warm->time = time;
+    update_ms = msSince(update_start);
+  }
+  raytracer.setTheta(theta);
+  // The frame is only reallocated for a larger image than it has held.
+  frame.reshape(width, height, 0, height);
+  double setup_ms = msSince(setup_start);
+
+  Clock::time_point render_start = Clock::now();
+  uint64_t primary_before = raytracer.rayStats().primary;
+  raytracer.render(frame);
+  double render_ms = msSince(render_start);
+
+  double write_ms = 0.0;
+  if (!output.empty()) {
+    Clock::time_point write_start = Clock::now();
+    if (!writeImage(frame, output)) { return errorReply("failed to write " + output); }
+    write_ms = msSince(write_start);
+  }
+  warm->renders++;
+
+  std::ostringstream reply;
+  reply << "{\"ok\": true, \"scene\": " << jsonString(name) << ", \"width\": " << width << ", \"height\": " << height
+        << ", \"theta\": " << theta << ", \"loaded\": " << (loaded ? "true" : "false")
+        << ", \"load_ms\": " << (loaded ? warm->load_ms : 0.0) << ", \"update_ms\": " << update_ms
+        << ", \"setup_ms\": " << setup_ms << ", \"render_ms\": " << render_ms
+        << ", \"write_ms\": " << write_ms << ", \"total_ms\": " << msSince(start) << ", \"samples_per_pixel\": "
+        << (raytracer.rayStats().primary - primary_before) / ((double)width * height);
+  if (!output.empty()) { reply << ", \"output\": " << jsonString(output); }
+  reply << "}";
+  return reply.str();
+}
+
+std::string Daemon::list() const {
+  std::ostringstream reply;
+  reply << "{\"ok\": true, \"scenes\": [";
+  bool first = true;
+  for (const auto &entry : scenes) {
+    const WarmScene &warm = *entry.second;
+    const CompiledScene *compiled = warm.scene.getScene();
+    reply << (first ? "" : ", ") << "{\"name\": " << jsonString(entry.first) << ", \"path\": "
+          << jsonString(warm.path) << ", \"spheres\": " << compiled->sphereCount() << ", \"triangles\": "
+          << compiled->triangleCount() << ", \"cached\": " << (warm.scene.fromCache() ? "true" : "false")
+          << ", \"load_ms\": " << warm.load_ms << ", \"renders\": " << warm.renders << "}";
+    first = false;
+  }
+  reply << "]}";
+  return reply.str();
+}
+
+std::string Daemon::handle(const std::string &line) {
+  std::vector<std::string> words;
+  std::istringstream stream(line);
+  std::string word;
+  while (stream >> word) {
+    words.push_back(word);
+  }
+  if (words.empty()) { return errorReply("empty request"); }
+
+  const std::string &command = words[0];
+  if (command == "render") { return render(words); }
+  if (command == "load" && words.size() == 3) {
+    std::string error;
+    WarmScene *warm = load(words[1], words[2], error);
+    if (warm == nullptr) { return errorReply(error); }
+    std::ostringstream reply;
+    reply << "{\"ok\": true, \"scene\": " << jsonString(words[1]) << ", \"load_ms\": " << warm->load_ms << "}";
+    return reply.str();
+  }
+  if (command == "unload" && words.size() == 2) {
+    if (scenes.erase(words[1]) == 0) { return errorReply("no scene " + words[1]); }
+    return "{\"ok\": true}";
+  }
+  if (command == "list" && words.size() == 1) { return list(); }
+  if (command == "shutdown" && words.size() == 1) {
+    stopping = true;
+    return "{\"ok\": true}";
+  }
+  return errorReply("bad request: " + line);
+}
+
+void Daemon::run() {
+  // Requests are handled one at a time, in the order their lines arrive;
+  // each render already uses every thread.
+  std::vector<char> buffer(4096);
+  while (!stopping) {
+    std::vector<pollfd> fds(clients.size() + 1);
+    fds[0] = {listener.handle(), POLLIN, 0};
+    for (size_t i = 0; i < clients.size(); i++) {
+      fds[i + 1] = {clients[i].connection.handle(), POLLIN, 0};
+    }
+    if (::poll(fds.data(), fds.size(), -1) <= 0) { continue; }
+
+    for (size_t i = clients.size(); i-- > 0 && !stopping;) {
+      if (fds[i + 1].revents == 0) { continue; }
+      Client &client = clients[i];
+      long received = client.connection.receiveSome(buffer.data(), buffer.size());
+      if (received <= 0) {
+        clients.erase(clients.begin() + i);
+        continue;
+      }
+      client.input.append(buffer.data(), (size_t)received);
+      size_t newline;
+      bool open = true;
+      while (open && (newline = client.input.find('\n')) != std::string::npos) {
+        std::string line = client.input.substr(0, newline);
+        client.input.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+        std::string reply = handle(line) + "\n";
+        open = client.connection.send(reply.data(), reply.size());
+      }
+      if (!open) { clients.erase(clients.begin() + i); }
+    }
+    if (fds[0].revents & POLLIN) {
+      Connection connection;
+      while ((connection = listener.accept()).isOpen()) {
+        clients.push_back(Client());
+        clients.back().connection = std::move(connection);
+      }
+    }
+  }
+}
+
+void usage(const char *program) {
+  std::cout << "Usage: " << program << " unix:<socket path> [--load NAME SCENE]... " << RENDER_OPTIONS_USAGE
+            << std::endl;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2 || strncmp(argv[1], "unix:", 5) != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  RenderOptions options;
+  std::vector<std::pair<std::string, std::string>> preload;
+  for (int i = 2; i < argc; i++) {
+    if (parseRenderOption(argc, argv, i, options)) {
+      continue;
+    } else if (strcmp(argv[i], "--load") == 0 && i + 2 < argc) {
+      preload.push_back({argv[i + 1], argv[i + 2]});
+      i += 2;
+    } else {
+      std::cout << "Unknown option: " << argv[i] << std::endl;
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  Daemon daemon(options);
+  for (const auto &scene : preload) {
+    std::cout << daemon.handle("load " + scene.first + " " + scene.second) << std::endl;
+  }
+  if (!daemon.listen(argv[1])) { return 1; }
+  std::cout << "Listening on " << argv[1] << std::endl;
+  daemon.run();
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include "connection.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+const char UNIX_PREFIX[] = "unix:";
+
+bool isUnixAddress(const std::string &address) { return address.compare(0, strlen(UNIX_PREFIX), UNIX_PREFIX) == 0; }
+
+bool unixAddress(const std::string &address, sockaddr_un &result) {
+  std::string path = address.substr(strlen(UNIX_PREFIX));
+  memset(&result, 0, sizeof(result));
+  if (path.empty() || path.size() >= sizeof(result.sun_path)) {
+    std::cout << "Bad socket path in " << address << std::endl;
+    return false;
+  }
+  result.sun_family = AF_UNIX;
+  memcpy(result.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// TCP addresses of "host:port" or "port"; the caller frees the list.
+addrinfo *tcpAddresses(const std::string &address, bool listening) {
+  size_t colon = address.find_last_of(':');
+  std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+  std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (listening) { hints.ai_flags = AI_PASSIVE; }
+  addrinfo *result = nullptr;
+  int error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+  if (error != 0) {
+    std::cout << "Bad address " << address << ": " << gai_strerror(error) << std::endl;
+    return nullptr;
+  }
+  return result;
+}
+
+// Results go out tile by tile, each as soon as it is done.
+void disableNagle(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+}  // namespace
+
+Connection &Connection::operator=(Connection &&other) {
+  if (this != &other) {
+    close();
+    fd = other.fd;
+    other.fd = -1;
+  }
+  return *this;
+}
+
+Connection::~Connection() { close(); }
+
+void Connection::close() {
+  if (fd >= 0) { ::close(fd); }
+  fd = -1;
+}
+
+bool Connection::open(const std::string &address, double timeout_seconds) {
+  close();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout_seconds);
+  while (true) {
+    if (isUnixAddress(address)) {
+      sockaddr_un target;
+      if (!unixAddress(address, target)) { return false; }
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, (const sockaddr *)&target, sizeof(target)) == 0) { return true; }
+      close();
+    } else {
+      addrinfo *addresses = tcpAddresses(address, false);
+      if (addresses == nullptr) { return false; }
+      for (addrinfo *a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) { close(); }
+      }
+      freeaddrinfo(addresses);
+      if (fd >= 0) {
+        disableNagle(fd);
+        return true;
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      std::cout << "Failed to connect to " << address << std::endl;
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+void Connection::setReceiveTimeout(double seconds) {
+  timeval timeout;
+  timeout.tv_sec = (time_t)seconds;
+  timeout.tv_usec = (suseconds_t)((seconds - (double)timeout.tv_sec) * 1e6);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+bool Connection::send(const void *data, size_t size) {
+  const char *bytes = (const char *)data;
+  while (size > 0) {
+    // A worker that has gone must not kill the coordinator with SIGPIPE.
+    ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) { continue; }
+    if (sent <= 0) { return false; }
+    bytes += sent;
+    size -= (size_t)sent;
+  }
+  return true;
+}
+
+bool Connection::receive(void *data, size_t size) {
+  char *bytes = (char *)data;
+  while (size > 0) {
+    ssize_t received = ::recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) { continue; }
+    if (received <= 0) { return false; }
+    bytes += received;
+    size -= (size_t)received;
+  }
+  return true;
+}
+
+long Connection::receiveSome(void *data, size_t size) {
+  while (true) {
+    ssize_t received = ::recv(fd, data, size, 0);
+    if (received < 0 && errno == EINTR) { continue; }
+    return (long)received;
+  }
+}
+
+Listener::~Listener() { close(); }
+
+void Listener::close() {
+  if (fd >= 0) { ::close(fd); }
+  if (!unix_path.empty()) { unlink(unix_path.c_str()); }
+  fd = -1;
+  unix_path.clear();
+}
+
+bool Listener::open(const std::string &address) {
+  close();
+  if (isUnixAddress(address)) {
+    sockaddr_un local;
+    if (!unixAddress(address, local)) { return false; }
+    // A socket file left behind by an earlier run would make bind() fail.
+    unlink(local.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (const sockaddr *)&local, sizeof(local)) == 0) {
+      unix_path = local.sun_path;
+    } else if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  } else {
+    addrinfo *addresses = tcpAddresses(address, true);
+    if (addresses == nullptr) { return false; }
+    for (addrinfo *a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd < 0) { continue; }
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (bind(fd, a->ai_addr, a->ai_addrlen) != 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+  }
+
+  if (fd < 0 || listen(fd, 64) != 0) {
+    std::cout << "Failed to listen on " << address << ": " << strerror(errno) << std::endl;
+    close();
+    return false;
+  }
+  // accept() is only called once poll() says a connection is waiting, but
+  // the client may give up in between.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+Connection Listener::accept() {
+  int client = ::accept(fd, nullptr, nullptr);
+  if (client < 0) { return Connection(); }
+  // Accepted sockets may inherit O_NONBLOCK; connections block.
+  fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);
+  if (!unix_path.empty()) { return Connection(client); }
+  disableNagle(client);
+  return Connection(client);
+}
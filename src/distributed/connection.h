@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Stream sockets between the processes of a distributed render. Addresses
+// are "unix:<path>" for a Unix domain socket, or "<host>:<port>" or just
+// "<port>" for TCP; a bare port listens on all interfaces and connects to
+// the local host.
+
+// Blocking, connected socket; closed when destroyed.
+class Connection {
+ private:
+  int fd = -1;
+
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+ public:
+  Connection() {}
+  explicit Connection(int fd) : fd(fd) {}
+  Connection(Connection &&other) : fd(other.fd) { other.fd = -1; }
+  Connection &operator=(Connection &&other);
+  ~Connection();
+
+  bool isOpen() const { return fd >= 0; }
+  int handle() const { return fd; }
+  void close();
+
+  // Connects to `address`, retrying for up to `timeout_seconds` while no one
+  // listens there yet.
+  bool open(const std::string &address, double timeout_seconds);
+  // Gives up on a receive() that has waited this long for the rest of a
+  // message, so a peer that hangs mid-message fails instead of blocking.
+  void setReceiveTimeout(double seconds);
+
+  // All `size` bytes, or false once the peer has gone or an error occurred.
+  bool send(const void *data, size_t size);
+  bool receive(void *data, size_t size);
+  // Whatever has arrived, up to `size` bytes, waiting for at least one:
+  // the byte count, 0 once the peer has closed, or -1 on an error.
+  long receiveSome(void *data, size_t size);
+};
+
+// Socket accepting Connections. A Unix socket's file is removed again when
+// the listener closes.
+class Listener {
+ private:
+  int fd = -1;
+  std::string unix_path;
+
+  Listener(const Listener &) = delete;
+  Listener &operator=(const Listener &) = delete;
+
+ public:
+  Listener() {}
+  ~Listener();
+
+  bool open(const std::string &address);
+  void close();
+  int handle() const { return fd; }
+  // The next pending connection; not open if there was none.
+  Connection accept();
+};
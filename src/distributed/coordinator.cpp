@@ -0,0 +1,250 @@
+#include "coordinator.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+
+namespace {
+// A worker has this long to send the rest of a message it has started.
+const double MESSAGE_TIMEOUT_SECONDS = 10.0;
+// Round trip below which no job counts as slow.
+const double MIN_SLOW_MS = 50.0;
+}  // namespace
+
+Coordinator::~Coordinator() {
+  MessageHeader quit = {PROTOCOL_MAGIC, MESSAGE_QUIT, 0};
+  for (Worker &worker : workers) {
+    worker.connection.send(&quit, sizeof(quit));
+  }
+}
+
+bool Coordinator::listen(const std::string &address) { return listener.open(address); }
+
+void Coordinator::acceptWorkers() {
+  while (true) {
+    Connection connection = listener.accept();
+    if (!connection.isOpen()) { return; }
+    connection.setReceiveTimeout(MESSAGE_TIMEOUT_SECONDS);
+    workers.push_back(Worker());
+    workers.back().connection = std::move(connection);
+  }
+}
+
+int Coordinator::readyWorkers() const {
+  int count = 0;
+  for (const Worker &worker : workers) {
+    if (worker.ready) { count++; }
+  }
+  return count;
+}
+
+std::vector<uint64_t> Coordinator::jobsDone() const {
+  std::vector<uint64_t> done;
+  for (const Worker &worker : workers) {
+    if (worker.ready) { done.push_back(worker.jobs_done); }
+  }
+  return done;
+}
+
+void Coordinator::dropWorker(size_t index, const char *reason) {
+  Worker &worker = workers[index];
+  if (worker.ready) {
+    std::cout << "Worker " << index << " " << reason << "; " << worker.jobs.size() << " jobs go to the others"
+              << std::endl;
+    report.lost_workers++;
+  }
+  // Its jobs of this frame go to the front of the queue unless another copy
+  // is still out.
+  for (const Outstanding &out : worker.jobs) {
+    if (out.frame != frame_number) { continue; }
+    Job &job = jobs[out.job];
+    job.copies--;
+    if (!job.done && job.copies == 0) {
+      queue.push_front(out.job);
+      report.reissued++;
+    }
+  }
+  workers.erase(workers.begin() + index);
+}
+
+bool Coordinator::handleMessage(Worker &worker, Frame *frame) {
+  MessageHeader header;
+  if (!worker.connection.receive(&header, sizeof(header)) || header.magic != PROTOCOL_MAGIC) { return false; }
+
+  if (header.type == MESSAGE_HELLO) {
+    HelloMessage hello;
+    if (worker.ready || header.size != sizeof(hello) || !worker.connection.receive(&hello, sizeof(hello))) {
+      return false;
+    }
+    if (hello.spheres != scene->sphereCount() || hello.triangles != scene->triangleCount() ||
+        hello.lights != scene->lightCount()) {
+      std::cout << "A worker with a different scene was turned away" << std::endl;
+      return false;
+    }
+    worker.ready = true;
+    worker.threads = hello.threads;
+    return true;
+  }
+
+  ResultMessage result;
+  if (!worker.ready || header.type != MESSAGE_RESULT || header.size < sizeof(result) ||
+      !worker.connection.receive(&result, sizeof(result))) {
+    return false;
+  }
+  auto out = std::find_if(worker.jobs.begin(), worker.jobs.end(), [&](const Outstanding &o) {
+    return o.frame == result.frame && o.job == result.job;
+  });
+  if (out == worker.jobs.end()) { return false; }
+
+  // Results of earlier frames are duplicates that lost the race; they are
+  // read and dropped.
+  bool current = result.frame == frame_number && frame != nullptr;
+  size_t pixel_bytes = header.size - sizeof(result);
+  if (pixel_bytes > Frame::bytesFor(JOB_SIZE, JOB_SIZE)) { return false; }
+  const Region &region = current ? jobs[result.job].region : result.region;
+  size_t row_bytes = (size_t)region.width() * Frame::CHANNELS * sizeof(uint16_t);
+  if (current && pixel_bytes != row_bytes * region.height()) { return false; }
+  pixels.resize(pixel_bytes / sizeof(uint16_t) + 1);
+  if (!worker.connection.receive(pixels.data(), pixel_bytes)) { return false; }
+
+  double ms = std::chrono::duration<double, std::milli>(Clock::now() - out->sent).count();
+  worker.jobs.erase(out);
+  worker.jobs_done++;
+  if (!current) { return true; }
+
+  Job &job = jobs[result.job];
+  job.copies--;
+  job_ms_total += ms;
+  job_ms_count++;
+  if (job.done) { return true; }
+  for (int y = 0; y < region.height(); y++) {
+    memcpy(frame->pixel(region.x0, region.y0 + y), &pixels[y * row_bytes / sizeof(uint16_t)], row_bytes);
+  }
+  job.done = true;
+  remaining--;
+  return true;
+}
+
+void Coordinator::poll(Frame *frame, int timeout_ms) {
+  std::vector<pollfd> fds(workers.size() + 1);
+  fds[0] = {listener.handle(), POLLIN, 0};
+  for (size_t i = 0; i < workers.size(); i++) {
+    fds[i + 1] = {workers[i].connection.handle(), POLLIN, 0};
+  }
+  if (::poll(fds.data(), fds.size(), timeout_ms) <= 0) { return; }
+
+  // Backwards, so dropping a worker leaves the indices still to visit.
+  for (size_t i = workers.size(); i-- > 0;) {
+    if (fds[i + 1].revents == 0) { continue; }
+    if (!handleMessage(workers[i], frame)) { dropWorker(i, "disconnected"); }
+  }
+  if (fds[0].revents & POLLIN) { acceptWorkers(); }
+}
+
+bool Coordinator::sendJob(Worker &worker, uint32_t job, float theta, float time) {
+  MessageHeader header = {PROTOCOL_MAGIC, MESSAGE_JOB, sizeof(JobMessage)};
+  JobMessage message = {frame_number, job, image_width, image_height, theta, time, jobs[job].region};
+  char buffer[sizeof(header) + sizeof(message)];
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &message, sizeof(message));
+  if (!worker.connection.send(buffer, sizeof(buffer))) { return false; }
+  worker.jobs.push_back({frame_number, job, Clock::now()});
+  jobs[job].copies++;
+  return true;
+}
+
+bool Coordinator::slowJob(const Worker &worker, uint32_t &job) const {
+  if (job_ms_count == 0) { return false; }
+  double slow_ms = std::max(MIN_SLOW_MS, SLOW_FACTOR * job_ms_total / job_ms_count);
+  Clock::time_point now = Clock::now();
+  // The oldest job of this frame that only one worker has and that is
+  // overdue.
+  bool found = false;
+  Clock::time_point oldest = now;
+  for (const Worker &other : workers) {
+    if (&other == &worker) { continue; }
+    for (const Outstanding &out : other.jobs) {
+      if (out.frame != frame_number || jobs[out.job].done || jobs[out.job].copies != 1) { continue; }
+      double age_ms = std::chrono::duration<double, std::milli>(now - out.sent).count();
+      if (age_ms > slow_ms && out.sent < oldest) {
+        oldest = out.sent;
+        job = out.job;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+void Coordinator::dispatch(float theta, float time) {
+  for (size_t i = workers.size(); i-- > 0;) {
+    Worker &worker = workers[i];
+    if (!worker.ready) { continue; }
+    while (worker.jobs.size() < JOBS_IN_FLIGHT) {
+      uint32_t job;
+      bool duplicate = false;
+      if (!queue.empty()) {
+        job = queue.front();
+        queue.pop_front();
+        if (jobs[job].done) { continue; }
+      } else if (slowJob(worker, job)) {
+        duplicate = true;
+      } else {
+        break;
+      }
+      if (!sendJob(worker, job, theta, time)) {
+        if (!duplicate) { queue.push_front(job); }
+        dropWorker(i, "disconnected");
+        break;
+      }
+      if (duplicate) { report.reissued++; }
+    }
+  }
+}
+
+bool Coordinator::waitForWorkers(int count, double timeout_seconds) {
+  Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                                  std::chrono::duration<double>(timeout_seconds));
+  while (readyWorkers() < count) {
+    if (Clock::now() >= deadline) { return false; }
+    poll(nullptr, 100);
+  }
+  return true;
+}
+
+bool Coordinator::render(Frame &frame, float theta, float time, double timeout_seconds) {
+  frame_number++;
+  report = CoordinatorReport();
+  jobs.clear();
+  queue.clear();
+  image_width = (uint32_t)frame.width();
+  image_height = (uint32_t)frame.height();
+  int y1 = frame.firstRow() + frame.rows();
+  for (int y = frame.firstRow(); y < y1; y += JOB_SIZE) {
+    for (int x = 0; x < frame.width(); x += JOB_SIZE) {
+      Job job;
+      job.region = {x, y, std::min(x + JOB_SIZE, frame.width()), std::min(y + JOB_SIZE, y1)};
+      queue.push_back((uint32_t)jobs.size());
+      jobs.push_back(job);
+    }
+  }
+  remaining = (int)jobs.size();
+  report.jobs = remaining;
+
+  Clock::time_point idle_since = Clock::now();
+  while (remaining > 0) {
+    dispatch(theta, time);
+    if (readyWorkers() > 0) {
+      idle_since = Clock::now();
+    } else if (std::chrono::duration<double>(Clock::now() - idle_since).count() > timeout_seconds) {
+      std::cout << "No workers left with " << remaining << " jobs to go" << std::endl;
+      return false;
+    }
+    // Wakes up now and then to look for slow jobs.
+    poll(&frame, 20);
+  }
+  report.workers = readyWorkers();
+  return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "connection.h"
+#include "protocol.h"
+#include "raytracer/compiledscene.h"
+#include "renderer/renderer_types.h"
+
+// How a distributed frame went.
+struct CoordinatorReport {
+  int workers = 0;
+  int jobs = 0;
+  // Jobs handed out again: those of lost workers, and duplicates of jobs
+  // that were taking too long.
+  int reissued = 0;
+  int lost_workers = 0;
+};
+
+// Renders frames with worker processes (see runWorker) that have the same
+// scene loaded. Each frame is cut into JOB_SIZE squares, handed out a few
+// at a time per worker, and the returned pixels are put together in one
+// Frame. Workers may connect at any time, also during a frame. The jobs of
+// a worker that disconnects go back in the queue; once the queue is empty,
+// a job that has been out several times as long as jobs usually take is
+// also given to an idle worker, and whichever copy comes back first is used.
+class Coordinator {
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Outstanding {
+    uint32_t frame;
+    uint32_t job;
+    Clock::time_point sent;
+  };
+  struct Worker {
+    Connection connection;
+    bool ready = false;
+    uint32_t threads = 0;
+    std::vector<Outstanding> jobs;
+    uint64_t jobs_done = 0;
+  };
+  struct Job {
+    Region region;
+    int copies = 0;
+    bool done = false;
+  };
+
+  static const int JOB_SIZE = 64;
+  // Jobs queued on each worker, so it starts the next one while the last
+  // result is on its way.
+  static const size_t JOBS_IN_FLIGHT = 2;
+  // A job this many times slower than the average is given out again.
+  static const int SLOW_FACTOR = 4;
+
+  const CompiledScene *scene;
+  Listener listener;
+  std::vector<Worker> workers;
+  uint32_t frame_number = 0;
+  uint32_t image_width = 0;
+  uint32_t image_height = 0;
+  std::vector<Job> jobs;
+  std::deque<uint32_t> queue;
+  int remaining = 0;
+  // Round trips of finished jobs, for telling slow ones.
+  double job_ms_total = 0.0;
+  uint64_t job_ms_count = 0;
+  // Pixels of the result being read.
+  std::vector<uint16_t> pixels;
+  CoordinatorReport report;
+
+  void acceptWorkers();
+  // Waits up to timeout_ms for messages and handles them into `frame`.
+  void poll(Frame *frame, int timeout_ms);
+  bool handleMessage(Worker &worker, Frame *frame);
+  void dispatch(float theta, float time);
+  bool sendJob(Worker &worker, uint32_t job, float theta, float time);
+  // A job to run a second time on `worker`, or false.
+  bool slowJob(const Worker &worker, uint32_t &job) const;
+  void dropWorker(size_t index, const char *reason);
+  int readyWorkers() const;
+
+ public:
+  explicit Coordinator(const CompiledScene *scene) : scene(scene) {}
+  // Tells all workers to quit.
+  ~Coordinator();
+
+  bool listen(const std::string &address);
+  // Waits until `count` workers have connected and said hello; false after
+  // timeout_seconds.
+  bool waitForWorkers(int count, double timeout_seconds);
+  // Renders the rows the frame holds at `theta` and scene time `time` with
+  // the workers.
+  // False if there have been no workers for timeout_seconds.
+  bool render(Frame &frame, float theta, float time, double timeout_seconds);
+  const CoordinatorReport &lastReport() const { return report; }
+  // Jobs each connected worker has finished so far.
+  std::vector<uint64_t> jobsDone() const;
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+
+#include "raytracer/raytracer.h"
+
+// Messages between a coordinator and its workers. Every message is a
+// MessageHeader followed by `size` bytes of body. Both ends run the same
+// binary, so bodies are the structs below in native layout; the magic
+// number catches anything else connecting.
+const uint32_t PROTOCOL_MAGIC = 0x32545452;  // "RTT2"
+
+enum MessageType : uint32_t {
+  // Worker -> coordinator, once after connecting: HelloMessage.
+  MESSAGE_HELLO = 1,
+  // Coordinator -> worker: JobMessage.
+  MESSAGE_JOB = 2,
+  // Worker -> coordinator: ResultMessage, then the job region's pixels row
+  // by row as RGBA16F, like Frame stores them.
+  MESSAGE_RESULT = 3,
+  // Coordinator -> worker: no body; the worker exits.
+  MESSAGE_QUIT = 4
+};
+
+struct MessageHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t size;
+};
+
+// What the worker loaded, so a worker with a different scene is turned away.
+struct HelloMessage {
+  uint32_t spheres;
+  uint32_t triangles;
+  uint32_t lights;
+  uint32_t threads;
+};
+
+// One region of one frame. Jobs are numbered within their frame.
+struct JobMessage {
+  uint32_t frame;
+  uint32_t job;
+  // Size of the whole image the region is part of.
+  uint32_t width;
+  uint32_t height;
+  float theta;
+  // Scene time for animated scenes.
+  float time;
+  Region region;
+};
+
+struct ResultMessage {
+  uint32_t frame;
+  uint32_t job;
+  Region region;
+  // Time the worker spent rendering the job.
+  float render_ms;
+};
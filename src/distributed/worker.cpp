@@ -0,0 +1,90 @@
+#include "worker.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "connection.h"
+#include "protocol.h"
+
+namespace {
+// Workers are often started before their coordinator listens.
+const double CONNECT_TIMEOUT_SECONDS = 30.0;
+
+// Larger images than this are surely a garbled message.
+const uint32_t MAX_IMAGE_SIZE = 1 << 16;
+
+bool validJob(const JobMessage &job) {
+  const Region &region = job.region;
+  return job.width <= MAX_IMAGE_SIZE && job.height <= MAX_IMAGE_SIZE && region.x0 >= 0 && region.y0 >= 0 &&
+         region.x1 <= (int)job.width && region.y1 <= (int)job.height && region.width() > 0 && region.height() > 0;
+}
+}  // namespace
+
+bool runWorker(const std::string &address, CompiledScene *scene, Raytracer &raytracer) {
+  Connection connection;
+  if (!connection.open(address, CONNECT_TIMEOUT_SECONDS)) { return false; }
+
+  MessageHeader header = {PROTOCOL_MAGIC, MESSAGE_HELLO, sizeof(HelloMessage)};
+  HelloMessage hello = {scene->sphereCount(), scene->triangleCount(), scene->lightCount(),
+                        (uint32_t)raytracer.threadCount()};
+  if (!connection.send(&header, sizeof(header)) || !connection.send(&hello, sizeof(hello))) {
+    std::cout << "Lost the coordinator at " << address << std::endl;
+    return false;
+  }
+
+  // Holds just the rows of the current job.
+  Frame frame(0, 0);
+  bool animated = scene->animated();
+  bool moved = false;
+  float scene_time = 0.0f;
+  std::vector<char> message;
+  while (true) {
+    if (!connection.receive(&header, sizeof(header)) || header.magic != PROTOCOL_MAGIC) {
+      std::cout << "Lost the coordinator at " << address << std::endl;
+      return false;
+    }
+    if (header.type == MESSAGE_QUIT) { return true; }
+
+    JobMessage job;
+    if (header.type != MESSAGE_JOB || header.size != sizeof(job) || !connection.receive(&job, sizeof(job)) ||
+        !validJob(job)) {
+      std::cout << "Bad message from the coordinator at " << address << std::endl;
+      return false;
+    }
+
+    if (animated && (!moved || job.time != scene_time)) {
+      scene->animate(job.time);
+      raytracer.updateScene();
+      moved = true;
+      scene_time = job.time;
+    }
+    auto start = std::chrono::steady_clock::now();
+    frame.reshape((int)job.width, (int)job.height, job.region.y0, job.region.height());
+    raytracer.setTheta(job.theta);
+    raytracer.render(frame, job.region);
+
+    // The whole result goes out in one send.
+    const Region &region = job.region;
+    size_t row_bytes = (size_t)region.width() * Frame::CHANNELS * sizeof(uint16_t);
+    size_t pixel_bytes = row_bytes * region.height();
+    ResultMessage result = {job.frame, job.job, region, 0.0f};
+    result.render_ms = (float)std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    header = {PROTOCOL_MAGIC, MESSAGE_RESULT, (uint32_t)(sizeof(result) + pixel_bytes)};
+    message.resize(sizeof(header) + sizeof(result) + pixel_bytes);
+    char *out = message.data();
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, &result, sizeof(result));
+    out += sizeof(result);
+    for (int y = region.y0; y < region.y1; y++) {
+      memcpy(out, frame.pixel(region.x0, y), row_bytes);
+      out += row_bytes;
+    }
+    if (!connection.send(message.data(), message.size())) {
+      std::cout << "Lost the coordinator at " << address << std::endl;
+      return false;
+    }
+  }
+}
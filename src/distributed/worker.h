@@ -0,0 +1,11 @@
+#pragma once
+#include <string>
+
+#include "raytracer/compiledscene.h"
+#include "raytracer/raytracer.h"
+
+// Connects to the coordinator at `address` and renders the jobs it sends
+// with `raytracer` until it says to quit. Animated scenes are moved to each
+// job's time first. False if the coordinator could not be reached or went
+// away without saying so.
+bool runWorker(const std::string &address, CompiledScene *scene, Raytracer &raytracer);
@@ -0,0 +1,498 @@
+// Offline renderer for machines without a display: renders one frame or a
+// theta sweep and writes the images to disk. Links no graphics libraries.
+// Frames are written on a thread of their own while the next ones trace;
+// with --batch N, N frames of a sweep trace at once. With --band N, images
+// are traced and written N rows at a time, so an image of any size needs
+// memory for two bands only.
+// With --write-cache it also compiles the scene into <scene>.bin, which every
+// front end then loads instead of parsing the text. Animated scenes advance
+// by --time-step per frame from --time, and each frame reports how the BVH
+// followed the motion.
+//
+// --cost-map METRIC also records what each pixel cost to trace and writes it
+// next to each image: <image>.cost.png shows METRIC (tests, rays or time) in
+// false color, <image>.cost.pfm holds all three as floats.
+//
+// Builds configured with RAYTRACER_PROFILE also take --profile FILE, for
+// per-frame counters and timers as JSON, and --trace FILE, for the same as
+// Chrome trace events.
+//
+// With --listen the frames are rendered by worker processes instead: copies
+// of this program started with --worker and the same scene, on this machine
+// (--spawn N starts them) or on others.
+#include "image/imagewriter.h"
+#include "raytracer/raytracer.h"
+#include "raytracer/renderoptions.h"
+#include "raytracer/scenecache.h"
+#include "renderer/framequeue.h"
+
+#ifndef _WIN32
+#include "distributed/coordinator.h"
+#include "distributed/worker.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+// Widest frame number a pattern may ask for.
+const int MAX_FRAME_DIGITS = 64;
+
+// Expands a frame number in an output pattern: "%d", optionally with a 0
+// flag and a width, e.g. "out_%03d.png"; "%%" stands for a '%'. Returns
+// false if the pattern has any other conversion or more than one number.
+// `has_number` tells whether it had one.
+bool expandFramePattern(const std::string &pattern, int frame, std::string &expanded, bool &has_number) {
+  expanded.clear();
+  has_number = false;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] != '%') {
+      expanded += pattern[i];
+      continue;
+    }
+    if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+      expanded += '%';
+      i++;
+      continue;
+    }
+    size_t end = i + 1;
+    bool zero = end < pattern.size() && pattern[end] == '0';
+    if (zero) { end++; }
+    int width = 0;
+    for (; end < pattern.size() && pattern[end] >= '0' && pattern[end] <= '9'; end++) {
+      width = std::min(width * 10 + (pattern[end] - '0'), MAX_FRAME_DIGITS + 1);
+    }
+    if (end == pattern.size() || pattern[end] != 'd' || width > MAX_FRAME_DIGITS || has_number) { return false; }
+    char number[MAX_FRAME_DIGITS + 16];
+    snprintf(number, sizeof(number), zero ? "%0*d" : "%*d", width, frame);
+    expanded += number;
+    has_number = true;
+    i = end;
+  }
+  return true;
+}
+
+// A frame number in the pattern (see expandFramePattern, which must accept
+// it) is filled in; otherwise sweeps get "_0000", "_0001", ... before the
+// extension.
+std::string frameFilename(const std::string &pattern, int frame, bool numbered) {
+  if (!numbered) { return pattern; }
+
+  std::string filename;
+  bool has_number;
+  expandFramePattern(pattern, frame, filename, has_number);
+  if (has_number) { return filename; }
+
+  char buffer[32];
+  size_t dot = filename.find_last_of('.');
+  size_t slash = filename.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) { dot = filename.size(); }
+  snprintf(buffer, sizeof(buffer), "_%04d", frame);
+  return filename.substr(0, dot) + buffer + filename.substr(dot);
+}
+
+// The pattern with its extension replaced by `format`.
+std::string withFormat(const std::string &pattern, const std::string &format) {
+  size_t dot = pattern.find_last_of('.');
+  size_t slash = pattern.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) { dot = pattern.size(); }
+  return pattern.substr(0, dot) + "." + format;
+}
+
+void usage(const char *program) {
+  std::cout << "Usage: " << program << " <config file> [-o <image.png|.ppm|.pfm>] [--format png|ppm|pfm]"
+            << " [--width W] [--height H] [--band ROWS]"
+            << " [--theta DEG] [--frames N] [--first N] [--theta-step DEG] [--time T] [--time-step T] [--batch N]"
+            << " [--write-cache] [--cost-map tests|rays|time] [--profile FILE.json] [--trace FILE.json]"
+            << " [--listen ADDRESS [--spawn N] [--workers N]] [--worker ADDRESS] " << RENDER_OPTIONS_USAGE << std::endl;
+  std::cout << "ADDRESS is unix:<path>, <host>:<port> or <port>" << std::endl;
+}
+
+#ifndef _WIN32
+// Seconds a coordinator waits for workers before giving up.
+const double WORKER_TIMEOUT_SECONDS = 30.0;
+
+// Starts `count` workers for a coordinator at `address`: this program
+// again, with the same scene and tracing options. Unless told otherwise
+// they split the cores between them.
+std::vector<pid_t> spawnWorkers(const char *program, const char *scene, const std::string &address, int count,
+                                std::vector<std::string> render_args, bool threads_given) {
+  std::vector<pid_t> children;
+  if (count == 0) { return children; }
+  if (!threads_given) {
+    int cores = (int)std::thread::hardware_concurrency();
+    render_args.push_back("--threads");
+    render_args.push_back(std::to_string(std::max(1, cores / count)));
+  }
+  std::vector<std::string> args = {program, scene, "--worker", address};
+  args.insert(args.end(), render_args.begin(), render_args.end());
+  std::vector<char *> argv;
+  for (std::string &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  for (int i = 0; i < count; i++) {
+    pid_t child = fork();
+    if (child == 0) {
+      execv(program, argv.data());
+      _exit(127);
+    }
+    if (child > 0) { children.push_back(child); }
+  }
+  return children;
+}
+#endif
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  RenderOptions options;
+  std::string output;
+  float theta = 0.0f;
+  float theta_step = 1.0f;
+  float time = 0.0f;
+  float time_step = 1.0f / 24.0f;
+  int frames = 1;
+  // Number of the first frame of the sweep, so a range of it can be
+  // rendered on its own.
+  int first_frame = 0;
+  int batch = 1;
+  std::string format;
+  int width = WIDTH;
+  int height = HEIGHT;
+  // Rows traced and written at a time; 0 for whole images.
+  int band = 0;
+  bool write_cache = false;
+  std::string cost_metric_name;
+  std::string profile_output;
+  std::string trace_output;
+  std::string listen_address;
+  std::string worker_address;
+  int spawn = 0;
+  int wait_for = 0;
+  // Tracing options as given, for spawned workers.
+  std::vector<std::string> render_args;
+  bool threads_given = false;
+  for (int i = 2; i < argc; i++) {
+    int first = i;
+    if (parseRenderOption(argc, argv, i, options)) {
+      render_args.insert(render_args.end(), argv + first, argv + i + 1);
+      threads_given = threads_given || strcmp(argv[first], "--threads") == 0;
+      continue;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) {
+      theta = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--theta-step") == 0 && i + 1 < argc) {
+      theta_step = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+      time = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--time-step") == 0 && i + 1 < argc) {
+      time_step = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--first") == 0 && i + 1 < argc) {
+      first_frame = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      format = argv[++i];
+    } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+      width = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+      height = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--band") == 0 && i + 1 < argc) {
+      band = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--write-cache") == 0) {
+      write_cache = true;
+    } else if (strcmp(argv[i], "--cost-map") == 0 && i + 1 < argc) {
+      cost_metric_name = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_output = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_output = argv[++i];
+    } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      listen_address = argv[++i];
+    } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+      worker_address = argv[++i];
+    } else if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc) {
+      spawn = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      wait_for = atoi(argv[++i]);
+    } else {
+      std::cout << "Unknown option: " << argv[i] << std::endl;
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  bool distributed = !listen_address.empty() || !worker_address.empty();
+  if ((output.empty() && !write_cache && worker_address.empty()) || frames < 1 || first_frame < 0 || batch < 1 ||
+      width < 1 || height < 1 || band < 0 ||
+      spawn < 0 || (spawn > 0 && listen_address.empty()) ||
+      !(format.empty() || format == "png" || format == "ppm" || format == "pfm")) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!format.empty() && !output.empty()) { output = withFormat(output, format); }
+  bool numbered = frames > 1 || first_frame > 0;
+  std::string first_filename;
+  bool has_number;
+  if (numbered && !expandFramePattern(output, first_frame, first_filename, has_number)) {
+    std::cout << "Output pattern " << output << " may only hold one %d, %0Nd or %Nd and %%" << std::endl;
+    return 1;
+  }
+  bool record_costs = !cost_metric_name.empty();
+  CostMetric cost_metric = COST_TIME;
+  if (record_costs && !CostMap::metricFor(cost_metric_name, cost_metric)) { return 1; }
+  bool profiling = !profile_output.empty() || !trace_output.empty();
+  if (profiling && !PROFILE_ENABLED) {
+    std::cout << "This build has no profiling; configure with -DRAYTRACER_PROFILE=ON" << std::endl;
+    return 1;
+  }
+  Profiler::instance().keepEvents(!trace_output.empty());
+#ifdef _WIN32
+  if (distributed) {
+    std::cout << "Distributed rendering needs POSIX sockets" << std::endl;
+    return 1;
+  }
+#endif
+
+  // The cache is always rebuilt from the text when asked for.
+  LoadedScene scene;
+  if (!scene.load(argv[1], options.use_cache && !write_cache)) {
+    std::cout << "Failed to parse file" << std::endl;
+    return 1;
+  }
+
+#ifndef _WIN32
+  if (!worker_address.empty()) {
+    Raytracer raytracer({0.0f, 0.0f, 0.0f}, scene.getScene(), options.threads, scene.getBVH());
+    applyRenderOptions(raytracer, options);
+    return runWorker(worker_address, scene.getScene(), raytracer) ? 0 : 1;
+  }
+
+  // The coordinator only puts frames together; all tracing happens in the
+  // workers.
+  std::unique_ptr<Coordinator> coordinator;
+  std::vector<pid_t> children;
+  if (!listen_address.empty()) {
+    coordinator.reset(new Coordinator(scene.getScene()));
+    if (!coordinator->listen(listen_address)) { return 1; }
+    children = spawnWorkers(argv[0], argv[1], listen_address, spawn, render_args, threads_given);
+    int workers = std::max(1, wait_for > 0 ? wait_for : spawn);
+    std::cout << "Waiting for " << workers << " workers on " << listen_address << std::endl;
+    if (!coordinator->waitForWorkers(workers, WORKER_TIMEOUT_SECONDS)) {
+      std::cout << "Workers failed to connect" << std::endl;
+      return 1;
+    }
+  }
+#endif
+
+  Raytracer raytracer({0.0f, 0.0f, 0.0f}, scene.getScene(), distributed ? 1 : options.threads, scene.getBVH());
+  applyRenderOptions(raytracer, options);
+
+  if (write_cache) {
+    std::string path = SceneCache::pathFor(argv[1]);
+    if (!SceneCache::write(path, argv[1], *scene.getScene(), &raytracer.getBVH())) { return 1; }
+    std::cout << "Wrote " << path << std::endl;
+    if (output.empty()) { return 0; }
+  }
+
+  // The cache is written before any animation, so it holds the scene as
+  // parsed. Workers animate their own copies.
+  CompiledScene *compiled = scene.getScene();
+  bool animated = compiled->animated() && !distributed;
+
+  // Frames of a batch share the scene, so they must all see it at one time.
+  int band_rows = band > 0 ? std::min(band, height) : height;
+  if (batch > 1 && (animated || distributed || band_rows < height)) {
+    std::cout << "Animated, distributed and banded renders go one frame at a time" << std::endl;
+    batch = 1;
+  }
+  // Cost maps are kept whole, and workers do not send theirs.
+  if (record_costs && (distributed || band_rows < height)) {
+    std::cout << "Cost maps need whole frames traced here; leave out --band and --listen" << std::endl;
+    return 1;
+  }
+
+  // Finished frames, or bands of a frame, go to a writer thread, which hands
+  // each buffer back once it is on disk, so there are never more than two
+  // batches of them in memory and tracing only waits for the disk when it
+  // is a batch ahead.
+  int parts = frames * ((height + band_rows - 1) / band_rows);
+  std::vector<Frame> buffers(std::min(2 * batch, parts), Frame(width, height, 0, band_rows));
+  std::vector<CostMap> cost_maps(record_costs ? buffers.size() : 0, CostMap(width, height));
+  std::vector<int> frame_numbers(buffers.size());
+  // What to print after the file name once the frame is written.
+  std::vector<std::string> reports(buffers.size());
+  FrameQueue free_buffers;
+  FrameQueue finished;
+  for (int buffer = 0; buffer < (int)buffers.size(); buffer++) {
+    free_buffers.push(buffer);
+  }
+  std::atomic<bool> write_failed(false);
+  std::thread writer([&]() {
+    ImageStream stream;
+    Frame heatmap(width, height);
+    int buffer;
+    // A negative buffer marks the end of the sweep.
+    while (finished.pop(buffer) && buffer >= 0) {
+      const Frame &part = buffers[buffer];
+      if (!write_failed) {
+        std::string filename = frameFilename(output, frame_numbers[buffer], numbered);
+        PROFILE_SCOPE("write image");
+        bool written = (part.firstRow() > 0 || stream.open(filename, width, height)) && stream.write(part);
+        bool last = part.firstRow() + part.rows() == height;
+        if (last) { written = stream.close() && written; }
+        if (written && record_costs) {
+          cost_maps[buffer].heatmap(cost_metric, heatmap);
+          written = writeImage(heatmap, withFormat(filename, "cost.png")) &&
+                    writeCostMap(cost_maps[buffer], withFormat(filename, "cost.pfm"));
+        }
+        if (!written) {
+          std::cout << "Failed to write " << filename << std::endl;
+          write_failed = true;
+        } else if (last) {
+          std::cout << filename << " (" << reports[buffer] << ")" << std::endl;
+        }
+      }
+      free_buffers.push(buffer);
+    }
+  });
+
+  // Trace time of the first frame since the top level was last built, to
+  // show what refitting alone costs in tracing speed.
+  double built_trace_ms = 0.0;
+  std::vector<int> batch_buffers(batch);
+  std::vector<Frame *> batch_frames(batch);
+  std::vector<CostMap *> batch_costs(batch);
+  std::vector<float> batch_thetas(batch);
+  bool failed = false;
+  for (int i = 0; i < frames && !failed && !write_failed; i += batch) {
+    int count = std::min(batch, frames - i);
+    int frame_number = first_frame + i;
+    for (int k = 0; k < count; k++) {
+      batch_thetas[k] = theta + theta_step * (frame_number + k);
+    }
+    float frame_time = time + time_step * frame_number;
+    if (profiling) {
+      Profiler::instance().beginFrame(frame_number, count);
+      raytracer.resetRayStats();
+    }
+    SceneUpdate update;
+    if (animated) {
+      compiled->animate(frame_time);
+      update = raytracer.updateScene();
+    }
+
+    double ms = 0.0;
+    uint64_t primary_before = raytracer.rayStats().primary;
+    std::string distributed_info;
+    for (int y = 0; y < height && !failed && !write_failed; y += band_rows) {
+      int rows = std::min(band_rows, height - y);
+      for (int k = 0; k < count; k++) {
+        free_buffers.pop(batch_buffers[k]);
+        batch_frames[k] = &buffers[batch_buffers[k]];
+        batch_frames[k]->reshape(width, height, y, rows);
+        if (record_costs) { batch_costs[k] = &cost_maps[batch_buffers[k]]; }
+      }
+
+      auto start = std::chrono::steady_clock::now();
+#ifndef _WIN32
+      if (coordinator) {
+        batch_frames[0]->clear();
+        if (!coordinator->render(*batch_frames[0], batch_thetas[0], frame_time, WORKER_TIMEOUT_SECONDS)) {
+          failed = true;
+          break;
+        }
+        const CoordinatorReport &report = coordinator->lastReport();
+        distributed_info = ", " + std::to_string(report.workers) + " workers, " + std::to_string(report.jobs) +
+                           " jobs";
+        if (report.reissued > 0) { distributed_info += ", " + std::to_string(report.reissued) + " reissued"; }
+      }
+#endif
+      if (!distributed) {
+        for (int k = 0; k < count; k++) {
+          batch_frames[k]->clear();
+        }
+        if (record_costs) {
+          raytracer.renderBatch(batch_frames.data(), batch_thetas.data(), count, batch_costs.data());
+        } else {
+          raytracer.renderBatch(batch_frames.data(), batch_thetas.data(), count);
+        }
+      }
+      // A batch's time is shared out over its frames.
+      ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / count;
+
+      // The report goes with the last band, which is written last.
+      std::string report_text;
+      if (y + rows == height) {
+        if (i == 0 || update.rebuilt) { built_trace_ms = ms; }
+        std::ostringstream report;
+        report << ms << " ms" << distributed_info;
+        if (options.aa_samples > 1 && !distributed) {
+          double pixels = (double)width * height * count;
+          report << ", " << (raytracer.rayStats().primary - primary_before) / pixels << " samples per pixel";
+        }
+        if (record_costs) {
+          double tests = 0.0;
+          double rays = 0.0;
+          for (int k = 0; k < count; k++) {
+            tests += batch_costs[k]->total(COST_TESTS) / count;
+            rays += batch_costs[k]->total(COST_RAYS) / count;
+          }
+          report << ", " << (uint64_t)tests << " tests, " << (uint64_t)rays << " rays";
+        }
+        if (animated) {
+          report << ", t " << frame_time << ", refit " << update.refit_ms << " ms, SAH x" << update.degradation
+                 << ", trace x" << (built_trace_ms > 0.0 ? ms / built_trace_ms : 1.0);
+          if (update.rebuilt) { report << ", rebuilt top level in " << update.rebuild_ms << " ms"; }
+        }
+        report_text = report.str();
+      }
+      for (int k = 0; k < count; k++) {
+        frame_numbers[batch_buffers[k]] = frame_number + k;
+        reports[batch_buffers[k]] = report_text;
+        finished.push(batch_buffers[k]);
+      }
+    }
+    if (profiling) { Profiler::instance().endFrame(raytracer.rayStats()); }
+  }
+  finished.push(-1);
+  writer.join();
+  if (failed || write_failed) { return 1; }
+  if (!profile_output.empty() && !Profiler::instance().writeJSON(profile_output)) { return 1; }
+  if (!trace_output.empty() && !Profiler::instance().writeTrace(trace_output)) { return 1; }
+
+#ifndef _WIN32
+  if (coordinator) {
+    std::cout << "Jobs per worker:";
+    for (uint64_t jobs : coordinator->jobsDone()) {
+      std::cout << " " << jobs;
+    }
+    std::cout << std::endl;
+    // Tells the workers to quit.
+    coordinator.reset();
+  }
+  for (pid_t child : children) {
+    waitpid(child, nullptr, 0);
+  }
+#endif
+  return 0;
+}
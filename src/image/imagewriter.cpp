@@ -0,0 +1,261 @@
+#include "imagewriter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace {
+uint8_t toByte(float c) {
+  c = std::min(1.0f, std::max(0.0f, c));
+  return (uint8_t)(c * 255.0f + 0.5f);
+}
+
+void putBigEndian(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back((uint8_t)(value >> 24));
+  out.push_back((uint8_t)(value >> 16));
+  out.push_back((uint8_t)(value >> 8));
+  out.push_back((uint8_t)value);
+}
+
+uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0) {
+  static uint32_t table[256];
+  static bool initialized = false;
+  if (!initialized) {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    initialized = true;
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void writeChunk(std::ofstream &file, const char *type, const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> chunk;
+  putBigEndian(chunk, (uint32_t)data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  putBigEndian(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+  file.write((const char *)chunk.data(), chunk.size());
+}
+
+bool endsWith(const std::string &s, const std::string &suffix) {
+  if (s.size() < suffix.size()) { return false; }
+  for (size_t i = 0; i < suffix.size(); i++) {
+    if (tolower(s[s.size() - suffix.size() + i]) != suffix[i]) { return false; }
+  }
+  return true;
+}
+}  // namespace
+
+bool ImageStream::formatFor(const std::string &filename, Format &format) {
+  if (endsWith(filename, ".png")) {
+    format = PNG;
+  } else if (endsWith(filename, ".ppm")) {
+    format = PPM;
+  } else if (endsWith(filename, ".pfm")) {
+    format = PFM;
+  } else {
+    std::cout << "Unknown image format: " << filename << " (use .png, .ppm or .pfm)" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ImageStream::open(const std::string &filename, int width, int height) {
+  Format format;
+  return formatFor(filename, format) && open(filename, format, width, height);
+}
+
+bool ImageStream::open(const std::string &filename, Format format, int width, int height) {
+  this->format = format;
+  file.open(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cout << "File " << filename << " failed to open" << std::endl;
+    return false;
+  }
+  this->filename = filename;
+  this->width = width;
+  this->height = height;
+  next_row = 0;
+  adler_a = 1;
+  adler_b = 0;
+
+  if (format == PNG) {
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    file.write((const char *)signature, sizeof(signature));
+
+    std::vector<uint8_t> header;
+    putBigEndian(header, (uint32_t)width);
+    putBigEndian(header, (uint32_t)height);
+    header.push_back(8);  // bit depth
+    header.push_back(2);  // RGB
+    header.push_back(0);  // deflate
+    header.push_back(0);  // adaptive filtering
+    header.push_back(0);  // no interlace
+    writeChunk(file, "IHDR", header);
+  } else if (format == PPM) {
+    file << "P6\n" << width << " " << height << "\n255\n";
+  } else {
+    // A negative scale marks little-endian data.
+    uint16_t probe = 1;
+    bool little_endian = *(uint8_t *)&probe == 1;
+    file << "PF\n" << width << " " << height << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+    header_size = file.tellp();
+  }
+  return file.good();
+}
+
+bool ImageStream::write(const Frame &band) {
+  if (!file.is_open() || band.width() != width || band.firstRow() != next_row ||
+      band.firstRow() + band.rows() > height) {
+    std::cout << "Rows out of order for " << filename << std::endl;
+    return false;
+  }
+  int y0 = band.firstRow();
+  int y1 = y0 + band.rows();
+  next_row = y1;
+
+  if (format == PNG) {
+    // Scanlines with filter type 0, stored uncompressed so no compression
+    // library is needed. The zlib stream runs on over one IDAT chunk per
+    // band; a final empty block ends it in close().
+    std::vector<uint8_t> raw;
+    raw.reserve((size_t)(y1 - y0) * (1 + width * 3));
+    for (int y = y0; y < y1; y++) {
+      raw.push_back(0);
+      for (int x = 0; x < width; x++) {
+        Color c = band.getColor(x, y);
+        raw.push_back(toByte(c.r));
+        raw.push_back(toByte(c.g));
+        raw.push_back(toByte(c.b));
+      }
+    }
+
+    std::vector<uint8_t> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    if (y0 == 0) {
+      zlib.push_back(0x78);
+      zlib.push_back(0x01);
+    }
+    for (size_t offset = 0; offset < raw.size();) {
+      size_t length = std::min<size_t>(65535, raw.size() - offset);
+      zlib.push_back(0);
+      zlib.push_back((uint8_t)length);
+      zlib.push_back((uint8_t)(length >> 8));
+      zlib.push_back((uint8_t)~length);
+      zlib.push_back((uint8_t)(~length >> 8));
+      zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+      offset += length;
+    }
+    for (uint8_t byte : raw) {
+      adler_a = (adler_a + byte) % 65521;
+      adler_b = (adler_b + adler_a) % 65521;
+    }
+    writeChunk(file, "IDAT", zlib);
+  } else if (format == PPM) {
+    std::vector<uint8_t> row(width * 3);
+    for (int y = y0; y < y1; y++) {
+      for (int x = 0; x < width; x++) {
+        Color c = band.getColor(x, y);
+        row[x * 3 + 0] = toByte(c.r);
+        row[x * 3 + 1] = toByte(c.g);
+        row[x * 3 + 2] = toByte(c.b);
+      }
+      file.write((const char *)row.data(), row.size());
+    }
+  } else {
+    // Rows run bottom to top, so each goes to its place in the file.
+    std::vector<float> row(width * 3);
+    std::streamoff row_bytes = (std::streamoff)row.size() * sizeof(float);
+    for (int y = y0; y < y1; y++) {
+      for (int x = 0; x < width; x++) {
+        Color c = band.getColor(x, y);
+        row[x * 3 + 0] = c.r;
+        row[x * 3 + 1] = c.g;
+        row[x * 3 + 2] = c.b;
+      }
+      file.seekp(header_size + (height - 1 - y) * row_bytes);
+      file.write((const char *)row.data(), row_bytes);
+    }
+  }
+  return file.good();
+}
+
+bool ImageStream::close() {
+  if (!file.is_open()) { return false; }
+  bool complete = next_row == height;
+  if (!complete) { std::cout << "Only " << next_row << " of " << height << " rows written to " << filename << std::endl; }
+  if (format == PNG && complete) {
+    std::vector<uint8_t> zlib;
+    if (height == 0) {
+      zlib.push_back(0x78);
+      zlib.push_back(0x01);
+    }
+    // An empty final block.
+    zlib.push_back(1);
+    zlib.push_back(0);
+    zlib.push_back(0);
+    zlib.push_back(0xff);
+    zlib.push_back(0xff);
+    putBigEndian(zlib, (adler_b << 16) | adler_a);
+    writeChunk(file, "IDAT", zlib);
+    writeChunk(file, "IEND", std::vector<uint8_t>());
+  }
+  bool good = file.good() && complete;
+  file.close();
+  return good;
+}
+
+namespace {
+bool writeWhole(const Frame &frame, const std::string &filename, ImageStream::Format format) {
+  ImageStream stream;
+  if (!stream.open(filename, format, frame.width(), frame.height())) { return false; }
+  bool written = stream.write(frame);
+  return stream.close() && written;
+}
+}  // namespace
+
+bool writePNG(const Frame &frame, const std::string &filename) {
+  return writeWhole(frame, filename, ImageStream::PNG);
+}
+
+bool writePPM(const Frame &frame, const std::string &filename) {
+  return writeWhole(frame, filename, ImageStream::PPM);
+}
+
+bool writePFM(const Frame &frame, const std::string &filename) {
+  return writeWhole(frame, filename, ImageStream::PFM);
+}
+
+bool writeCostMap(const CostMap &costs, const std::string &filename) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cout << "File " << filename << " failed to open" << std::endl;
+    return false;
+  }
+  uint16_t probe = 1;
+  bool little_endian = *(uint8_t *)&probe == 1;
+  file << "PF\n" << costs.width() << " " << costs.height() << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+  // Bottom row first.
+  size_t row_floats = (size_t)costs.width() * 3;
+  for (int y = costs.height() - 1; y >= 0; y--) {
+    file.write((const char *)(costs.data() + y * row_floats), row_floats * sizeof(float));
+  }
+  return file.good();
+}
+
+bool writeImage(const Frame &frame, const std::string &filename) {
+  ImageStream::Format format;
+  return ImageStream::formatFor(filename, format) && writeWhole(frame, filename, format);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "../renderer/renderer_types.h"
+
+// Writes a frame to disk without any graphics dependency. The format is
+// picked from the file extension: .png (8-bit RGB), .ppm (binary P6) or
+// .pfm (float RGB, unclamped; values carry the half precision of Frame).
+bool writeImage(const Frame &frame, const std::string &filename);
+
+bool writePNG(const Frame &frame, const std::string &filename);
+bool writePPM(const Frame &frame, const std::string &filename);
+bool writePFM(const Frame &frame, const std::string &filename);
+
+// Writes the costs themselves as a float .pfm: tests, rays and nanoseconds
+// of each pixel as its red, green and blue, at full float precision.
+bool writeCostMap(const CostMap &costs, const std::string &filename);
+
+// Writes an image a band of rows at a time, top to bottom, so no more than
+// one band of it has to be in memory. The file is the same as writeImage
+// would make of the whole frame.
+class ImageStream {
+ public:
+  enum Format { PNG, PPM, PFM };
+
+  ImageStream() {}
+  ImageStream(const ImageStream &) = delete;
+  ImageStream &operator=(const ImageStream &) = delete;
+
+  // The format of `filename`'s extension, as writeImage picks it.
+  static bool formatFor(const std::string &filename, Format &format);
+
+  // The format is picked from the extension.
+  bool open(const std::string &filename, int width, int height);
+  bool open(const std::string &filename, Format format, int width, int height);
+  // Appends the rows `band` holds, which must be the next ones.
+  bool write(const Frame &band);
+  // Finishes the file; false if anything went wrong on the way.
+  bool close();
+
+ private:
+  std::ofstream file;
+  std::string filename;
+  Format format = PNG;
+  int width = 0;
+  int height = 0;
+  int next_row = 0;
+  std::streamoff header_size = 0;
+  // Running Adler-32 of the PNG scanlines.
+  uint32_t adler_a = 1;
+  uint32_t adler_b = 0;
+};
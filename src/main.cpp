@@ -1,24 +1,79 @@
-#include "configfile/parser.h"
 #include "renderer/renderer.h"
 #include "raytracer/raytracer.h"
+#include "raytracer/renderoptions.h"
+#include "raytracer/scenecache.h"
+#include "renderer/framequeue.h"
+#include "renderer/governor.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Progressive frames start with every 4th pixel of every 4th row, then
+// halve the step down to full detail.
+const int PROGRESSIVE_STEP = 4;
+// Degrees the camera turns per arrow key step.
+const float ORBIT_STEP = 2.0f;
 
 int main(int argc, char **argv) {
   if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " <config file>" << std::endl;
+    std::cout << "Usage: " << argv[0] << " <config file> [--width W] [--height H] [--progressive] [--target-fps N] "
+              << "[--profile FILE.json] [--trace FILE.json] " << RENDER_OPTIONS_USAGE << std::endl;
+    return 1;
+  }
+
+  RenderOptions options;
+  int width = WIDTH;
+  int height = HEIGHT;
+  bool progressive = false;
+  float target_fps = 0.0f;
+  std::string profile_output;
+  std::string trace_output;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+      width = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+      height = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--progressive") == 0) {
+      progressive = true;
+    } else if (strcmp(argv[i], "--target-fps") == 0 && i + 1 < argc) {
+      target_fps = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_output = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_output = argv[++i];
+    } else if (!parseRenderOption(argc, argv, i, options)) {
+      std::cout << "Unknown option: " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  bool profiling = !profile_output.empty() || !trace_output.empty();
+  if (profiling && !PROFILE_ENABLED) {
+    std::cout << "This build has no profiling; configure with -DRAYTRACER_PROFILE=ON" << std::endl;
     return 1;
   }
+  Profiler::instance().keepEvents(!trace_output.empty());
 
-  Parser parser;
-  RenderingInfo *info = parser.parseFile(argv[1]);
-  if (info == nullptr) {
+  LoadedScene scene;
+  if (!scene.load(argv[1], options.use_cache)) {
     std::cout << "Failed to parse file" << std::endl;
     return 1;
   }
 
-  Frame frame;
+  Frame frame(width, height);
   Renderer renderer;
 
-  Raytracer raytracer({0.0f, 0.0f, 0.0f}, info);
+  Raytracer raytracer({0.0f, 0.0f, 0.0f}, scene.getScene(), options.threads, scene.getBVH());
+  applyRenderOptions(raytracer, options);
   raytracer.render(frame);
 
   if (!renderer.init(frame)) {
@@ -26,16 +81,175 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  float theta = 0.0f;
+  // The tracing thread renders the sweep into free upload frames and queues
+  // them; the display thread presents them and hands each buffer back once
+  // the GPU has copied it. Neither side waits on the other's work.
+  FrameQueue free_frames;
+  FrameQueue ready_frames;
+  for (int i = 0; i < renderer.uploadFrameCount(); i++) {
+    free_frames.push(i);
+  }
+
+  // Animated scenes play in a loop at wall-clock speed.
+  CompiledScene *compiled = scene.getScene();
+  float animation_length = compiled->animationLength();
+  auto animation_start = std::chrono::steady_clock::now();
+
+  // The camera sweeps back and forth until an arrow key turns it; from then
+  // on it stays where the keys leave it. Each change of camera bumps
+  // `camera_version` and calls off the passes still tracing the old view.
+  std::mutex camera_mutex;
+  std::condition_variable camera_changed;
+  float camera_theta = 0.0f;
+  bool manual = false;
+  bool stopping = false;
+  int camera_version = 0;
+  std::atomic<bool> cancel(false);
+
+  // With --target-fps the governor sets resolution, anti-aliasing and
+  // bounces for each frame from the times of those before. The level shown
+  // in the title is the one the tracer last moved to.
+  std::unique_ptr<FrameGovernor> governor;
+  if (target_fps > 0.0f) { governor.reset(new FrameGovernor(1000.0 / target_fps, options.aa_samples, options.bounces)); }
+  std::atomic<int> quality_level(0);
+
+  // With --progressive each view is traced as passes of decreasing step,
+  // and with the governor at the resolution it picks, into a frame of the
+  // tracer's own, which is copied out for display after every pass.
+  int first_step = progressive ? PROGRESSIVE_STEP : 1;
+  bool own_frame = progressive || governor;
+  Frame image(own_frame ? width : 1, own_frame ? height : 1);
+
+  // Profiled, each view the tracer starts is a frame, finished or not;
+  // uploads count in the frame being traced when they happen.
+  std::thread tracer([&]() {
+    int traced_version = -1;
+    int frame_number = 0;
+    for (;;) {
+      float theta;
+      {
+        std::unique_lock<std::mutex> lock(camera_mutex);
+        // A still camera on a still scene has nothing new to show.
+        camera_changed.wait(lock, [&]() {
+          return stopping || !manual || compiled->animated() || camera_version != traced_version;
+        });
+        if (stopping) { return; }
+        theta = camera_theta;
+        traced_version = camera_version;
+        cancel = false;
+      }
+      if (profiling) {
+        Profiler::instance().beginFrame(frame_number++);
+        raytracer.resetRayStats();
+      }
+      auto frame_start = std::chrono::steady_clock::now();
+      if (governor) {
+        const QualityLevel &quality = governor->quality();
+        raytracer.setAntialiasing(quality.aa_samples, options.aa_threshold);
+        raytracer.setBounces(quality.bounces);
+        int scaled_width = std::max(1, (int)std::lround(width * quality.scale));
+        int scaled_height = std::max(1, (int)std::lround(height * quality.scale));
+        image.reshape(scaled_width, scaled_height, 0, scaled_height);
+      }
+      if (compiled->animated()) {
+        float time = std::chrono::duration<float>(std::chrono::steady_clock::now() - animation_start).count();
+        compiled->animate(animation_length > 0.0f ? std::fmod(time, animation_length) : 0.0f);
+        raytracer.updateScene();
+      }
+      raytracer.setTheta(theta);
+
+      bool complete = true;
+      bool closed = false;
+      for (int step = first_step; step >= 1; step /= 2) {
+        int buffer;
+        if (!free_frames.pop(buffer)) {
+          complete = false;
+          closed = true;
+          break;
+        }
+        Frame &upload = renderer.uploadFrame(buffer);
+        if (!own_frame) {
+          // Every pixel gets overwritten, so the upload frame is not cleared first.
+          raytracer.render(upload);
+        } else if (first_step == 1) {
+          raytracer.render(image);
+          upload = image;
+        } else if (raytracer.renderPass(image, step, step < first_step, &cancel)) {
+          upload = image;
+        } else {
+          free_frames.push(buffer);
+          complete = false;
+          break;
+        }
+        ready_frames.push(buffer);
+      }
+      if (profiling) { Profiler::instance().endFrame(raytracer.rayStats()); }
+      if (closed) { return; }
+      if (complete && governor) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count();
+        if (governor->frameDone(ms)) { quality_level = governor->level(); }
+      }
+
+      std::lock_guard<std::mutex> lock(camera_mutex);
+      if (complete && !manual && camera_version == traced_version) {
+        camera_theta += 1.0f;
+        if (camera_theta > 15.0f){
+          camera_theta = -15.0f;
+        }
+      }
+    }
+  });
+
+  std::vector<int> uploading;
+  int shown_level = -1;
   while (renderer.render()) {
-    frame.clear();
-    raytracer.setTheta(theta);
-    raytracer.render(frame);
-    renderer.changeFrame(frame);
-
-    theta += 1.0f;
-    if (theta > 15.0f){
-      theta = -15.0f;
+    int level = quality_level;
+    if (governor && level != shown_level) {
+      const QualityLevel &quality = governor->quality(level);
+      char title[160];
+      snprintf(title, sizeof(title), "Raytracer - %g fps target: quality %d/%d (%d%% resolution, %d AA samples, %d bounces)",
+               target_fps, governor->levelCount() - level, governor->levelCount(),
+               (int)std::lround(quality.scale * 100.0f), quality.aa_samples, quality.bounces);
+      renderer.setTitle(title);
+      shown_level = level;
+    }
+
+    int orbit = renderer.takeOrbit();
+    if (orbit != 0) {
+      std::lock_guard<std::mutex> lock(camera_mutex);
+      manual = true;
+      camera_theta += orbit * ORBIT_STEP;
+      camera_version++;
+      cancel = true;
+      camera_changed.notify_one();
+    }
+
+    int buffer;
+    if (ready_frames.tryPop(buffer)) {
+      renderer.changeFrame(renderer.uploadFrame(buffer));
+      uploading.push_back(buffer);
+    }
+    for (size_t i = 0; i < uploading.size();) {
+      if (renderer.uploadDone(uploading[i])) {
+        free_frames.push(uploading[i]);
+        uploading.erase(uploading.begin() + i);
+      } else {
+        i++;
+      }
     }
   }
-}
\ No newline at end of file
+
+  // The tracer may still be writing into a mapped buffer; let it finish its
+  // frame before the buffers go away.
+  {
+    std::lock_guard<std::mutex> lock(camera_mutex);
+    stopping = true;
+    camera_changed.notify_one();
+  }
+  free_frames.close();
+  tracer.join();
+  renderer.shutdown();
+
+  if (!profile_output.empty() && !Profiler::instance().writeJSON(profile_output)) { return 1; }
+  if (!trace_output.empty() && !Profiler::instance().writeTrace(trace_output)) { return 1; }
+}
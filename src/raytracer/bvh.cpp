@@ -0,0 +1,341 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "profile.h"
+
+namespace {
+const int BIN_COUNT = 16;
+const uint32_t MAX_LEAF_SIZE = 4;
+const float TRAVERSAL_COST = 1.0f;
+const float INTERSECTION_COST = 1.0f;
+// Past this depth ranges are halved instead of SAH-split, which keeps the
+// tree shallow enough for the fixed 64-entry traversal stacks.
+const int MAX_SAH_DEPTH = 32;
+
+// Primitive boxes are widened slightly so the slab test stays conservative
+// against rounding in the sphere and triangle intersection routines.
+void pad(AABB &box) {
+  float largest = 0.0f;
+  for (int a = 0; a < 3; a++) {
+    largest = std::max(largest, std::max(std::fabs(box.min[a]), std::fabs(box.max[a])));
+  }
+  float eps = 1e-5f * (1.0f + largest);
+  for (int a = 0; a < 3; a++) {
+    box.min[a] -= eps;
+    box.max[a] += eps;
+  }
+}
+
+AABB sphereBounds(const CompiledScene *scene, uint32_t i) {
+  AABB box;
+  float r = std::sqrt(scene->sphere_r2[i]);
+  float x = scene->sphere_x[i];
+  float y = scene->sphere_y[i];
+  float z = scene->sphere_z[i];
+  box.grow(x - r, y - r, z - r);
+  box.grow(x + r, y + r, z + r);
+  pad(box);
+  return box;
+}
+
+AABB triangleBounds(const CompiledScene *scene, uint32_t i) {
+  AABB box;
+  for (int corner = 0; corner < 3; corner++) {
+    const float *p = scene->triangleVertex(i, corner);
+    box.grow(p[0], p[1], p[2]);
+  }
+  pad(box);
+  return box;
+}
+
+// World box of an instance: the corners of its object's box, transformed.
+AABB instanceBounds(const SceneInstance &instance, const AABB &object) {
+  AABB box;
+  const float *m = instance.to_world;
+  for (int corner = 0; corner < 8; corner++) {
+    float x = (corner & 1) ? object.max[0] : object.min[0];
+    float y = (corner & 2) ? object.max[1] : object.min[1];
+    float z = (corner & 4) ? object.max[2] : object.min[2];
+    box.grow(m[0] * x + m[1] * y + m[2] * z + m[3], m[4] * x + m[5] * y + m[6] * z + m[7],
+             m[8] * x + m[9] * y + m[10] * z + m[11]);
+  }
+  pad(box);
+  return box;
+}
+}  // namespace
+
+AABB::AABB() {
+  for (int a = 0; a < 3; a++) {
+    min[a] = std::numeric_limits<float>::max();
+    max[a] = -std::numeric_limits<float>::max();
+  }
+}
+
+void AABB::grow(const AABB &other) {
+  for (int a = 0; a < 3; a++) {
+    min[a] = std::min(min[a], other.min[a]);
+    max[a] = std::max(max[a], other.max[a]);
+  }
+}
+
+void AABB::grow(float x, float y, float z) {
+  float p[3] = {x, y, z};
+  for (int a = 0; a < 3; a++) {
+    min[a] = std::min(min[a], p[a]);
+    max[a] = std::max(max[a], p[a]);
+  }
+}
+
+float AABB::surfaceArea() const {
+  float dx = max[0] - min[0];
+  float dy = max[1] - min[1];
+  float dz = max[2] - min[2];
+  if (dx < 0.0f || dy < 0.0f || dz < 0.0f) { return 0.0f; }
+  return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+BVH::BVH(const CompiledScene *scene) {
+  PROFILE_SCOPE("build bvh");
+  // Without a top level the object trees would go unused.
+  if (topLevelCount(scene) == 0) { return; }
+
+  size_t count = scene->sphereCount() + scene->triangleCount() + scene->instanceCount();
+  primitives.reserve(count);
+  nodes.reserve(2 * count);
+
+  // The object trees come first in both arrays, so the top level can be
+  // rebuilt at the end without moving them.
+  std::vector<AABB> boxes;
+  object_roots.reserve(scene->objectCount());
+  for (uint32_t o = 0; o < scene->objectCount(); o++) {
+    const SceneObject &object = scene->objects[o];
+    if (object.triangle_count == 0) {
+      object_roots.push_back(0);
+      continue;
+    }
+    uint32_t begin = (uint32_t)primitives.size();
+    boxes.clear();
+    for (uint32_t i = object.first_triangle; i < object.first_triangle + object.triangle_count; i++) {
+      primitives.push_back({PRIMITIVE_TRIANGLE, i});
+      boxes.push_back(triangleBounds(scene, i));
+    }
+    object_roots.push_back(buildRecursive(boxes, begin, begin, (uint32_t)primitives.size(), 0));
+  }
+
+  buildTopLevel(scene);
+}
+
+BVH::BVH(const BVHNode *nodes, size_t node_count, const PrimitiveRef *primitives, size_t primitive_count,
+         const uint32_t *object_roots, size_t object_count, uint32_t root) {
+  this->nodes.view(nodes, node_count);
+  this->primitives.view(primitives, primitive_count);
+  this->object_roots.view(object_roots, object_count);
+  this->root = root;
+  if (!empty()) { build_cost = topLevelCost(); }
+}
+
+uint32_t BVH::topLevelCount(const CompiledScene *scene) {
+  uint32_t count = scene->sphereCount() + scene->worldTriangleCount();
+  for (const SceneInstance &instance : scene->instances) {
+    count += scene->objects[instance.object].triangle_count != 0;
+  }
+  return count;
+}
+
+AABB BVH::primitiveBounds(const CompiledScene *scene, const PrimitiveRef &primitive) const {
+  switch (primitive.type) {
+    case PRIMITIVE_SPHERE:
+      return sphereBounds(scene, primitive.index);
+    case PRIMITIVE_TRIANGLE:
+      return triangleBounds(scene, primitive.index);
+    default: {
+      const SceneInstance &instance = scene->instances[primitive.index];
+      return instanceBounds(instance, nodes[object_roots[instance.object]].bounds);
+    }
+  }
+}
+
+void BVH::buildTopLevel(const CompiledScene *scene) {
+  uint32_t begin = (uint32_t)primitives.size();
+  for (uint32_t i = 0; i < scene->sphereCount(); i++) {
+    primitives.push_back({PRIMITIVE_SPHERE, i});
+  }
+  for (uint32_t i = 0; i < scene->worldTriangleCount(); i++) {
+    primitives.push_back({PRIMITIVE_TRIANGLE, i});
+  }
+  for (uint32_t i = 0; i < scene->instanceCount(); i++) {
+    if (scene->objects[scene->instances[i].object].triangle_count == 0) { continue; }
+    primitives.push_back({PRIMITIVE_INSTANCE, i});
+  }
+
+  std::vector<AABB> boxes;
+  boxes.reserve(primitives.size() - begin);
+  for (uint32_t i = begin; i < primitives.size(); i++) {
+    boxes.push_back(primitiveBounds(scene, primitives[i]));
+  }
+  root = buildRecursive(boxes, begin, begin, (uint32_t)primitives.size(), 0);
+  build_cost = topLevelCost();
+}
+
+void BVH::rebuildTopLevel(const CompiledScene *scene) {
+  if (empty()) { return; }
+  nodes.detach();
+  primitives.detach();
+  // The top level is the tail of both arrays; its primitives are the last
+  // topLevelCount() of them.
+  nodes.truncate(root);
+  primitives.truncate(primitives.size() - topLevelCount(scene));
+  buildTopLevel(scene);
+}
+
+void BVH::refit(const CompiledScene *scene) {
+  if (empty()) { return; }
+  nodes.detach();
+  const SceneArray<PrimitiveRef> &primitives = this->primitives;
+
+  // Children follow their parent, so a backwards pass sees both children
+  // of every node before the node itself.
+  for (size_t i = nodes.size(); i-- > root;) {
+    BVHNode &node = nodes[i];
+    AABB bounds;
+    if (node.isLeaf()) {
+      for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+        bounds.grow(primitiveBounds(scene, primitives[p]));
+      }
+    } else {
+      bounds.grow(nodes[i + 1].bounds);
+      bounds.grow(nodes[node.offset].bounds);
+    }
+    node.bounds = bounds;
+  }
+}
+
+float BVH::topLevelCost() const {
+  const SceneArray<BVHNode> &nodes = this->nodes;
+  float root_area = nodes[root].bounds.surfaceArea();
+  if (root_area <= 0.0f) { return 0.0f; }
+  float cost = 0.0f;
+  for (size_t i = root; i < nodes.size(); i++) {
+    const BVHNode &node = nodes[i];
+    cost += node.bounds.surfaceArea() * (node.isLeaf() ? INTERSECTION_COST * node.count : TRAVERSAL_COST);
+  }
+  return cost / root_area;
+}
+
+float BVH::degradation() const {
+  if (empty() || build_cost <= 0.0f) { return 1.0f; }
+  return topLevelCost() / build_cost;
+}
+
+uint32_t BVH::buildRecursive(std::vector<AABB> &boxes, uint32_t first, uint32_t begin, uint32_t end, int depth) {
+  uint32_t node_index = (uint32_t)nodes.size();
+  nodes.push_back(BVHNode());
+
+  AABB bounds;
+  AABB centroid_bounds;
+  for (uint32_t i = begin; i < end; i++) {
+    bounds.grow(boxes[i - first]);
+    centroid_bounds.grow(boxes[i - first].centroid(0), boxes[i - first].centroid(1), boxes[i - first].centroid(2));
+  }
+  nodes[node_index].bounds = bounds;
+
+  uint32_t count = end - begin;
+  float leaf_cost = INTERSECTION_COST * count;
+
+  // Find the cheapest binned split over all three axes.
+  int best_axis = -1;
+  int best_bin = 0;
+  float best_cost = std::numeric_limits<float>::max();
+  float parent_area = bounds.surfaceArea();
+
+  for (int axis = 0; axis < 3 && count > 1 && depth < MAX_SAH_DEPTH; axis++) {
+    float lo = centroid_bounds.min[axis];
+    float extent = centroid_bounds.max[axis] - lo;
+    if (extent <= 0.0f) { continue; }
+
+    AABB bin_bounds[BIN_COUNT];
+    uint32_t bin_counts[BIN_COUNT] = {0};
+    float scale = BIN_COUNT / extent;
+    for (uint32_t i = begin; i < end; i++) {
+      int b = std::min(BIN_COUNT - 1, (int)((boxes[i - first].centroid(axis) - lo) * scale));
+      bin_counts[b]++;
+      bin_bounds[b].grow(boxes[i - first]);
+    }
+
+    // Sweep from the right to collect suffix areas, then from the left.
+    float right_area[BIN_COUNT];
+    uint32_t right_count[BIN_COUNT];
+    AABB acc;
+    uint32_t acc_count = 0;
+    for (int b = BIN_COUNT - 1; b > 0; b--) {
+      acc.grow(bin_bounds[b]);
+      acc_count += bin_counts[b];
+      right_area[b] = acc.surfaceArea();
+      right_count[b] = acc_count;
+    }
+
+    acc = AABB();
+    acc_count = 0;
+    for (int b = 0; b < BIN_COUNT - 1; b++) {
+      acc.grow(bin_bounds[b]);
+      acc_count += bin_counts[b];
+      if (acc_count == 0 || right_count[b + 1] == 0) { continue; }
+      float cost = TRAVERSAL_COST + INTERSECTION_COST *
+                   (acc.surfaceArea() * acc_count + right_area[b + 1] * right_count[b + 1]) / parent_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  if (count <= MAX_LEAF_SIZE && (best_axis == -1 || best_cost >= leaf_cost)) {
+    nodes[node_index].offset = begin;
+    nodes[node_index].count = (uint16_t)count;
+    return node_index;
+  }
+
+  uint32_t mid = begin;
+  if (best_axis == -1) {
+    // No usable split (coincident centroids or too deep); halve the range.
+    best_axis = 0;
+    mid = begin + count / 2;
+  } else {
+    float lo = centroid_bounds.min[best_axis];
+    float scale = BIN_COUNT / (centroid_bounds.max[best_axis] - lo);
+    for (uint32_t i = begin; i < end; i++) {
+      int b = std::min(BIN_COUNT - 1, (int)((boxes[i - first].centroid(best_axis) - lo) * scale));
+      if (b <= best_bin) {
+        std::swap(boxes[i - first], boxes[mid - first]);
+        std::swap(primitives[i], primitives[mid]);
+        mid++;
+      }
+    }
+  }
+
+  buildRecursive(boxes, first, begin, mid, depth + 1);
+  uint32_t right = buildRecursive(boxes, first, mid, end, depth + 1);
+  nodes[node_index].offset = right;
+  nodes[node_index].count = 0;
+  nodes[node_index].axis = (uint16_t)best_axis;
+  return node_index;
+}
+
+bool BVH::intersect(const AABB &box, const float origin[3], const float inv_dir[3],
+                    float t_min, float t_max, float &t_near) {
+  for (int a = 0; a < 3; a++) {
+    float t0 = (box.min[a] - origin[a]) * inv_dir[a];
+    float t1 = (box.max[a] - origin[a]) * inv_dir[a];
+    // NaNs (zero direction component on a slab boundary) fall through
+    // these comparisons and leave the interval untouched.
+    t_min = std::max(t_min, std::min(t0, t1));
+    t_max = std::min(t_max, std::max(t0, t1));
+    if (t_min > t_max) { return false; }
+  }
+  t_near = t_min;
+  return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "compiledscene.h"
+
+enum PrimitiveType : uint32_t {
+  PRIMITIVE_SPHERE = 0,
+  PRIMITIVE_TRIANGLE = 1,
+  PRIMITIVE_INSTANCE = 2
+};
+
+// Marks a hit on world geometry rather than on an instance.
+const uint32_t NO_INSTANCE = 0xffffffffu;
+
+// Reference from a BVH leaf into the scene's sphere, triangle or instance
+// list.
+struct PrimitiveRef {
+  PrimitiveType type;
+  uint32_t index;
+};
+
+struct AABB {
+  float min[3];
+  float max[3];
+
+  AABB();
+  void grow(const AABB &other);
+  void grow(float x, float y, float z);
+  float surfaceArea() const;
+  float centroid(int axis) const { return 0.5f * (min[axis] + max[axis]); }
+};
+
+// Flattened node. Interior nodes store their left child right after
+// themselves and the right child at `offset`; leaves store `count`
+// primitives starting at `offset` in the primitive list.
+struct BVHNode {
+  AABB bounds;
+  uint32_t offset;
+  uint16_t count;
+  uint16_t axis;
+
+  bool isLeaf() const { return count != 0; }
+};
+
+// Two-level bounding volume hierarchy, built with the surface area heuristic
+// (binned). Each object has a bottom-level tree over its triangles in object
+// space, entered through the instance's inverse transform, so the memory
+// grows with the unique geometry rather than with the instances. The top
+// level, rooted at getRoot(), holds the spheres, the world triangles and one
+// leaf entry per instance.
+//
+// The object trees come first in both the node and the primitive array and
+// the top level last, so when spheres or instances move (see
+// CompiledScene::animate) only the top level needs refitting or rebuilding.
+class BVH {
+ private:
+  SceneArray<BVHNode> nodes;
+  SceneArray<PrimitiveRef> primitives;
+  // Root node of each object's tree; 0 for objects without triangles,
+  // whose instances are left out of the top level.
+  SceneArray<uint32_t> object_roots;
+  // First node of the top level; 0 when there are no objects.
+  uint32_t root = 0;
+  // topLevelCost() right after the top level was last built.
+  float build_cost = 0.0f;
+
+  // boxes[i - first] is the box of primitives[i].
+  uint32_t buildRecursive(std::vector<AABB> &boxes, uint32_t first, uint32_t begin, uint32_t end, int depth);
+  void buildTopLevel(const CompiledScene *scene);
+  AABB primitiveBounds(const CompiledScene *scene, const PrimitiveRef &primitive) const;
+  float topLevelCost() const;
+  static uint32_t topLevelCount(const CompiledScene *scene);
+
+ public:
+  explicit BVH(const CompiledScene *scene);
+  // A BVH built earlier, viewed in place (e.g. from a SceneCache).
+  BVH(const BVHNode *nodes, size_t node_count, const PrimitiveRef *primitives, size_t primitive_count,
+      const uint32_t *object_roots, size_t object_count, uint32_t root);
+
+  const SceneArray<BVHNode> &getNodes() const { return nodes; }
+  const SceneArray<PrimitiveRef> &getPrimitives() const { return primitives; }
+  const SceneArray<uint32_t> &getObjectRoots() const { return object_roots; }
+  uint32_t getRoot() const { return root; }
+  bool empty() const { return primitives.empty(); }
+
+  // Recomputes the top-level boxes bottom-up from the scene's current
+  // sphere centers and instance transforms, keeping the tree's shape.
+  void refit(const CompiledScene *scene);
+  // Builds the top level again from scratch; the object trees are kept.
+  void rebuildTopLevel(const CompiledScene *scene);
+  // SAH cost of the top level relative to when it was built. Refitting
+  // after large motion lets boxes grow and overlap, which shows up here.
+  float degradation() const;
+
+  // Slab test; returns the entry distance in t_near when the box is hit
+  // anywhere in [t_min, t_max].
+  static bool intersect(const AABB &box, const float origin[3], const float inv_dir[3],
+                        float t_min, float t_max, float &t_near);
+};
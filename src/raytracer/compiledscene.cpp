@@ -0,0 +1,293 @@
+#include "compiledscene.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace {
+// Starts a run of triangles in `material`, unless the last run has it. Only
+// called right before triangles are added, so no run is empty.
+void beginTriangles(CompiledScene &scene, uint32_t material) {
+  const SceneArray<TriangleRange> &ranges = scene.tri_ranges;
+  if (!ranges.empty() && ranges[ranges.size() - 1].material == material) { return; }
+  scene.tri_ranges.push_back({scene.triangleCount(), material});
+}
+
+void addVertex(CompiledScene &scene, const Vect &p) {
+  scene.vertices.push_back(p.x);
+  scene.vertices.push_back(p.y);
+  scene.vertices.push_back(p.z);
+}
+
+void addTriangle(CompiledScene &scene, Vect p0, Vect p1, Vect p2, uint32_t material) {
+  beginTriangles(scene, material);
+  uint32_t first = (uint32_t)(scene.vertices.size() / 3);
+  addVertex(scene, p0);
+  addVertex(scene, p1);
+  addVertex(scene, p2);
+  scene.tri_indices.push_back(first);
+  scene.tri_indices.push_back(first + 1);
+  scene.tri_indices.push_back(first + 2);
+}
+
+// The mesh's vertices and indices are taken over as they are, the indices
+// moved past the vertices already in the scene.
+void addMeshTriangles(CompiledScene &scene, const Mesh *mesh, uint32_t material) {
+  if (mesh->indices.empty()) { return; }
+  beginTriangles(scene, material);
+  uint32_t base = (uint32_t)(scene.vertices.size() / 3);
+  for (float coordinate : mesh->vertices) {
+    scene.vertices.push_back(coordinate);
+  }
+  for (uint32_t index : mesh->indices) {
+    scene.tri_indices.push_back(base + index);
+  }
+}
+
+// Object to world matrix: scale, then rotate about x, y and z (degrees),
+// then translate.
+void instanceTransform(const Vect &position, const Vect &rotation, const Vect &scale, float transform[12]) {
+  float m[3][3] = {{scale.x, 0.0f, 0.0f}, {0.0f, scale.y, 0.0f}, {0.0f, 0.0f, scale.z}};
+  float angles[3] = {rotation.x, rotation.y, rotation.z};
+  for (int axis = 0; axis < 3; axis++) {
+    float rad = angles[axis] * 3.1415926f / 180.0f;
+    float c = cos(rad);
+    float s = sin(rad);
+    // The two rows the rotation mixes.
+    int u = (axis + 1) % 3;
+    int v = (axis + 2) % 3;
+    for (int column = 0; column < 3; column++) {
+      float mu = m[u][column];
+      float mv = m[v][column];
+      m[u][column] = c * mu - s * mv;
+      m[v][column] = s * mu + c * mv;
+    }
+  }
+  float t[3] = {position.x, position.y, position.z};
+  for (int row = 0; row < 3; row++) {
+    for (int column = 0; column < 3; column++) {
+      transform[4 * row + column] = m[row][column];
+    }
+    transform[4 * row + 3] = t[row];
+  }
+}
+
+// Inverse of an affine transform with an invertible linear part.
+void invertTransform(const float m[12], float inverse[12]) {
+  // Adjugate of the 3x3 part over its determinant.
+  float a[9] = {m[5] * m[10] - m[6] * m[9], m[2] * m[9] - m[1] * m[10], m[1] * m[6] - m[2] * m[5],
+                m[6] * m[8] - m[4] * m[10], m[0] * m[10] - m[2] * m[8], m[2] * m[4] - m[0] * m[6],
+                m[4] * m[9] - m[5] * m[8],  m[1] * m[8] - m[0] * m[9],  m[0] * m[5] - m[1] * m[4]};
+  float inv_det = 1.0f / (m[0] * a[0] + m[1] * a[3] + m[2] * a[6]);
+  for (int row = 0; row < 3; row++) {
+    for (int column = 0; column < 3; column++) {
+      inverse[4 * row + column] = a[3 * row + column] * inv_det;
+    }
+  }
+  for (int row = 0; row < 3; row++) {
+    const float *r = inverse + 4 * row;
+    inverse[4 * row + 3] = -(r[0] * m[3] + r[1] * m[7] + r[2] * m[11]);
+  }
+}
+
+void placeInstance(SceneInstance &instance, const Vect &position, const Vect &rotation, const Vect &scale) {
+  instanceTransform(position, rotation, scale, instance.to_world);
+  invertTransform(instance.to_world, instance.to_object);
+}
+
+Vect lerp(const Vect &a, const Vect &b, float f) {
+  return Vect{a.x + (b.x - a.x) * f, a.y + (b.y - a.y) * f, a.z + (b.z - a.z) * f};
+}
+
+// Index of the last key of the track [first, end) at or before `time`,
+// and how far `time` is towards the key after it (0 when holding).
+template <class Key>
+size_t trackPosition(const SceneArray<Key> &keys, size_t first, size_t end, float time, float &f) {
+  size_t key = first;
+  while (key + 1 < end && keys[key + 1].time <= time) {
+    key++;
+  }
+  f = 0.0f;
+  if (key + 1 < end && time > keys[key].time) {
+    f = (time - keys[key].time) / (keys[key + 1].time - keys[key].time);
+  }
+  return key;
+}
+}  // namespace
+
+CompiledScene::CompiledScene(const RenderingInfo *info) {
+  ambient = info->ambient;
+  focal_length = info->focal_length;
+  shadows = info->shadows;
+
+  has_dir_light = info->dir_light != nullptr;
+  dir_light_intensity = has_dir_light ? info->dir_light->h_intensity : 0.0f;
+  if (has_dir_light) { dir_light_direction = info->dir_light->direction; }
+
+  std::unordered_map<const Material *, uint32_t> material_index;
+  materials.reserve(info->materials.size());
+  for (auto material : info->materials) {
+    material_index[material] = (uint32_t)materials.size();
+    materials.push_back({material->color, material->glossiness, material->p, material->mirror});
+  }
+
+  size_t light_count = info->point_lights.size();
+  light_x.reserve(light_count);
+  light_y.reserve(light_count);
+  light_z.reserve(light_count);
+  light_intensity.reserve(light_count);
+  for (auto light : info->point_lights) {
+    light_x.push_back(light->position.x);
+    light_y.push_back(light->position.y);
+    light_z.push_back(light->position.z);
+    light_intensity.push_back(light->intensity);
+  }
+
+  size_t sphere_count = info->spheres.size();
+  sphere_x.reserve(sphere_count);
+  sphere_y.reserve(sphere_count);
+  sphere_z.reserve(sphere_count);
+  sphere_r2.reserve(sphere_count);
+  sphere_material.reserve(sphere_count);
+  for (auto sphere : info->spheres) {
+    sphere_x.push_back(sphere->center.x);
+    sphere_y.push_back(sphere->center.y);
+    sphere_z.push_back(sphere->center.z);
+    sphere_r2.push_back(sphere->radius * sphere->radius);
+    sphere_material.push_back(material_index[sphere->material]);
+  }
+
+  size_t coordinate_count = 9 * info->triangles.size();
+  size_t index_count = 3 * info->triangles.size();
+  for (auto mesh : info->meshes) {
+    coordinate_count += mesh->vertices.size();
+    index_count += mesh->indices.size();
+    mesh_files.push_back(mesh->filename);
+  }
+  for (auto object : info->objects) {
+    coordinate_count += object->vertices.size();
+    index_count += object->indices.size();
+    mesh_files.push_back(object->filename);
+  }
+  vertices.reserve(coordinate_count);
+  tri_indices.reserve(index_count);
+  for (auto triangle : info->triangles) {
+    addTriangle(*this, triangle->p0, triangle->p1, triangle->p2, material_index[triangle->material]);
+  }
+  for (auto mesh : info->meshes) {
+    addMeshTriangles(*this, mesh, material_index[mesh->material]);
+  }
+
+  std::unordered_map<const Mesh *, uint32_t> object_index;
+  objects.reserve(info->objects.size());
+  for (auto object : info->objects) {
+    object_index[object] = (uint32_t)objects.size();
+    objects.push_back({triangleCount(), (uint32_t)(object->indices.size() / 3)});
+    addMeshTriangles(*this, object, material_index[object->material]);
+  }
+  std::unordered_map<const Instance *, uint32_t> instance_index;
+  instances.reserve(info->instances.size());
+  for (auto instance : info->instances) {
+    SceneInstance compiled;
+    placeInstance(compiled, instance->position, instance->rotation, instance->scale);
+    compiled.object = object_index[instance->object];
+    compiled.material = material_index[instance->material];
+    instance_index[instance] = (uint32_t)instances.size();
+    instances.push_back(compiled);
+  }
+
+  std::unordered_map<const Sphere *, uint32_t> sphere_index;
+  for (size_t i = 0; i < info->spheres.size(); i++) {
+    sphere_index[info->spheres[i]] = (uint32_t)i;
+  }
+  std::vector<SphereKey> sphere_tracks;
+  std::vector<InstanceKey> instance_tracks;
+  for (auto key : info->keyframes) {
+    if (key->sphere != nullptr) {
+      sphere_tracks.push_back({sphere_index[key->sphere], key->time, key->position});
+    } else {
+      instance_tracks.push_back({instance_index[key->instance], key->time, key->position, key->rotation, key->scale});
+    }
+  }
+  // Keys of one target at the same time keep their order in the file.
+  std::stable_sort(sphere_tracks.begin(), sphere_tracks.end(), [](const SphereKey &a, const SphereKey &b) {
+    return a.sphere != b.sphere ? a.sphere < b.sphere : a.time < b.time;
+  });
+  std::stable_sort(instance_tracks.begin(), instance_tracks.end(), [](const InstanceKey &a, const InstanceKey &b) {
+    return a.instance != b.instance ? a.instance < b.instance : a.time < b.time;
+  });
+  sphere_keys.reserve(sphere_tracks.size());
+  for (const SphereKey &key : sphere_tracks) {
+    sphere_keys.push_back(key);
+  }
+  instance_keys.reserve(instance_tracks.size());
+  for (const InstanceKey &key : instance_tracks) {
+    instance_keys.push_back(key);
+  }
+}
+
+Vect CompiledScene::triangleNormal(uint32_t i) const {
+  const float *p0 = triangleVertex(i, 0);
+  const float *p1 = triangleVertex(i, 1);
+  const float *p2 = triangleVertex(i, 2);
+  Vect ab{p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+  Vect ac{p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+  float nx = ab.y * ac.z - ab.z * ac.y;
+  float ny = ab.z * ac.x - ab.x * ac.z;
+  float nz = ab.x * ac.y - ab.y * ac.x;
+  return Vect{nx, ny, nz}.normalize();
+}
+
+uint32_t CompiledScene::triangleMaterial(uint32_t i) const {
+  // The last run starting at or before triangle i; the first starts at 0.
+  const TriangleRange *range = std::upper_bound(
+      tri_ranges.begin(), tri_ranges.end(), i,
+      [](uint32_t triangle, const TriangleRange &other) { return triangle < other.first_triangle; });
+  return range[-1].material;
+}
+
+float CompiledScene::animationLength() const {
+  float length = 0.0f;
+  for (const SphereKey &key : sphere_keys) {
+    length = std::max(length, key.time);
+  }
+  for (const InstanceKey &key : instance_keys) {
+    length = std::max(length, key.time);
+  }
+  return length;
+}
+
+void CompiledScene::animate(float time) {
+  // Views of a scene cache are copied the first time they change.
+  if (!sphere_keys.empty()) {
+    sphere_x.detach();
+    sphere_y.detach();
+    sphere_z.detach();
+  }
+  if (!instance_keys.empty()) { instances.detach(); }
+  // Read-only access: the keys themselves may still be a view.
+  const SceneArray<SphereKey> &sphere_keys = this->sphere_keys;
+  const SceneArray<InstanceKey> &instance_keys = this->instance_keys;
+
+  for (size_t first = 0, end; first < sphere_keys.size(); first = end) {
+    uint32_t sphere = sphere_keys[first].sphere;
+    for (end = first + 1; end < sphere_keys.size() && sphere_keys[end].sphere == sphere; end++) {}
+    float f;
+    size_t key = trackPosition(sphere_keys, first, end, time, f);
+    Vect center = f > 0.0f ? lerp(sphere_keys[key].center, sphere_keys[key + 1].center, f) : sphere_keys[key].center;
+    sphere_x[sphere] = center.x;
+    sphere_y[sphere] = center.y;
+    sphere_z[sphere] = center.z;
+  }
+
+  for (size_t first = 0, end; first < instance_keys.size(); first = end) {
+    uint32_t instance = instance_keys[first].instance;
+    for (end = first + 1; end < instance_keys.size() && instance_keys[end].instance == instance; end++) {}
+    float f;
+    size_t key = trackPosition(instance_keys, first, end, time, f);
+    const InstanceKey &a = instance_keys[key];
+    const InstanceKey &b = f > 0.0f ? instance_keys[key + 1] : a;
+    placeInstance(instances[instance], lerp(a.position, b.position, f), lerp(a.rotation, b.rotation, f),
+                  lerp(a.scale, b.scale, f));
+  }
+}
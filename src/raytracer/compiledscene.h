@@ -0,0 +1,148 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../configfile/scenedata.h"
+#include "scenearray.h"
+
+// Material as seen by the shading code: no name, referenced by index.
+struct ShadingMaterial
+{
+  Color color;
+  float glossiness;
+  float p;
+  float mirror;
+};
+
+// Material of the triangles from `first_triangle` up to the next range's
+// first, or to the last triangle.
+struct TriangleRange
+{
+  uint32_t first_triangle;
+  uint32_t material;
+};
+
+// Geometry of an `object`: a range of the triangle arrays, in the object's
+// own coordinates.
+struct SceneObject
+{
+  uint32_t first_triangle;
+  uint32_t triangle_count;
+};
+
+// One placement of a SceneObject. Both transforms are affine and stored as
+// the top three rows of a row-major 4x4 matrix.
+struct SceneInstance
+{
+  float to_world[12];
+  float to_object[12];
+  uint32_t object;
+  uint32_t material;
+};
+
+// Keyframes of animated spheres and instances, sorted by target and then
+// time. Between two keys the values are interpolated linearly; before the
+// first and after the last key of a track they hold.
+struct SphereKey
+{
+  uint32_t sphere;
+  float time;
+  Vect center;
+};
+
+struct InstanceKey
+{
+  uint32_t instance;
+  float time;
+  Vect position;
+  Vect rotation;  // degrees about x, then y, then z
+  Vect scale;
+};
+
+// Flat, read-only copy of a parsed scene laid out for tracing. Every sphere
+// and light attribute lives in its own contiguous array (structure of
+// arrays), triangles index one shared vertex array, and materials are
+// referenced by 32-bit index, so the hot path touches no pointers, strings
+// or per-object allocations.
+//
+// The arrays are built from a RenderingInfo or, for a scene loaded from a
+// SceneCache, view the mapped cache file.
+//
+// Do not modify any of this data after construction, except through
+// animate().
+struct CompiledScene
+{
+  float ambient = 0.0f;
+  float focal_length = 0.0f;
+  bool shadows = false;
+
+  bool has_dir_light = false;
+  Vect dir_light_direction;
+  float dir_light_intensity = 0.0f;
+
+  SceneArray<ShadingMaterial> materials;
+
+  // point lights
+  SceneArray<float> light_x;
+  SceneArray<float> light_y;
+  SceneArray<float> light_z;
+  SceneArray<float> light_intensity;
+
+  // spheres: center and squared radius
+  SceneArray<float> sphere_x;
+  SceneArray<float> sphere_y;
+  SceneArray<float> sphere_z;
+  SceneArray<float> sphere_r2;
+  SceneArray<uint32_t> sphere_material;
+
+  // triangles: three indices into the shared vertices each, as meshes come
+  // from their files, and the material of each run of triangles (one per
+  // mesh or object, one per stretch of loose triangles sharing a
+  // material). Edges and normals are worked out from the vertices when a
+  // triangle is tested or shaded, so a mesh triangle takes its 12 bytes of
+  // indices plus its share of the vertices.
+  SceneArray<float> vertices;  // x, y, z per vertex
+  SceneArray<uint32_t> tri_indices;
+  SceneArray<TriangleRange> tri_ranges;
+
+  // Objects and their instances. Object triangles follow all world
+  // triangles in the arrays above and are only reached through instances.
+  SceneArray<SceneObject> objects;
+  SceneArray<SceneInstance> instances;
+
+  SceneArray<SphereKey> sphere_keys;
+  SceneArray<InstanceKey> instance_keys;
+
+  // Mesh and object files the scene names, as written in it. Their
+  // vertices and triangles follow the scene's own in the arrays above.
+  std::vector<std::string> mesh_files;
+
+  // Empty scene, to be filled in by SceneCache.
+  CompiledScene() {}
+  explicit CompiledScene(const RenderingInfo *info);
+
+  uint32_t lightCount() const { return (uint32_t)light_x.size(); }
+  uint32_t sphereCount() const { return (uint32_t)sphere_x.size(); }
+  uint32_t triangleCount() const { return (uint32_t)(tri_indices.size() / 3); }
+  // Triangles placed directly in the world, i.e. not part of an object.
+  uint32_t worldTriangleCount() const { return objects.empty() ? triangleCount() : objects[0].first_triangle; }
+  uint32_t objectCount() const { return (uint32_t)objects.size(); }
+  uint32_t instanceCount() const { return (uint32_t)instances.size(); }
+
+  // Corner 0, 1 or 2 of triangle i, as x, y and z.
+  const float *triangleVertex(uint32_t i, int corner) const {
+    return &vertices[3 * (size_t)tri_indices[3 * (size_t)i + corner]];
+  }
+  // Unit normal of (p1 - p0) x (p2 - p0).
+  Vect triangleNormal(uint32_t i) const;
+  uint32_t triangleMaterial(uint32_t i) const;
+
+  bool animated() const { return !sphere_keys.empty() || !instance_keys.empty(); }
+  // Time of the last keyframe.
+  float animationLength() const;
+  // Moves every animated sphere and instance to where its track has it at
+  // `time`. Nothing else changes. Must not run while a frame renders; the
+  // Raytracer then needs updateScene() before the next one.
+  void animate(float time);
+};
@@ -0,0 +1,74 @@
+#include "lighttree.h"
+
+LightTree::LightTree(const CompiledScene *scene) : scene(scene) {
+  uint32_t count = scene->lightCount();
+  if (count == 0) { return; }
+  lights.resize(count);
+  for (uint32_t i = 0; i < count; i++) {
+    lights[i] = i;
+  }
+  nodes.reserve(2 * count);
+  buildRecursive(0, count);
+}
+
+uint32_t LightTree::buildRecursive(uint32_t begin, uint32_t end) {
+  uint32_t node_index = (uint32_t)nodes.size();
+  nodes.push_back(LightNode());
+
+  AABB bounds;
+  float intensity = 0.0f;
+  for (uint32_t i = begin; i < end; i++) {
+    uint32_t light = lights[i];
+    bounds.grow(scene->light_x[light], scene->light_y[light], scene->light_z[light]);
+    intensity += scene->light_intensity[light];
+  }
+  nodes[node_index].bounds = bounds;
+  nodes[node_index].intensity = intensity;
+
+  if (end - begin <= MAX_LEAF_LIGHTS) {
+    nodes[node_index].offset = begin;
+    nodes[node_index].count = end - begin;
+    return node_index;
+  }
+
+  // Lights are points, so a median split along the widest axis keeps the
+  // tree balanced and the boxes compact.
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (bounds.max[a] - bounds.min[a] > bounds.max[axis] - bounds.min[axis]) { axis = a; }
+  }
+  const SceneArray<float> &coordinate = axis == 0 ? scene->light_x : axis == 1 ? scene->light_y : scene->light_z;
+  uint32_t mid = begin + (end - begin) / 2;
+  std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+                   [&coordinate](uint32_t a, uint32_t b) { return coordinate[a] < coordinate[b]; });
+
+  buildRecursive(begin, mid);
+  uint32_t right = buildRecursive(mid, end);
+  nodes[node_index].offset = right;
+  nodes[node_index].count = 0;
+  return node_index;
+}
+
+float LightTree::distanceSquared(const AABB &box, const float point[3]) {
+  float d2 = 0.0f;
+  for (int a = 0; a < 3; a++) {
+    float d = std::max(std::max(box.min[a] - point[a], point[a] - box.max[a]), 0.0f);
+    d2 += d * d;
+  }
+  return d2;
+}
+
+float LightTree::importance(const LightNode &node, const float point[3]) const {
+  // Distance to the box center, but never less than half its diagonal, so
+  // a point inside or next to a large cluster does not see it as infinitely
+  // bright.
+  float d2 = 0.0f;
+  float half_diagonal2 = 0.0f;
+  for (int a = 0; a < 3; a++) {
+    float d = node.bounds.centroid(a) - point[a];
+    float h = 0.5f * (node.bounds.max[a] - node.bounds.min[a]);
+    d2 += d * d;
+    half_diagonal2 += h * h;
+  }
+  return node.intensity / std::max(std::max(d2, half_diagonal2), 1e-6f);
+}
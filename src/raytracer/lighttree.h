@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "compiledscene.h"
+
+// Irradiance below which lights are dropped unless told otherwise: about
+// one 8-bit step of a white surface.
+const float DEFAULT_LIGHT_CUTOFF = 4e-3f;
+
+// Node of a LightTree, flattened like BVHNode: the left child follows its
+// parent, the right child is at `offset`; leaves hold `count` lights
+// starting at `offset` in the tree's light order.
+struct LightNode {
+  AABB bounds;
+  // Sum of the intensities of all lights below the node.
+  float intensity;
+  uint32_t offset;
+  uint32_t count;
+
+  bool isLeaf() const { return count != 0; }
+};
+
+// Bounding volume hierarchy over a scene's point lights, for scenes with too
+// many lights to visit all of them at every hit. The irradiance of a point
+// light falls off as intensity / distance^2, so a whole subtree can be
+// bounded by its summed intensity over the squared distance to its box.
+class LightTree {
+ private:
+  // sample() weighs the lights of a leaf on the stack.
+  static const uint32_t MAX_LEAF_LIGHTS = 4;
+
+  std::vector<LightNode> nodes;
+  // Scene light indices in leaf order.
+  std::vector<uint32_t> lights;
+  const CompiledScene *scene;
+
+  uint32_t buildRecursive(uint32_t begin, uint32_t end);
+  // Estimated share of the light reaching `point` from below a node.
+  float importance(const LightNode &node, const float point[3]) const;
+  static float distanceSquared(const AABB &box, const float point[3]);
+
+ public:
+  explicit LightTree(const CompiledScene *scene);
+
+  bool empty() const { return nodes.empty(); }
+
+  // Calls visit(light, 1.0f) for every light whose irradiance at `point`
+  // may reach `cutoff`; whole subtrees below it are skipped unvisited.
+  template <class Visit>
+  void collect(const Vect &point, float cutoff, Visit visit) const;
+
+  // Picks `samples` lights at random, each by walking down the tree with
+  // the children's importance as odds, and calls visit(light, weight) with
+  // the weight that makes the sum an unbiased estimate over all lights.
+  // `seed` makes the choice repeatable for a given shading point.
+  template <class Visit>
+  void sample(const Vect &point, int samples, uint32_t seed, Visit visit) const;
+};
+
+template <class Visit>
+void LightTree::collect(const Vect &point, float cutoff, Visit visit) const {
+  if (nodes.empty()) { return; }
+  float p[3] = {point.x, point.y, point.z};
+  uint32_t stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const LightNode &node = nodes[stack[--stack_size]];
+    float d2 = distanceSquared(node.bounds, p);
+    if (d2 > 0.0f && node.intensity < cutoff * d2) { continue; }
+    if (node.isLeaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+        visit(lights[i], 1.0f);
+      }
+      continue;
+    }
+    stack[stack_size++] = node.offset;
+    stack[stack_size++] = (uint32_t)(&node - &nodes[0]) + 1;
+  }
+}
+
+template <class Visit>
+void LightTree::sample(const Vect &point, int samples, uint32_t seed, Visit visit) const {
+  if (nodes.empty() || samples <= 0) { return; }
+  float p[3] = {point.x, point.y, point.z};
+  uint32_t state = seed | 1u;
+  auto next = [&state]() {
+    // xorshift32, mapped to [0, 1).
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+  };
+
+  for (int s = 0; s < samples; s++) {
+    uint32_t index = 0;
+    float probability = 1.0f;
+    while (!nodes[index].isLeaf()) {
+      uint32_t left = index + 1;
+      uint32_t right = nodes[index].offset;
+      float wl = importance(nodes[left], p);
+      float wr = importance(nodes[right], p);
+      float pl = wl + wr > 0.0f ? wl / (wl + wr) : 0.5f;
+      if (next() < pl) {
+        index = left;
+        probability *= pl;
+      } else {
+        index = right;
+        probability *= 1.0f - pl;
+      }
+    }
+
+    // Within a leaf, by each light's own irradiance.
+    const LightNode &leaf = nodes[index];
+    float weights[MAX_LEAF_LIGHTS];
+    float total = 0.0f;
+    for (uint32_t i = 0; i < leaf.count; i++) {
+      uint32_t light = lights[leaf.offset + i];
+      float dx = scene->light_x[light] - p[0];
+      float dy = scene->light_y[light] - p[1];
+      float dz = scene->light_z[light] - p[2];
+      weights[i] = scene->light_intensity[light] / std::max(dx * dx + dy * dy + dz * dz, 1e-6f);
+      total += weights[i];
+    }
+    float u = next() * total;
+    uint32_t pick = 0;
+    while (pick + 1 < leaf.count && u >= weights[pick]) {
+      u -= weights[pick++];
+    }
+    probability *= total > 0.0f ? weights[pick] / total : 1.0f / leaf.count;
+    if (probability > 0.0f) { visit(lights[leaf.offset + pick], 1.0f / (samples * probability)); }
+  }
+}
@@ -0,0 +1,78 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() { close(); }
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string &path) {
+  close();
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) { return false; }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(file);
+    return false;
+  }
+  void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (view == NULL) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  file_handle = file;
+  mapping_handle = mapping;
+  bytes = (const char *)view;
+  length = (size_t)size.QuadPart;
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes != nullptr) { UnmapViewOfFile(bytes); }
+  if (mapping_handle != nullptr) { CloseHandle(mapping_handle); }
+  if (file_handle != nullptr) { CloseHandle(file_handle); }
+  bytes = nullptr;
+  length = 0;
+  mapping_handle = nullptr;
+  file_handle = nullptr;
+}
+#else
+bool MappedFile::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) { return false; }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void *view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  ::close(fd);
+  if (view == MAP_FAILED) { return false; }
+  bytes = (const char *)view;
+  length = (size_t)info.st_size;
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes != nullptr) { munmap((void *)bytes, length); }
+  bytes = nullptr;
+  length = 0;
+}
+#endif
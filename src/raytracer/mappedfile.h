@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+ private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  void *file_handle = nullptr;
+  void *mapping_handle = nullptr;
+#endif
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+ public:
+  MappedFile() {}
+  ~MappedFile();
+
+  // Maps `path`, replacing any earlier mapping. Empty files fail to map.
+  bool open(const std::string &path);
+  void close();
+
+  const char *data() const { return bytes; }
+  size_t size() const { return length; }
+};
@@ -0,0 +1,110 @@
+#include "packet.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PACKET_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace {
+#ifdef PACKET_X86
+void cpuid(int leaf, int subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+  int out[4];
+  __cpuidex(out, leaf, subleaf);
+  for (int i = 0; i < 4; i++) { regs[i] = (unsigned)out[i]; }
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+unsigned long long xgetbv0() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+}  // namespace
+
+PacketScene makePacketScene(const CompiledScene *scene, const BVH *bvh) {
+  PacketScene view;
+  view.nodes = bvh->getNodes().data();
+  view.node_count = (uint32_t)bvh->getNodes().size();
+  view.primitives = bvh->getPrimitives().data();
+  view.object_roots = bvh->getObjectRoots().data();
+  view.root = bvh->getRoot();
+
+  view.instances = scene->instances.data();
+
+  view.sphere_x = scene->sphere_x.data();
+  view.sphere_y = scene->sphere_y.data();
+  view.sphere_z = scene->sphere_z.data();
+  view.sphere_r2 = scene->sphere_r2.data();
+
+  view.vertices = scene->vertices.data();
+  view.tri_indices = scene->tri_indices.data();
+  return view;
+}
+
+SimdLevel detectSimdLevel() {
+#ifdef PACKET_X86
+  unsigned regs[4];
+  cpuid(0, 0, regs);
+  unsigned max_leaf = regs[0];
+
+  cpuid(1, 0, regs);
+  bool sse2 = (regs[3] >> 26) & 1;
+  bool osxsave = (regs[2] >> 27) & 1;
+  bool avx = (regs[2] >> 28) & 1;
+  if (!sse2) { return SIMD_SCALAR; }
+  if (!osxsave || !avx || max_leaf < 7) { return SIMD_SSE; }
+
+  // The OS has to save the wider registers on context switches too.
+  unsigned long long xcr0 = xgetbv0();
+  bool ymm_state = (xcr0 & 0x6) == 0x6;
+  bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+  cpuid(7, 0, regs);
+  bool avx2 = (regs[1] >> 5) & 1;
+  bool avx512f = (regs[1] >> 16) & 1;
+
+  if (avx512f && zmm_state) { return SIMD_AVX512; }
+  if (avx2 && ymm_state) { return SIMD_AVX2; }
+  return SIMD_SSE;
+#else
+  return SIMD_SCALAR;
+#endif
+}
+
+const char *simdLevelName(SimdLevel level) {
+  switch (level) {
+    case SIMD_SSE:
+      return "sse";
+    case SIMD_AVX2:
+      return "avx2";
+    case SIMD_AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+const PacketKernelTable *packetKernels(SimdLevel level) {
+  switch (level) {
+    case SIMD_SSE:
+      return packetKernelsSSE();
+    case SIMD_AVX2:
+      return packetKernelsAVX2();
+    case SIMD_AVX512:
+      return packetKernelsAVX512();
+    default:
+      return nullptr;
+  }
+}
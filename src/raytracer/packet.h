@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+
+#include "bvh.h"
+#include "compiledscene.h"
+#include "profile.h"
+
+enum SimdLevel {
+  SIMD_SCALAR = 0,
+  SIMD_SSE = 1,
+  SIMD_AVX2 = 2,
+  SIMD_AVX512 = 3
+};
+
+const int MAX_PACKET_WIDTH = 16;
+
+// Bundle of rays in SoA form. Only the first `width` lanes of the kernel
+// in use are read, and only those set in the caller's active mask count.
+struct RayPacket {
+  alignas(64) float ox[MAX_PACKET_WIDTH];
+  alignas(64) float oy[MAX_PACKET_WIDTH];
+  alignas(64) float oz[MAX_PACKET_WIDTH];
+  alignas(64) float dx[MAX_PACKET_WIDTH];
+  alignas(64) float dy[MAX_PACKET_WIDTH];
+  alignas(64) float dz[MAX_PACKET_WIDTH];
+};
+
+// Raw views of the BVH and scene arrays. The packet kernels are compiled
+// with wider instruction sets than the rest of the program, so they must
+// not call inline library code the linker could share with other objects.
+struct PacketScene {
+  const BVHNode *nodes;
+  uint32_t node_count;
+  const PrimitiveRef *primitives;
+  const uint32_t *object_roots;
+  uint32_t root;
+
+  const SceneInstance *instances;
+
+  const float *sphere_x;
+  const float *sphere_y;
+  const float *sphere_z;
+  const float *sphere_r2;
+
+  const float *vertices;
+  const uint32_t *tri_indices;
+};
+
+PacketScene makePacketScene(const CompiledScene *scene, const BVH *bvh);
+
+// Packet traversal kernels for one instruction set. The per-lane arithmetic
+// mirrors Raytracer::hitsSphere/hitsTriangle operation for operation, so a
+// lane gets the same hit as the single-ray path. With profiling compiled in,
+// they count their work per lane into `counters` (PROFILE_COUNTERS). Given
+// `lane_tests`, they add each lane's intersection tests to its entry, for
+// cost maps; nullptr skips that.
+struct PacketKernelTable {
+  int width;
+
+  // Closest hit in [0, inf) for every lane in `active`. Fills t, primitive
+  // and instance (NO_INSTANCE for world geometry) for the lanes that hit
+  // and returns their mask.
+  uint32_t (*closestHit)(const PacketScene &scene, const RayPacket &packet, uint32_t active, float *t,
+                         PrimitiveRef *primitive, uint32_t *instance, ProfileCounters *counters,
+                         uint32_t *lane_tests);
+
+  // Any hit in [0.0001, t_max) for every lane in `active`; returns the mask
+  // of lanes that are blocked.
+  uint32_t (*occluded)(const PacketScene &scene, const RayPacket &packet, float t_max, uint32_t active,
+                       ProfileCounters *counters, uint32_t *lane_tests);
+};
+
+// Best instruction set the CPU and OS support, from CPUID.
+SimdLevel detectSimdLevel();
+const char *simdLevelName(SimdLevel level);
+
+// Kernels for `level`, or nullptr for SIMD_SCALAR and for instruction sets
+// that were not compiled in.
+const PacketKernelTable *packetKernels(SimdLevel level);
+
+const PacketKernelTable *packetKernelsSSE();
+const PacketKernelTable *packetKernelsAVX2();
+const PacketKernelTable *packetKernelsAVX512();
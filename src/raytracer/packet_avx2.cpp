@@ -0,0 +1,12 @@
+// Built with the AVX2 code generation flags (see CMakeLists.txt); only
+// called after detectSimdLevel() has confirmed CPU support.
+#include "packet.h"
+#include "simd.h"
+
+#if defined(__AVX2__)
+#include "packet_kernels.h"
+
+const PacketKernelTable *packetKernelsAVX2() { return PacketKernels<Float8>::table(); }
+#else
+const PacketKernelTable *packetKernelsAVX2() { return nullptr; }
+#endif
@@ -0,0 +1,12 @@
+// Built with the AVX512 code generation flags (see CMakeLists.txt); only
+// called after detectSimdLevel() has confirmed CPU support.
+#include "packet.h"
+#include "simd.h"
+
+#if defined(__AVX512F__)
+#include "packet_kernels.h"
+
+const PacketKernelTable *packetKernelsAVX512() { return PacketKernels<Float16>::table(); }
+#else
+const PacketKernelTable *packetKernelsAVX512() { return nullptr; }
+#endif
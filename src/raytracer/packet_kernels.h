@@ -0,0 +1,323 @@
+#pragma once
+// Packet traversal and intersection, templated on a register wrapper from
+// simd.h. Included only by the per-instruction-set packet_*.cpp files, so
+// everything here works on the raw arrays of PacketScene.
+
+#include <limits>
+
+#include "packet.h"
+
+template <class V>
+struct PacketKernels {
+  typedef typename V::Reg Reg;
+  typedef typename V::Mask Mask;
+
+#ifdef RAYTRACER_PROFILE
+  static uint64_t laneCount(uint32_t bits) {
+    uint64_t count = 0;
+    for (; bits != 0; bits &= bits - 1) {
+      count++;
+    }
+    return count;
+  }
+
+  static void countTests(ProfileCounters *counters, const PrimitiveRef &p, uint32_t lanes) {
+    (p.type == PRIMITIVE_SPHERE ? counters->sphere_tests : counters->triangle_tests) += laneCount(lanes);
+  }
+#endif
+
+  // Tests per lane are counted in a register, one add per primitive, and
+  // handed out to lane_tests at the end.
+  static void countLaneTests(Reg *tests, const Mask &lanes) {
+    *tests = V::add(*tests, V::select(lanes, V::set1(1.0f), V::set1(0.0f)));
+  }
+
+  static void addLaneTests(uint32_t *lane_tests, const Reg &tests) {
+    alignas(64) float counts[V::LANES];
+    V::store(counts, tests);
+    for (int lane = 0; lane < V::LANES; lane++) {
+      lane_tests[lane] += (uint32_t)counts[lane];
+    }
+  }
+
+  static Mask boxTest(const AABB &box, const Reg o[3], const Reg inv_dir[3], Reg t_min, Reg t_max) {
+    for (int a = 0; a < 3; a++) {
+      Reg t0 = V::mul(V::sub(V::set1(box.min[a]), o[a]), inv_dir[a]);
+      Reg t1 = V::mul(V::sub(V::set1(box.max[a]), o[a]), inv_dir[a]);
+      // NaN candidates lose both comparisons and leave the interval as is.
+      t_min = V::max(V::min(t0, t1), t_min);
+      t_max = V::min(V::max(t0, t1), t_max);
+    }
+    return V::le(t_min, t_max);
+  }
+
+  static Mask sphere(const PacketScene &scene, uint32_t i, const Reg o[3], const Reg d[3],
+                     Reg t_min, Reg t_max, Reg &t_out) {
+    Reg ocx = V::sub(o[0], V::set1(scene.sphere_x[i]));
+    Reg ocy = V::sub(o[1], V::set1(scene.sphere_y[i]));
+    Reg ocz = V::sub(o[2], V::set1(scene.sphere_z[i]));
+
+    Reg two = V::set1(2.0f);
+    Reg a = V::add(V::add(V::mul(d[0], d[0]), V::mul(d[1], d[1])), V::mul(d[2], d[2]));
+    Reg b = V::add(V::add(V::mul(V::mul(d[0], two), ocx), V::mul(V::mul(d[1], two), ocy)),
+                   V::mul(V::mul(d[2], two), ocz));
+    Reg c = V::sub(V::add(V::add(V::mul(ocx, ocx), V::mul(ocy, ocy)), V::mul(ocz, ocz)),
+                   V::set1(scene.sphere_r2[i]));
+
+    Reg discriminant = V::sub(V::mul(b, b), V::mul(V::mul(V::set1(4.0f), a), c));
+    Mask reject = V::lt(discriminant, V::set1(0.0f));
+
+    Reg sqrt_disc = V::sqrt(discriminant);
+    Reg neg_b = V::neg(b);
+    Reg two_a = V::mul(two, a);
+    Reg t1 = V::div(V::add(neg_b, sqrt_disc), two_a);
+    Reg t2 = V::div(V::sub(neg_b, sqrt_disc), two_a);
+    Reg lesser_t = V::min(t2, t1);
+    reject = V::maskOr(reject, V::maskOr(V::gt(lesser_t, t_max), V::lt(lesser_t, t_min)));
+
+    t_out = lesser_t;
+    return reject;
+  }
+
+  static Mask triangle(const PacketScene &scene, uint32_t i, const Reg o[3], const Reg d[3],
+                       Reg t_min, Reg t_max, Reg &t_out) {
+    const float *p0 = scene.vertices + 3 * (size_t)scene.tri_indices[3 * (size_t)i];
+    const float *p1 = scene.vertices + 3 * (size_t)scene.tri_indices[3 * (size_t)i + 1];
+    const float *p2 = scene.vertices + 3 * (size_t)scene.tri_indices[3 * (size_t)i + 2];
+    Reg a = V::set1(p0[0] - p1[0]);
+    Reg b = V::set1(p0[1] - p1[1]);
+    Reg c = V::set1(p0[2] - p1[2]);
+    Reg dd = V::set1(p0[0] - p2[0]);
+    Reg e = V::set1(p0[1] - p2[1]);
+    Reg f = V::set1(p0[2] - p2[2]);
+    Reg j = V::sub(V::set1(p0[0]), o[0]);
+    Reg k = V::sub(V::set1(p0[1]), o[1]);
+    Reg l = V::sub(V::set1(p0[2]), o[2]);
+
+    Reg ei_hf = V::sub(V::mul(e, d[2]), V::mul(d[1], f));
+    Reg gf_di = V::sub(V::mul(d[0], f), V::mul(dd, d[2]));
+    Reg dh_eg = V::sub(V::mul(dd, d[1]), V::mul(e, d[0]));
+    Reg ak_jb = V::sub(V::mul(a, k), V::mul(j, b));
+    Reg jc_al = V::sub(V::mul(j, c), V::mul(a, l));
+    Reg bl_kc = V::sub(V::mul(b, l), V::mul(k, c));
+
+    Reg M = V::add(V::add(V::mul(a, ei_hf), V::mul(b, gf_di)), V::mul(c, dh_eg));
+    Reg t = V::div(V::neg(V::add(V::add(V::mul(f, ak_jb), V::mul(e, jc_al)), V::mul(dd, bl_kc))), M);
+    Mask reject = V::maskOr(V::lt(t, t_min), V::ge(t, t_max));
+
+    Reg gamma = V::div(V::add(V::add(V::mul(d[2], ak_jb), V::mul(d[1], jc_al)), V::mul(d[0], bl_kc)), M);
+    reject = V::maskOr(reject, V::maskOr(V::lt(gamma, V::set1(0.0f)), V::gt(gamma, V::set1(1.0f))));
+
+    Reg beta = V::div(V::add(V::add(V::mul(j, ei_hf), V::mul(k, gf_di)), V::mul(l, dh_eg)), M);
+    reject = V::maskOr(reject, V::maskOr(V::lt(beta, V::set1(0.0f)), V::gt(beta, V::sub(V::set1(1.0f), gamma))));
+
+    t_out = t;
+    return reject;
+  }
+
+  static void loadRays(const RayPacket &packet, Reg o[3], Reg d[3], Reg inv_dir[3]) {
+    o[0] = V::load(packet.ox);
+    o[1] = V::load(packet.oy);
+    o[2] = V::load(packet.oz);
+    d[0] = V::load(packet.dx);
+    d[1] = V::load(packet.dy);
+    d[2] = V::load(packet.dz);
+    for (int a = 0; a < 3; a++) {
+      inv_dir[a] = V::div(V::set1(1.0f), d[a]);
+    }
+  }
+
+  // The packet in the object space of an instance, computed exactly as
+  // toObjectSpace in raytracer.cpp does for a single ray.
+  static void toObjectSpace(const SceneInstance &instance, const Reg o[3], const Reg d[3], Reg object_o[3],
+                            Reg object_d[3], Reg inv_dir[3]) {
+    for (int a = 0; a < 3; a++) {
+      const float *row = instance.to_object + 4 * a;
+      Reg m0 = V::set1(row[0]);
+      Reg m1 = V::set1(row[1]);
+      Reg m2 = V::set1(row[2]);
+      object_o[a] = V::add(V::add(V::add(V::mul(m0, o[0]), V::mul(m1, o[1])), V::mul(m2, o[2])), V::set1(row[3]));
+      object_d[a] = V::add(V::add(V::mul(m0, d[0]), V::mul(m1, d[1])), V::mul(m2, d[2]));
+      inv_dir[a] = V::div(V::set1(1.0f), object_d[a]);
+    }
+  }
+
+  // Closest hits below node `root` for the lanes in `live`, lowering t_best.
+  // dir holds the lanes of d, for ordering children; instance is recorded
+  // with every hit. In the top level, instance leaves continue in their
+  // object's tree; object trees hold only triangles. (Two instantiations
+  // rather than recursion, so both inline and keep the rays in registers.)
+  template <bool TOP_LEVEL>
+  static void closestHitFrom(const PacketScene &scene, uint32_t root, const Reg o[3], const Reg d[3],
+                             const Reg inv_dir[3], const float *const dir[3], const Mask &live, uint32_t instance,
+                             Reg &t_best, uint32_t &hit_lanes, PrimitiveRef *primitive, uint32_t *instance_out,
+                             ProfileCounters *counters, Reg *tests) {
+    const BVHNode *nodes = scene.nodes;
+    const PrimitiveRef *primitives = scene.primitives;
+    Reg zero = V::set1(0.0f);
+
+    uint32_t stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = root;
+    while (stack_size > 0) {
+      const BVHNode &node = nodes[stack[--stack_size]];
+      Mask entered = V::maskAnd(live, boxTest(node.bounds, o, inv_dir, zero, t_best));
+      uint32_t entered_bits = V::bits(entered);
+      if (entered_bits == 0) { continue; }
+
+      if (node.count != 0) {
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+          const PrimitiveRef &p = primitives[i];
+          if (TOP_LEVEL && p.type == PRIMITIVE_INSTANCE) {
+            const SceneInstance &placed = scene.instances[p.index];
+            Reg object_o[3], object_d[3], object_inv_dir[3];
+            toObjectSpace(placed, o, d, object_o, object_d, object_inv_dir);
+            alignas(64) float object_dir[3][V::LANES];
+            for (int a = 0; a < 3; a++) {
+              V::store(object_dir[a], object_d[a]);
+            }
+            const float *object_dir_lanes[3] = {object_dir[0], object_dir[1], object_dir[2]};
+            closestHitFrom<false>(scene, scene.object_roots[placed.object], object_o, object_d, object_inv_dir,
+                           object_dir_lanes, entered, p.index, t_best, hit_lanes, primitive, instance_out, counters,
+                           tests);
+            continue;
+          }
+#ifdef RAYTRACER_PROFILE
+          countTests(counters, p, entered_bits);
+#endif
+          if (tests != nullptr) { countLaneTests(tests, entered); }
+          Reg t_hit;
+          Mask reject = p.type == PRIMITIVE_SPHERE ? sphere(scene, p.index, o, d, zero, t_best, t_hit)
+                                                   : triangle(scene, p.index, o, d, zero, t_best, t_hit);
+          Mask closer = V::maskAndNot(V::maskAndNot(entered, reject), V::ge(t_hit, t_best));
+          uint32_t closer_bits = V::bits(closer);
+          if (closer_bits == 0) { continue; }
+
+          t_best = V::select(closer, t_hit, t_best);
+          hit_lanes |= closer_bits;
+          for (uint32_t lane = 0; closer_bits != 0; lane++, closer_bits >>= 1) {
+            if (closer_bits & 1) {
+              primitive[lane] = p;
+              instance_out[lane] = instance;
+            }
+          }
+        }
+        continue;
+      }
+
+      // Order children front to back along the split axis, judged by the
+      // first ray that entered the node.
+      int lane = 0;
+      while (!((entered_bits >> lane) & 1)) { lane++; }
+      uint32_t left = (uint32_t)(&node - &nodes[0]) + 1;
+      uint32_t right = node.offset;
+      if (dir[node.axis][lane] < 0.0f) {
+        stack[stack_size++] = left;
+        stack[stack_size++] = right;
+      } else {
+        stack[stack_size++] = right;
+        stack[stack_size++] = left;
+      }
+    }
+  }
+
+  static uint32_t closestHit(const PacketScene &scene, const RayPacket &packet, uint32_t active, float *t,
+                             PrimitiveRef *primitive, uint32_t *instance, ProfileCounters *counters,
+                             uint32_t *lane_tests) {
+    if (scene.node_count == 0 || active == 0) { return 0; }
+
+    Reg o[3], d[3], inv_dir[3];
+    loadRays(packet, o, d, inv_dir);
+    const float *dir[3] = {packet.dx, packet.dy, packet.dz};
+
+    Mask live = V::fromBits(active);
+    // Inactive lanes get an empty interval so they never enter a box.
+    Reg t_best = V::select(live, V::set1(std::numeric_limits<float>::max()), V::set1(-1.0f));
+    uint32_t hit_lanes = 0;
+    Reg tests = V::set1(0.0f);
+    closestHitFrom<true>(scene, scene.root, o, d, inv_dir, dir, live, NO_INSTANCE, t_best, hit_lanes, primitive, instance,
+                         counters, lane_tests != nullptr ? &tests : nullptr);
+    if (lane_tests != nullptr) { addLaneTests(lane_tests, tests); }
+#ifdef RAYTRACER_PROFILE
+    counters->hits += laneCount(hit_lanes);
+#endif
+
+    alignas(64) float t_lanes[V::LANES];
+    V::store(t_lanes, t_best);
+    for (int lane = 0; lane < V::LANES; lane++) {
+      if ((hit_lanes >> lane) & 1) { t[lane] = t_lanes[lane]; }
+    }
+    return hit_lanes;
+  }
+
+  // Adds the lanes of `active` blocked below node `root` to `blocked`.
+  template <bool TOP_LEVEL>
+  static uint32_t occludedFrom(const PacketScene &scene, uint32_t root, const Reg o[3], const Reg d[3],
+                               const Reg inv_dir[3], const Reg &t_min, const Reg &t_limit, uint32_t active,
+                               uint32_t blocked, ProfileCounters *counters, Reg *tests) {
+    const BVHNode *nodes = scene.nodes;
+    const PrimitiveRef *primitives = scene.primitives;
+
+    uint32_t stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = root;
+    while (stack_size > 0) {
+      const BVHNode &node = nodes[stack[--stack_size]];
+      Mask live = V::fromBits(active & ~blocked);
+      Mask entered = V::maskAnd(live, boxTest(node.bounds, o, inv_dir, t_min, t_limit));
+      if (V::bits(entered) == 0) { continue; }
+
+      if (node.count != 0) {
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+          const PrimitiveRef &p = primitives[i];
+          if (TOP_LEVEL && p.type == PRIMITIVE_INSTANCE) {
+            const SceneInstance &placed = scene.instances[p.index];
+            Reg object_o[3], object_d[3], object_inv_dir[3];
+            toObjectSpace(placed, o, d, object_o, object_d, object_inv_dir);
+            blocked = occludedFrom<false>(scene, scene.object_roots[placed.object], object_o, object_d, object_inv_dir,
+                                   t_min, t_limit, V::bits(entered), blocked, counters, tests);
+            continue;
+          }
+#ifdef RAYTRACER_PROFILE
+          countTests(counters, p, V::bits(entered));
+#endif
+          if (tests != nullptr) { countLaneTests(tests, entered); }
+          Reg t_hit;
+          Mask reject = p.type == PRIMITIVE_SPHERE ? sphere(scene, p.index, o, d, t_min, t_limit, t_hit)
+                                                   : triangle(scene, p.index, o, d, t_min, t_limit, t_hit);
+          blocked |= V::bits(V::maskAndNot(entered, reject));
+        }
+        // Every ray already blocked: no need to look any further.
+        if ((active & ~blocked) == 0) { return blocked; }
+        continue;
+      }
+
+      stack[stack_size++] = node.offset;
+      stack[stack_size++] = (uint32_t)(&node - &nodes[0]) + 1;
+    }
+    return blocked;
+  }
+
+  static uint32_t occluded(const PacketScene &scene, const RayPacket &packet, float t_max, uint32_t active,
+                           ProfileCounters *counters, uint32_t *lane_tests) {
+    if (scene.node_count == 0 || active == 0) { return 0; }
+
+    Reg o[3], d[3], inv_dir[3];
+    loadRays(packet, o, d, inv_dir);
+    Reg t_min = V::set1(0.0001f);
+    Reg t_limit = V::set1(t_max);
+    Reg tests = V::set1(0.0f);
+    uint32_t blocked = occludedFrom<true>(scene, scene.root, o, d, inv_dir, t_min, t_limit, active, 0, counters,
+                                          lane_tests != nullptr ? &tests : nullptr);
+    if (lane_tests != nullptr) { addLaneTests(lane_tests, tests); }
+#ifdef RAYTRACER_PROFILE
+    counters->shadow_early_exits += laneCount(blocked);
+#endif
+    return blocked;
+  }
+
+  static const PacketKernelTable *table() {
+    static const PacketKernelTable kernels = {V::LANES, closestHit, occluded};
+    return &kernels;
+  }
+};
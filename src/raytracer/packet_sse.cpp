@@ -0,0 +1,12 @@
+// Built with the SSE code generation flags (see CMakeLists.txt); only
+// called after detectSimdLevel() has confirmed CPU support.
+#include "packet.h"
+#include "simd.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include "packet_kernels.h"
+
+const PacketKernelTable *packetKernelsSSE() { return PacketKernels<Float4>::table(); }
+#else
+const PacketKernelTable *packetKernelsSSE() { return nullptr; }
+#endif
@@ -0,0 +1,188 @@
+#include "profile.h"
+
+#include <fstream>
+#include <iostream>
+
+#include "raytracer.h"
+
+PROFILE_THREAD_LOCAL Profiler::ThreadData *Profiler::local_thread = nullptr;
+
+const int Profiler::MAX_FRAMES;
+const size_t Profiler::MAX_EVENTS;
+
+namespace {
+void writeCounters(std::ostream &out, uint64_t primary, uint64_t shadow, uint64_t reflection,
+                   const ProfileCounters &counters) {
+  out << "\"primary_rays\": " << primary << ", \"shadow_rays\": " << shadow << ", \"reflection_rays\": " << reflection
+      << ", \"sphere_tests\": " << counters.sphere_tests << ", \"triangle_tests\": " << counters.triangle_tests
+      << ", \"hits\": " << counters.hits << ", \"shadow_early_exits\": " << counters.shadow_early_exits;
+}
+
+template <typename Timers>
+void writeTimers(std::ostream &out, const Timers &timers) {
+  out << "{";
+  bool first = true;
+  for (const auto &timer : timers) {
+    out << (first ? "" : ", ") << "\"" << timer.first << "\": {\"count\": " << timer.second.count
+        << ", \"ms\": " << timer.second.total_us / 1000.0 << "}";
+    first = false;
+  }
+  out << "}";
+}
+}  // namespace
+
+Profiler &Profiler::instance() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::ThreadData &Profiler::thread() {
+  std::lock_guard<std::mutex> lock(mutex);
+  threads.emplace_back(new ThreadData());
+  ThreadData *data = threads.back().get();
+  data->id = (int)threads.size();
+  local_thread = data;
+  return *data;
+}
+
+void Profiler::beginFrame(int frame, int count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &data : threads) {
+    data->counters = ProfileCounters();
+  }
+  if (frames.size() == (size_t)MAX_FRAMES) {
+    // Totals still pending for the oldest frame go with it.
+    foldTimers();
+    frames.pop_front();
+    dropped_frames++;
+  }
+  frame_start = Clock::now();
+  FrameRecord record = FrameRecord();
+  record.frame = frame;
+  record.count = count;
+  record.start_us = micros(frame_start);
+  frames.push_back(record);
+  current = dropped_frames + (int)frames.size() - 1;
+}
+
+void Profiler::endFrame(const RayStats &rays) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (current < 0) { return; }
+  FrameRecord &record = frames[current - dropped_frames];
+  record.duration_us = micros(Clock::now()) - record.start_us;
+  record.primary_rays = rays.primary;
+  record.shadow_rays = rays.shadow;
+  record.reflection_rays = rays.reflection;
+  for (auto &data : threads) {
+    record.counters += data->counters;
+  }
+  foldTimers();
+  current = -1;
+}
+
+void Profiler::foldTimers() {
+  for (auto &data : threads) {
+    std::lock_guard<std::mutex> events_lock(data->mutex);
+    for (const PendingTotal &pending : data->pending) {
+      if (pending.frame >= 0 && pending.frame < dropped_frames) { continue; }
+      std::map<std::string, TimerTotal> &timers =
+          pending.frame < 0 ? outside_frames : frames[pending.frame - dropped_frames].timers;
+      TimerTotal &total = timers[pending.name];
+      total.count += pending.total.count;
+      total.total_us += pending.total.total_us;
+    }
+    data->pending.clear();
+  }
+}
+
+void Profiler::record(const char *name, Clock::time_point start, Clock::time_point end) {
+  ThreadData *data = local_thread != nullptr ? local_thread : &thread();
+  Event event = {name, micros(start), micros(end) - micros(start), current};
+  std::lock_guard<std::mutex> lock(data->mutex);
+  // Only a few timers run in a frame, so a search beats a map here.
+  PendingTotal *pending = nullptr;
+  for (PendingTotal &candidate : data->pending) {
+    if (candidate.frame == event.frame && candidate.name == name) {
+      pending = &candidate;
+      break;
+    }
+  }
+  if (pending == nullptr) {
+    data->pending.push_back({event.frame, name, TimerTotal()});
+    pending = &data->pending.back();
+  }
+  pending->total.count++;
+  pending->total.total_us += event.duration_us;
+
+  if (!keep_events) { return; }
+  if (data->events.size() < MAX_EVENTS) {
+    data->events.push_back(event);
+  } else {
+    data->events[data->next_event] = event;
+    data->next_event = (data->next_event + 1) % MAX_EVENTS;
+  }
+}
+
+bool Profiler::writeJSON(const std::string &filename) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    std::cout << "File " << filename << " failed to open" << std::endl;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  foldTimers();
+
+  file << "{\n  \"outside_frames\": ";
+  writeTimers(file, outside_frames);
+  file << ",\n  \"frames\": [";
+  for (size_t i = 0; i < frames.size(); i++) {
+    const FrameRecord &record = frames[i];
+    file << (i == 0 ? "\n" : ",\n") << "    {\"frame\": " << record.frame << ", \"count\": " << record.count
+         << ", \"ms\": " << record.duration_us / 1000.0 << ", ";
+    writeCounters(file, record.primary_rays, record.shadow_rays, record.reflection_rays, record.counters);
+    file << ", \"timers\": ";
+    writeTimers(file, record.timers);
+    file << "}";
+  }
+  file << "\n  ]\n}\n";
+  return file.good();
+}
+
+bool Profiler::writeTrace(const std::string &filename) {
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    std::cout << "File " << filename << " failed to open" << std::endl;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"raytracer\"}}";
+  for (auto &data : threads) {
+    std::lock_guard<std::mutex> events_lock(data->mutex);
+    file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << data->id
+         << ", \"args\": {\"name\": \"thread " << data->id << "\"}}";
+    // Oldest first.
+    for (size_t i = 0; i < data->events.size(); i++) {
+      const Event &event = data->events[(data->next_event + i) % data->events.size()];
+      file << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"raytracer\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+           << data->id << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us;
+      if (event.frame >= dropped_frames) {
+        file << ", \"args\": {\"frame\": " << frames[event.frame - dropped_frames].frame << "}";
+      }
+      file << "}";
+    }
+  }
+  // Frames on a track of their own, with their counters alongside.
+  file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"frames\"}}";
+  for (const FrameRecord &record : frames) {
+    file << ",\n{\"name\": \"frame " << record.frame << "\", \"cat\": \"frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0"
+         << ", \"ts\": " << record.start_us << ", \"dur\": " << record.duration_us << "}";
+    file << ",\n{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << record.start_us << ", \"args\": {";
+    writeCounters(file, record.primary_rays, record.shadow_rays, record.reflection_rays, record.counters);
+    file << "}}";
+  }
+  file << "\n]}\n";
+  return file.good();
+}
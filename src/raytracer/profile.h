@@ -0,0 +1,185 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct RayStats;
+
+// GCC and Clang guard every access to an extern thread_local in case it
+// needs constructing, which costs more than the counting itself; __thread
+// promises it never does.
+#if defined(__GNUC__)
+#define PROFILE_THREAD_LOCAL __thread
+#else
+#define PROFILE_THREAD_LOCAL thread_local
+#endif
+
+// Counters and scoped timers for finding where frame time goes, exported per
+// frame as JSON and as Chrome trace events (chrome://tracing, Perfetto).
+// They are only compiled in with RAYTRACER_PROFILE defined (the CMake option
+// of that name); otherwise PROFILE_SCOPE and PROFILE_COUNT expand to nothing
+// and add no work to the hot paths. The raytracer still counts primitive
+// tests on each thread in every build, one increment per test, since cost
+// maps (--cost-map) are chosen at run time.
+
+// Intersection work, counted per thread. The rays themselves are counted
+// by the raytracer in RayStats either way.
+struct ProfileCounters {
+  uint64_t sphere_tests = 0;
+  uint64_t triangle_tests = 0;
+  // Closest-hit queries that found something.
+  uint64_t hits = 0;
+  // Shadow rays that stopped at the first blocker found.
+  uint64_t shadow_early_exits = 0;
+
+  ProfileCounters &operator+=(const ProfileCounters &other) {
+    sphere_tests += other.sphere_tests;
+    triangle_tests += other.triangle_tests;
+    hits += other.hits;
+    shadow_early_exits += other.shadow_early_exits;
+    return *this;
+  }
+};
+
+class Profiler {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  static Profiler &instance();
+
+  // Starts a frame: timers from now on belong to it and the counters
+  // restart. `frame` is the number it is reported under; `count` frames
+  // rendered together as a batch share one record.
+  void beginFrame(int frame, int count = 1);
+  // Ends the frame begun last, with the rays the raytracer counted in it.
+  // Called while no thread traces, so every thread's counters are settled.
+  // Its timers are added up into its record here.
+  void endFrame(const RayStats &rays);
+
+  // Whether to keep each timed scope for writeTrace(); off by default, since
+  // writeJSON() only needs the totals. Each thread keeps its last
+  // MAX_EVENTS scopes.
+  void keepEvents(bool keep) { keep_events = keep; }
+
+  // Per frame: time, ray and intersection counts and the total time of each
+  // timer; timers outside frames (parsing, building) are listed apart. Only
+  // the last MAX_FRAMES frames are kept.
+  bool writeJSON(const std::string &filename);
+  // Every timed scope kept as a complete event on its thread's track, and
+  // the counters of each frame as counter events.
+  bool writeTrace(const std::string &filename);
+
+  // The calling thread's counters.
+  static ProfileCounters &counters() {
+    ThreadData *data = local_thread;
+    return data != nullptr ? data->counters : instance().thread().counters;
+  }
+  void record(const char *name, Clock::time_point start, Clock::time_point end);
+
+ private:
+  static const int MAX_FRAMES = 10000;
+  static const size_t MAX_EVENTS = 1 << 18;
+
+  struct TimerTotal {
+    uint64_t count = 0;
+    int64_t total_us = 0;
+  };
+  struct Event {
+    const char *name;
+    int64_t start_us;
+    int64_t duration_us;
+    // Number of the frame begun it happened in, counting from 0, or -1.
+    int frame;
+  };
+  // Totals of one timer in one frame not yet added to the frame's record.
+  struct PendingTotal {
+    int frame;
+    const char *name;
+    TimerTotal total;
+  };
+  // What one thread has recorded. The thread owns the counters; the rest is
+  // also read by the exporting thread, so it is guarded.
+  struct ThreadData {
+    int id;
+    ProfileCounters counters;
+    std::mutex mutex;
+    std::vector<PendingTotal> pending;
+    // A ring once full: `next_event` is the oldest.
+    std::vector<Event> events;
+    size_t next_event = 0;
+  };
+  struct FrameRecord {
+    int frame;
+    int count;
+    int64_t start_us;
+    int64_t duration_us;
+    uint64_t primary_rays;
+    uint64_t shadow_rays;
+    uint64_t reflection_rays;
+    ProfileCounters counters;
+    std::map<std::string, TimerTotal> timers;
+  };
+
+  static PROFILE_THREAD_LOCAL ThreadData *local_thread;
+
+  Clock::time_point epoch = Clock::now();
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadData>> threads;
+  // The last MAX_FRAMES frames; `dropped_frames` older ones were let go.
+  std::deque<FrameRecord> frames;
+  int dropped_frames = 0;
+  std::map<std::string, TimerTotal> outside_frames;
+  // Number of the frame being rendered, counting from 0, or -1. Read by
+  // every thread that records an event.
+  std::atomic<int> current{-1};
+  std::atomic<bool> keep_events{false};
+  Clock::time_point frame_start;
+
+  Profiler() {}
+  // The calling thread's data, registered on first use.
+  ThreadData &thread();
+  // Adds every thread's pending totals to the records. Called with `mutex`
+  // held.
+  void foldTimers();
+  int64_t micros(Clock::time_point time) const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - epoch).count();
+  }
+};
+
+// Times the enclosing block under `name`, which must be a string literal.
+class ProfileScope {
+ public:
+  explicit ProfileScope(const char *name) : name(name), start(Profiler::Clock::now()) {}
+  ~ProfileScope() { Profiler::instance().record(name, start, Profiler::Clock::now()); }
+
+ private:
+  const char *name;
+  Profiler::Clock::time_point start;
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef RAYTRACER_PROFILE
+const bool PROFILE_ENABLED = true;
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+// Adds n to one of the calling thread's ProfileCounters.
+#define PROFILE_COUNT(counter, n) (Profiler::counters().counter += (n))
+// Counters for code that must not call into the profiler itself (the
+// packet kernels); nullptr when profiling is compiled out.
+#define PROFILE_COUNTERS (&Profiler::counters())
+#else
+const bool PROFILE_ENABLED = false;
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_COUNT(counter, n) ((void)0)
+#define PROFILE_COUNTERS ((ProfileCounters *)nullptr)
+#endif
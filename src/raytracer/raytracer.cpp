@@ -1,14 +1,90 @@
 #include "raytracer.h"
 
-bool Raytracer::hits(Vect &origin, Vect &direction, Sphere *sphere, float min_t, float max_t, float &return_t) {
-  Vect center = sphere->center;
-  float radius = sphere->radius;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+// Refitted top levels whose SAH cost grew past this factor are rebuilt.
+const float REBUILD_DEGRADATION = 1.3f;
+
+// The ray in the object space of `instance`. The direction is not
+// renormalized, so t measures the same point in both spaces. The packet
+// kernels do the same arithmetic in the same order.
+void toObjectSpace(const SceneInstance &instance, const Vect &origin, const Vect &direction, Vect &object_origin,
+                   Vect &object_direction) {
+  const float *m = instance.to_object;
+  object_origin = Vect{m[0] * origin.x + m[1] * origin.y + m[2] * origin.z + m[3],
+                       m[4] * origin.x + m[5] * origin.y + m[6] * origin.z + m[7],
+                       m[8] * origin.x + m[9] * origin.y + m[10] * origin.z + m[11]};
+  object_direction = Vect{m[0] * direction.x + m[1] * direction.y + m[2] * direction.z,
+                          m[4] * direction.x + m[5] * direction.y + m[6] * direction.z,
+                          m[8] * direction.x + m[9] * direction.y + m[10] * direction.z};
+}
+
+// Seed for sampling lights at a hit, the same every time it is shaded.
+uint32_t hashPoint(const Vect &point) {
+  uint32_t bits[3];
+  memcpy(&bits[0], &point.x, sizeof(float));
+  memcpy(&bits[1], &point.y, sizeof(float));
+  memcpy(&bits[2], &point.z, sizeof(float));
+  uint32_t hash = 2166136261u;
+  for (uint32_t b : bits) {
+    hash = (hash ^ b) * 16777619u;
+    hash ^= hash >> 15;
+  }
+  return hash;
+}
+
+// All the rows a frame holds.
+Region frameRegion(const Frame &frame) {
+  return {0, frame.firstRow(), frame.width(), frame.firstRow() + frame.rows()};
+}
+
+// Intersection tests of the single-ray path on the calling thread, read
+// around each pixel when recording costs. Counted in every build, with or
+// without profiling: always counting is cheaper than asking first.
+PROFILE_THREAD_LOCAL uint64_t primitive_tests = 0;
+
+float nanoseconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<float, std::nano>(end - start).count();
+}
+
+// Point i of the Halton sequence in `base`, in [0, 1). Point 0 is 0, so the
+// sequence starts at a pixel's corner, where the first pass samples.
+float radicalInverse(int i, int base) {
+  float inverse = 0.0f;
+  float digit = 1.0f / base;
+  for (; i > 0; i /= base, digit /= base) {
+    inverse += (i % base) * digit;
+  }
+  return inverse;
+}
+
+// A color at the precision a Frame stores it.
+Color stored(Color c) {
+  return {halfToFloat(floatToHalf(c.r)), halfToFloat(floatToHalf(c.g)), halfToFloat(floatToHalf(c.b))};
+}
+
+float contrast(Color a, Color b) {
+  return std::max(std::fabs(a.r - b.r), std::max(std::fabs(a.g - b.g), std::fabs(a.b - b.b)));
+}
+}  // namespace
+
+bool Raytracer::hitsSphere(Vect &origin, Vect &direction, uint32_t sphere, float min_t, float max_t, float &return_t) {
+  PROFILE_COUNT(sphere_tests, 1);
+  primitive_tests++;
+  Vect center{scene->sphere_x[sphere], scene->sphere_y[sphere], scene->sphere_z[sphere]};
 
   Vect oc = origin - center;
 
   float a = direction * direction;
   float b = (2 * direction) * oc;
-  float c = oc * oc - radius * radius;
+  float c = oc * oc - scene->sphere_r2[sphere];
 
   float discriminant = b * b - 4 * a * c;
   if (discriminant < 0.0f) { return false; }
@@ -23,20 +99,22 @@ bool Raytracer::hits(Vect &origin, Vect &direction, Sphere *sphere, float min_t,
   return true;
 }
 
-bool Raytracer::hits(Vect &origin, Vect &direction, Triangle *triangle, float t_min, float t_max, float &return_t) {
-  Vect p0 = triangle->p0;
-  Vect p1 = triangle->p1;
-  Vect p2 = triangle->p2;
-
-  float a = p0.x - p1.x;
-  float b = p0.y - p1.y;
-  float c = p0.z - p1.z;
-  float d = p0.x - p2.x;
-  float e = p0.y - p2.y;
-  float f = p0.z - p2.z;
-  float j = p0.x - origin.x;
-  float k = p0.y - origin.y;
-  float l = p0.z - origin.z;
+bool Raytracer::hitsTriangle(Vect &origin, Vect &direction, uint32_t triangle, float t_min, float t_max, float &return_t) {
+  PROFILE_COUNT(triangle_tests, 1);
+  primitive_tests++;
+  const float *p0 = scene->triangleVertex(triangle, 0);
+  const float *p1 = scene->triangleVertex(triangle, 1);
+  const float *p2 = scene->triangleVertex(triangle, 2);
+  // The edges p0 - p1 and p0 - p2.
+  float a = p0[0] - p1[0];
+  float b = p0[1] - p1[1];
+  float c = p0[2] - p1[2];
+  float d = p0[0] - p2[0];
+  float e = p0[1] - p2[1];
+  float f = p0[2] - p2[2];
+  float j = p0[0] - origin.x;
+  float k = p0[1] - origin.y;
+  float l = p0[2] - origin.z;
 
   float ei_hf = e * direction.z - direction.y * f;
   float gf_di = direction.x * f - d * direction.z;
@@ -59,132 +137,882 @@ bool Raytracer::hits(Vect &origin, Vect &direction, Triangle *triangle, float t_
   return true;
 }
 
-bool Raytracer::inShadow(Vect &origin, Vect &direction, float t_max) {
+bool Raytracer::inShadowLinear(Vect &origin, Vect &direction, float t_max) {
   float t_min = 0.0001f;
 
   float return_t;
-  std::vector<Sphere *> spheres = info->spheres;
-  for(int i = 0; i < spheres.size(); i++){
-    if(hits(origin, direction, spheres[i], t_min, t_max, return_t)){ return true; }
+  for(uint32_t i = 0; i < scene->sphereCount(); i++){
+    if(hitsSphere(origin, direction, i, t_min, t_max, return_t)){ return true; }
+  }
+
+  for(uint32_t i = 0; i < scene->worldTriangleCount(); i++){
+    if(hitsTriangle(origin, direction, i, t_min, t_max, return_t)){ return true; }
+  }
+
+  for(uint32_t i = 0; i < scene->instanceCount(); i++){
+    const SceneObject &object = scene->objects[scene->instances[i].object];
+    Vect o, d;
+    toObjectSpace(scene->instances[i], origin, direction, o, d);
+    for(uint32_t j = object.first_triangle; j < object.first_triangle + object.triangle_count; j++){
+      if(hitsTriangle(o, d, j, t_min, t_max, return_t)){ return true; }
+    }
   }
 
-  std::vector<Triangle *> triangles = info->triangles;
-  for(int i = 0; i < triangles.size(); i++){
-    if(hits(origin, direction, triangles[i], t_min, t_max, return_t)){ return true; }
+  return false;
+}
+
+template <unsigned F>
+bool Raytracer::inShadowBVH(Vect &origin, Vect &direction, float t_max) {
+  return inShadowFrom<F>(bvh.getRoot(), origin, direction, t_max);
+}
+
+template <unsigned F>
+bool Raytracer::inShadowFrom(uint32_t root, Vect &origin, Vect &direction, float t_max) {
+  float t_min = 0.0001f;
+  float o[3] = {origin.x, origin.y, origin.z};
+  float inv_dir[3] = {1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+
+  const SceneArray<BVHNode> &nodes = bvh.getNodes();
+  const SceneArray<PrimitiveRef> &primitives = bvh.getPrimitives();
+
+  // Any hit will do, so no ordering is needed; stop at the first one.
+  uint32_t stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = root;
+  while (stack_size > 0) {
+    const BVHNode &node = nodes[stack[--stack_size]];
+    float t_near;
+    if (!BVH::intersect(node.bounds, o, inv_dir, t_min, t_max, t_near)) { continue; }
+
+    if (node.isLeaf()) {
+      float return_t;
+      for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+        const PrimitiveRef &p = primitives[i];
+        if ((F & FEATURE_INSTANCES) && p.type == PRIMITIVE_INSTANCE) {
+          const SceneInstance &instance = scene->instances[p.index];
+          Vect object_origin, object_direction;
+          toObjectSpace(instance, origin, direction, object_origin, object_direction);
+          // Object trees hold nothing but triangles.
+          if (inShadowFrom<FEATURE_TRIANGLES>(bvh.getObjectRoots()[instance.object], object_origin, object_direction,
+                                              t_max)) {
+            return true;
+          }
+          continue;
+        }
+        bool hit = (F & FEATURE_SPHERES) && (!(F & FEATURE_TRIANGLES) || p.type == PRIMITIVE_SPHERE)
+                       ? hitsSphere(origin, direction, p.index, t_min, t_max, return_t)
+                       : hitsTriangle(origin, direction, p.index, t_min, t_max, return_t);
+        if (hit) { return true; }
+      }
+    } else {
+      uint32_t self = (uint32_t)(&node - &nodes[0]);
+      stack[stack_size++] = node.offset;
+      stack[stack_size++] = self + 1;
+    }
   }
 
   return false;
 }
 
-Color Raytracer::rayCast(Vect &origin, Vect &direction, int bounces) {
+bool Raytracer::closestHitLinear(Vect &origin, Vect &direction, HitRecord &record) {
   float t = std::numeric_limits<float>::max();
-  Material material;
-  Vect n;
 
-  std::vector<Sphere *> spheres = info->spheres;
-  for (int i = 0; i < spheres.size(); i++) {
+  for (uint32_t i = 0; i < scene->sphereCount(); i++) {
     float return_t;
-    if (!hits(origin, direction, spheres[i], 0.0f, std::numeric_limits<float>::max(), return_t) || return_t >= t) { continue; }
+    if (!hitsSphere(origin, direction, i, 0.0f, std::numeric_limits<float>::max(), return_t) || return_t >= t) { continue; }
     t = return_t;
-    material = *spheres[i]->material;
-
-    Vect hit = origin + direction * t;
-    n = (hit - spheres[i]->center).normalize();
+    record.primitive = {PRIMITIVE_SPHERE, i};
+    record.instance = NO_INSTANCE;
   }
 
-  std::vector<Triangle *> triangles = info->triangles;
-  for (int i = 0; i < triangles.size(); i++) {
+  for (uint32_t i = 0; i < scene->worldTriangleCount(); i++) {
     float return_t;
-    if (! hits(origin, direction, triangles[i], 0.0f, std::numeric_limits<float>::max(), return_t) || return_t >= t) { continue; }
+    if (! hitsTriangle(origin, direction, i, 0.0f, std::numeric_limits<float>::max(), return_t) || return_t >= t) { continue; }
     t = return_t;
-    material = *triangles[i]->material;
-
-    Vect a = triangles[i]->p0;
-    Vect b = triangles[i]->p1;
-    Vect c = triangles[i]->p2;
-
-    Vect ab = b - a;
-    Vect ac = c - a;
-    float nx = ab.y * ac.z - ab.z * ac.y;
-    float ny = ab.z * ac.x - ab.x * ac.z;
-    float nz = ab.x * ac.y - ab.y * ac.x;
-    n = Vect{nx, ny, nz}.normalize();
-    if(n * direction > 0.0f) { n = n * -1.0f; }
+    record.primitive = {PRIMITIVE_TRIANGLE, i};
+    record.instance = NO_INSTANCE;
   }
-  if (t == std::numeric_limits<float>::max()) { return { 0.0f, 0.0f, 0.0f }; }
-  
-  Color color = material.color;
-  float diffuse = 0.0f;
-  float specular = 0.0f;
 
-  Vect hit = origin + direction * t;
-  Vect v = (origin - hit).normalize();
-  bool hasDirLight = info->dir_light != nullptr;
+  for (uint32_t i = 0; i < scene->instanceCount(); i++) {
+    const SceneObject &object = scene->objects[scene->instances[i].object];
+    Vect o, d;
+    toObjectSpace(scene->instances[i], origin, direction, o, d);
+    for (uint32_t j = object.first_triangle; j < object.first_triangle + object.triangle_count; j++) {
+      float return_t;
+      if (!hitsTriangle(o, d, j, 0.0f, std::numeric_limits<float>::max(), return_t) || return_t >= t) { continue; }
+      t = return_t;
+      record.primitive = {PRIMITIVE_TRIANGLE, j};
+      record.instance = i;
+    }
+  }
 
-  std::vector<Light*> point_lights = info->point_lights;
-  for (int i = 0; i <= point_lights.size(); i++) {
-    bool isDirLight = i == point_lights.size();
-    if(isDirLight && !hasDirLight){ break; }
+  record.t = t;
+  return t != std::numeric_limits<float>::max();
+}
 
-    Vect direction = (hasDirLight && isDirLight) ? -info->dir_light->direction : (point_lights[i]->position - hit);
-    float intensity = (hasDirLight && isDirLight) ? info->dir_light->h_intensity : point_lights[i]->intensity;
-    float t_max = (hasDirLight && isDirLight) ? std::numeric_limits<float>::max() : 1.0f;
+template <unsigned F>
+bool Raytracer::closestHitBVH(Vect &origin, Vect &direction, HitRecord &record) {
+  float t = std::numeric_limits<float>::max();
+  record.t = t;
+  closestHitFrom<F>(bvh.getRoot(), origin, direction, NO_INSTANCE, t, record);
+  record.t = t;
+  return t != std::numeric_limits<float>::max();
+}
 
-    if(info->shadows && inShadow(hit, direction, t_max)){ continue; }
+template <unsigned F>
+void Raytracer::closestHitFrom(uint32_t root, Vect &origin, Vect &direction, uint32_t instance, float &t,
+                               HitRecord &record) {
+  float o[3] = {origin.x, origin.y, origin.z};
+  float inv_dir[3] = {1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z};
+
+  const SceneArray<BVHNode> &nodes = bvh.getNodes();
+  const SceneArray<PrimitiveRef> &primitives = bvh.getPrimitives();
+
+  struct Entry {
+    uint32_t node;
+    float t_near;
+  };
+  Entry stack[64];
+  int stack_size = 0;
+
+  float t_root;
+  if (!BVH::intersect(nodes[root].bounds, o, inv_dir, 0.0f, t, t_root)) { return; }
+  stack[stack_size++] = {root, t_root};
+
+  while (stack_size > 0) {
+    Entry entry = stack[--stack_size];
+    // Skip nodes that start behind the closest hit found since they were pushed.
+    if (entry.t_near > t) { continue; }
+    const BVHNode &node = nodes[entry.node];
+
+    if (node.isLeaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+        const PrimitiveRef &p = primitives[i];
+        if ((F & FEATURE_INSTANCES) && p.type == PRIMITIVE_INSTANCE) {
+          const SceneInstance &placed = scene->instances[p.index];
+          Vect object_origin, object_direction;
+          toObjectSpace(placed, origin, direction, object_origin, object_direction);
+          closestHitFrom<FEATURE_TRIANGLES>(bvh.getObjectRoots()[placed.object], object_origin, object_direction,
+                                            p.index, t, record);
+          continue;
+        }
+        float return_t;
+        bool hit = (F & FEATURE_SPHERES) && (!(F & FEATURE_TRIANGLES) || p.type == PRIMITIVE_SPHERE)
+                       ? hitsSphere(origin, direction, p.index, 0.0f, t, return_t)
+                       : hitsTriangle(origin, direction, p.index, 0.0f, t, return_t);
+        if (!hit || return_t >= t) { continue; }
+        t = return_t;
+        record.primitive = p;
+        record.instance = instance;
+      }
+      continue;
+    }
 
-    Vect l = direction.normalize();
-    Vect h = (v + l).normalize();
+    // Visit the nearer child first so the far one can often be culled.
+    uint32_t left = entry.node + 1;
+    uint32_t right = node.offset;
+    float t_left, t_right;
+    bool hit_left = BVH::intersect(nodes[left].bounds, o, inv_dir, 0.0f, t, t_left);
+    bool hit_right = BVH::intersect(nodes[right].bounds, o, inv_dir, 0.0f, t, t_right);
+    if (hit_left && hit_right) {
+      if (t_left <= t_right) {
+        stack[stack_size++] = {right, t_right};
+        stack[stack_size++] = {left, t_left};
+      } else {
+        stack[stack_size++] = {left, t_left};
+        stack[stack_size++] = {right, t_right};
+      }
+    } else if (hit_left) {
+      stack[stack_size++] = {left, t_left};
+    } else if (hit_right) {
+      stack[stack_size++] = {right, t_right};
+    }
+  }
 
-    float distanceSquared = direction.mag() * direction.mag();
-    float irradiance = (hasDirLight && isDirLight) ? (intensity * n*l) : (intensity / distanceSquared);
+}
 
-    diffuse += irradiance * std::max(0.0f, n * l);
-    specular += irradiance * material.glossiness * pow(std::max(0.0f, n * h), material.p);
+template <unsigned F>
+Color Raytracer::rayCast(Vect &origin, Vect &direction, int bounces, RayStats &stats) {
+  HitRecord record;
+  if (!closestHit(origin, direction, record)) { return { 0.0f, 0.0f, 0.0f }; }
+  return shade<F>(origin, direction, record, bounces, nullptr, 0, stats);
+}
+
+template <class Visit>
+void Raytracer::forEachLight(const Vect &hit, Visit visit) {
+  if (!use_light_tree) {
+    for (uint32_t i = 0; i < scene->lightCount(); i++) {
+      visit(i, 1.0f);
+    }
+  } else if (light_samples > 0) {
+    light_tree.sample(hit, light_samples, hashPoint(hit), visit);
+  } else {
+    light_tree.collect(hit, light_cutoff, visit);
   }
+}
+
+template <unsigned F>
+Color Raytracer::shade(Vect &origin, Vect &direction, HitRecord &record, int bounces, const uint32_t *occlusion, int lane,
+                       RayStats &stats) {
+  Vect hit, n;
+  float mirror;
+  Color color = shadeDirect<F & (FEATURE_SHADOWS | FEATURE_DIR_LIGHT)>(origin, direction, record, occlusion, lane,
+                                                                       stats, hit, n, mirror);
 
   Color reflection;
-  if(bounces > 0 && material.mirror > 0.0f){
+  if((F & FEATURE_MIRRORS) && bounces > 0 && mirror > 0.0f){
     Vect r = direction - n * 2.0f * (direction * n);
-    reflection = rayCast(hit, r, bounces-1) * material.mirror;
+    stats.reflection++;
+    reflection = rayCast<F>(hit, r, bounces-1, stats) * mirror;
   }
 
-  color = color * (info->ambient + diffuse);
-  color += Color{1.0f, 1.0f, 1.0f} * specular;
   color += reflection;
 
   return color;
 }
 
-void Raytracer::render(Frame &frame) {
+template <unsigned F>
+Color Raytracer::shadeDirect(Vect &origin, Vect &direction, HitRecord &record, const uint32_t *occlusion, int lane,
+                             RayStats &stats, Vect &hit, Vect &n, float &mirror) {
+  float t = record.t;
+  uint32_t index = record.primitive.index;
+  uint32_t material_index;
+  hit = origin + direction * t;
+  if (record.primitive.type == PRIMITIVE_SPHERE) {
+    material_index = scene->sphere_material[index];
+
+    Vect center{scene->sphere_x[index], scene->sphere_y[index], scene->sphere_z[index]};
+    n = (hit - center).normalize();
+  } else {
+    material_index = scene->triangleMaterial(index);
+
+    n = scene->triangleNormal(index);
+    if (record.instance != NO_INSTANCE) {
+      const SceneInstance &instance = scene->instances[record.instance];
+      material_index = instance.material;
+      // Normals go to world space through the inverse transpose.
+      const float *m = instance.to_object;
+      n = Vect{m[0] * n.x + m[4] * n.y + m[8] * n.z, m[1] * n.x + m[5] * n.y + m[9] * n.z,
+               m[2] * n.x + m[6] * n.y + m[10] * n.z}.normalize();
+    }
+    if(n * direction > 0.0f) { n = n * -1.0f; }
+  }
+  const ShadingMaterial &material = scene->materials[material_index];
+
+  Color color = material.color;
+  float diffuse = 0.0f;
+  float specular = 0.0f;
+
+  Vect v = (origin - hit).normalize();
+
+  // Adds the diffuse and specular light arriving from direction l.
+  auto addLight = [&](const Vect &l, float irradiance) {
+    Vect h = (v + l).normalize();
+    diffuse += irradiance * std::max(0.0f, n * l);
+    specular += irradiance * material.glossiness * pow(std::max(0.0f, n * h), material.p);
+  };
+
+  // Point light i, unless it is shadowed.
+  auto addPointLight = [&](uint32_t i, float weight) {
+    Vect direction = Vect{scene->light_x[i], scene->light_y[i], scene->light_z[i]} - hit;
+    if(F & FEATURE_SHADOWS) {
+      stats.shadow++;
+      bool blocked = occlusion ? ((occlusion[i] >> lane) & 1) != 0 : inShadow(hit, direction, 1.0f);
+      if(blocked){ return; }
+    }
+    float intensity = scene->light_intensity[i] * weight;
+    float distanceSquared = direction.mag() * direction.mag();
+    addLight(direction.normalize(), intensity / distanceSquared);
+  };
+  forEachLight(hit, addPointLight);
+
+  if(F & FEATURE_DIR_LIGHT) {
+    Vect dir_light_direction = scene->dir_light_direction;
+    Vect direction = -dir_light_direction;
+    bool blocked = false;
+    if(F & FEATURE_SHADOWS) {
+      stats.shadow++;
+      uint32_t i = scene->lightCount();
+      blocked = occlusion ? ((occlusion[i] >> lane) & 1) != 0
+                          : inShadow(hit, direction, std::numeric_limits<float>::max());
+    }
+    if(!blocked) {
+      Vect l = direction.normalize();
+      float intensity = scene->dir_light_intensity;
+      addLight(l, intensity * n*l);
+    }
+  }
+
+  mirror = material.mirror;
+  color = color * (scene->ambient + diffuse);
+  color += Color{1.0f, 1.0f, 1.0f} * specular;
+
+  return color;
+}
+
+Vect Raytracer::primaryDirection(float x, float y, float sin_theta, float cos_theta) {
   //viewplane borders
   float min = -1.0f;
   float max = 1.0f;
 
-  int bounces = 3;
-  float aspect_ratio = (float)WIDTH / HEIGHT;
+  float aspect_ratio = (float)image_width / image_height;
+
+  float pixel_x = min + (max - min) * (x / image_width);
+  float pixel_y = min + (max - min) * (y / image_height);
+  pixel_y /= aspect_ratio;
+
+  float z = scene->focal_length;
+  pixel_x = cos_theta * pixel_x - sin_theta * z;
+  z = sin_theta * pixel_x + cos_theta * z;
+
+  return Vect{pixel_x, pixel_y, z };
+}
+
+template <unsigned F>
+void Raytracer::tracePacket(Frame &frame, int x, int y, int lanes, int spacing, float sin_theta, float cos_theta,
+                            PacketShadows &shadows, RayStats &stats, CostMap *costs) {
+  stats.primary += lanes;
+
+  Clock::time_point start;
+  uint32_t lane_tests[MAX_PACKET_WIDTH];
+  uint32_t *packet_tests = nullptr;
+  if (costs != nullptr) {
+    start = Clock::now();
+    std::fill(lane_tests, lane_tests + MAX_PACKET_WIDTH, 0u);
+    packet_tests = lane_tests;
+  }
+
+  RayPacket primary;
+  Vect directions[MAX_PACKET_WIDTH];
+  for (int lane = 0; lane < lanes; lane++) {
+    directions[lane] = primaryDirection(x + lane * spacing, y, sin_theta, cos_theta);
+    primary.ox[lane] = origin.x;
+    primary.oy[lane] = origin.y;
+    primary.oz[lane] = origin.z;
+    primary.dx[lane] = directions[lane].x;
+    primary.dy[lane] = directions[lane].y;
+    primary.dz[lane] = directions[lane].z;
+  }
+  // Lanes past the end of the row still get finite rays so no kernel sees
+  // garbage, but they are left out of the active mask.
+  for (int lane = lanes; lane < packets->width; lane++) {
+    primary.ox[lane] = primary.oy[lane] = primary.oz[lane] = 0.0f;
+    primary.dx[lane] = primary.dy[lane] = primary.dz[lane] = 1.0f;
+  }
+
+  uint32_t active = (1u << lanes) - 1;
+  float t[MAX_PACKET_WIDTH];
+  PrimitiveRef primitives[MAX_PACKET_WIDTH];
+  uint32_t instances[MAX_PACKET_WIDTH];
+  uint32_t hit = packets->closestHit(packet_scene, primary, active, t, primitives, instances, PROFILE_COUNTERS,
+                                     packet_tests);
+
+  // Shadow rays towards each light go out as one packet from all lanes that
+  // hit something, with the same origin and direction rayCast would use.
+  // With the light tree, each light goes out only from the lanes that will
+  // shade with it. Sampled lights hardly ever coincide between lanes, so
+  // their shadow rays are left to shade() one at a time.
+  bool sampled = use_light_tree && light_samples > 0;
+  if ((F & FEATURE_SHADOWS) && hit != 0 && !sampled) {
+    RayPacket shadow = primary;
+    Vect points[MAX_PACKET_WIDTH];
+    for (int lane = 0; lane < lanes; lane++) {
+      if (!((hit >> lane) & 1)) { continue; }
+      points[lane] = origin + directions[lane] * t[lane];
+      shadow.ox[lane] = points[lane].x;
+      shadow.oy[lane] = points[lane].y;
+      shadow.oz[lane] = points[lane].z;
+    }
+
+    Vect dirLightDirection = scene->dir_light_direction;
+    uint32_t light_count = scene->lightCount();
+    auto traceShadows = [&](uint32_t i, uint32_t light_lanes) {
+      bool isDirLight = i == light_count;
+      for (int lane = 0; lane < lanes; lane++) {
+        if (!((light_lanes >> lane) & 1)) { continue; }
+        Vect direction = isDirLight ? -dirLightDirection
+                                    : (Vect{scene->light_x[i], scene->light_y[i], scene->light_z[i]} - points[lane]);
+        shadow.dx[lane] = direction.x;
+        shadow.dy[lane] = direction.y;
+        shadow.dz[lane] = direction.z;
+      }
+      float t_max = isDirLight ? std::numeric_limits<float>::max() : 1.0f;
+      shadows.occlusion[i] =
+          packets->occluded(packet_scene, shadow, t_max, light_lanes, PROFILE_COUNTERS, packet_tests);
+    };
+
+    if (!use_light_tree) {
+      for (uint32_t i = 0; i < light_count; i++) {
+        traceShadows(i, hit);
+      }
+    } else {
+      for (int lane = 0; lane < lanes; lane++) {
+        if (!((hit >> lane) & 1)) { continue; }
+        forEachLight(points[lane], [&](uint32_t i, float) {
+          if (shadows.lanes[i] == 0) { shadows.lights.push_back(i); }
+          shadows.lanes[i] |= 1u << lane;
+        });
+      }
+      for (uint32_t i : shadows.lights) {
+        traceShadows(i, shadows.lanes[i]);
+        shadows.lanes[i] = 0;
+      }
+      shadows.lights.clear();
+    }
+    if (F & FEATURE_DIR_LIGHT) { traceShadows(light_count, hit); }
+  }
+
+  Clock::time_point lane_start;
+  float traversal_ns = 0.0f;
+  if (costs != nullptr) {
+    lane_start = Clock::now();
+    traversal_ns = nanoseconds(start, lane_start) / lanes;
+  }
+
+  // Shading, and any mirror bounces (which no longer stay coherent), run
+  // per lane on the single-ray path.
+  for (int lane = 0; lane < lanes; lane++) {
+    uint64_t tests_before = primitive_tests;
+    uint64_t rays_before = stats.total();
+    Color c;
+    if ((hit >> lane) & 1) {
+      HitRecord record = {t[lane], primitives[lane], instances[lane]};
+      c = shade<F>(origin, directions[lane], record, bounces, sampled ? nullptr : shadows.occlusion.data(), lane, stats);
+    }
+    frame.setColor(x + lane * spacing, y, c);
+
+    if (costs != nullptr) {
+      Clock::time_point lane_end = Clock::now();
+      PixelCost &cost = costs->at(x + lane * spacing, y);
+      cost.tests = (float)(lane_tests[lane] + (primitive_tests - tests_before));
+      cost.rays = (float)(1 + stats.total() - rays_before);
+      cost.nanoseconds = traversal_ns + nanoseconds(lane_start, lane_end);
+      lane_start = lane_end;
+    }
+  }
+}
+
+Region Raytracer::tileRegion(const Region &region, int tile) {
+  int tiles_x = (region.width() + TILE_SIZE - 1) / TILE_SIZE;
+  int x0 = region.x0 + (tile % tiles_x) * TILE_SIZE;
+  int y0 = region.y0 + (tile / tiles_x) * TILE_SIZE;
+  return {x0, y0, std::min(x0 + TILE_SIZE, region.x1), std::min(y0 + TILE_SIZE, region.y1)};
+}
+
+int Raytracer::tileCount(const Region &region) {
+  int tiles_x = (region.width() + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (region.height() + TILE_SIZE - 1) / TILE_SIZE;
+  return tiles_x * tiles_y;
+}
+
+template <unsigned F>
+void Raytracer::renderTile(Frame &frame, const Region &region, int tile, float sin_theta, float cos_theta,
+                           RayStats &stats, CostMap *costs) {
+  PROFILE_SCOPE("trace tile");
+
+  Region bounds = tileRegion(region, tile);
+  int x0 = bounds.x0;
+  int y0 = bounds.y0;
+  int x1 = bounds.x1;
+  int y1 = bounds.y1;
+
+  if (packets != nullptr && accelerated) {
+    PacketShadows shadows;
+    shadows.occlusion.resize(scene->lightCount() + 1);
+    if (use_light_tree) { shadows.lanes.resize(scene->lightCount()); }
+    for(int y = y0; y < y1; y++){
+      for(int x = x0; x < x1; x += packets->width){
+        tracePacket<F>(frame, x, y, std::min(packets->width, x1 - x), 1, sin_theta, cos_theta, shadows, stats, costs);
+      }
+    }
+    return;
+  }
+
+  Clock::time_point start;
+  if (costs != nullptr) { start = Clock::now(); }
+  for(int y = y0; y < y1; y++){
+    for(int x = x0; x < x1; x++){
+      uint64_t tests_before = primitive_tests;
+      uint64_t rays_before = stats.total();
+      Vect d = primaryDirection(x, y, sin_theta, cos_theta);
+      stats.primary++;
+      Color c = rayCast<F>(origin, d, bounces, stats);
+
+      frame.setColor(x, y, c);
+
+      if (costs != nullptr) {
+        Clock::time_point end = Clock::now();
+        PixelCost &cost = costs->at(x, y);
+        cost.tests = (float)(primitive_tests - tests_before);
+        cost.rays = (float)(stats.total() - rays_before);
+        cost.nanoseconds = nanoseconds(start, end);
+        start = end;
+      }
+    }
+  }
+}
+
+template <unsigned F>
+void Raytracer::refineTile(Frame &frame, const Frame &base, const Region &region, int tile, float sin_theta,
+                           float cos_theta, RayStats &stats, CostMap *costs) {
+  PROFILE_SCOPE("refine tile");
+  Region bounds = tileRegion(region, tile);
+
+  // First-pass color of pixel (x, y). Neighbors outside the region are
+  // traced again, so the pixels at its edges decide as they would inside a
+  // larger one.
+  auto firstSample = [&](int x, int y) {
+    if (x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1) { return base.getColor(x, y); }
+    Vect d = primaryDirection(x, y, sin_theta, cos_theta);
+    stats.primary++;
+    return stored(rayCast<F>(origin, d, bounces, stats));
+  };
+
+  float max_error = 0.5f * aa_threshold;
+  Clock::time_point start;
+  if (costs != nullptr) { start = Clock::now(); }
+  for (int y = bounds.y0; y < bounds.y1; y++) {
+    for (int x = bounds.x0; x < bounds.x1; x++) {
+      uint64_t tests_before = primitive_tests;
+      uint64_t rays_before = stats.total();
+      Color first = base.getColor(x, y);
+      bool edge = (x > 0 && contrast(first, firstSample(x - 1, y)) > aa_threshold) ||
+                  (x + 1 < image_width && contrast(first, firstSample(x + 1, y)) > aa_threshold) ||
+                  (y > 0 && contrast(first, firstSample(x, y - 1)) > aa_threshold) ||
+                  (y + 1 < image_height && contrast(first, firstSample(x, y + 1)) > aa_threshold);
+
+      if (edge) {
+        // Running mean and sum of squared deviations per channel
+        // (Welford), starting from the first sample.
+        float mean[3] = {first.r, first.g, first.b};
+        float squares[3] = {0.0f, 0.0f, 0.0f};
+        int n = 1;
+        while (n < aa_samples) {
+          for (int end = std::min(n + AA_ROUND, aa_samples); n < end;) {
+            Vect d = primaryDirection(x + radicalInverse(n, 2), y + radicalInverse(n, 3), sin_theta, cos_theta);
+            stats.primary++;
+            Color c = rayCast<F>(origin, d, bounces, stats);
+            float sample[3] = {c.r, c.g, c.b};
+            n++;
+            for (int channel = 0; channel < 3; channel++) {
+              float delta = sample[channel] - mean[channel];
+              mean[channel] += delta / n;
+              squares[channel] += delta * (sample[channel] - mean[channel]);
+            }
+          }
+          // Done once the standard error of the mean is small enough in
+          // every channel.
+          float variance = std::max(squares[0], std::max(squares[1], squares[2])) / (n - 1);
+          if (variance < max_error * max_error * n) { break; }
+        }
+        frame.setColor(x, y, {mean[0], mean[1], mean[2]});
+      }
+
+      if (costs != nullptr) {
+        Clock::time_point end = Clock::now();
+        PixelCost &cost = costs->at(x, y);
+        cost.tests += (float)(primitive_tests - tests_before);
+        cost.rays += (float)(stats.total() - rays_before);
+        cost.nanoseconds += nanoseconds(start, end);
+        start = end;
+      }
+    }
+  }
+}
+
+void Raytracer::refineViews(const std::vector<View> &views, const Region &region, unsigned features) {
+  typedef void (Raytracer::*TileRefiner)(Frame &, const Frame &, const Region &, int, float, float, RayStats &,
+                                         CostMap *);
+  static const TileRefiner tile_refiners[SHADING_FEATURES + 1] = {
+      &Raytracer::refineTile<0>, &Raytracer::refineTile<1>, &Raytracer::refineTile<2>, &Raytracer::refineTile<3>,
+      &Raytracer::refineTile<4>, &Raytracer::refineTile<5>, &Raytracer::refineTile<6>, &Raytracer::refineTile<7>};
+  TileRefiner refine_tile = tile_refiners[features & SHADING_FEATURES];
+
+  if (aa_bases.size() < views.size()) { aa_bases.resize(views.size()); }
+  for (size_t i = 0; i < views.size(); i++) {
+    aa_bases[i] = *views[i].frame;
+  }
+  int tiles = tileCount(region);
+  pool.run(tiles * (int)views.size(), [&](int task, int worker) {
+    const View &view = views[task / tiles];
+    (this->*refine_tile)(*view.frame, aa_bases[task / tiles], region, task % tiles, view.sin_theta,
+                         view.cos_theta, worker_stats[worker].stats, view.costs);
+  });
+}
+
+template <unsigned F>
+void Raytracer::passTile(Frame &frame, const Region &region, int tile, int step, bool refining, float sin_theta,
+                         float cos_theta, RayStats &stats) {
+  PROFILE_SCOPE("trace pass tile");
+  Region bounds = tileRegion(region, tile);
+  bool use_packets = packets != nullptr && accelerated;
+  PacketShadows shadows;
+  if (use_packets) {
+    shadows.occlusion.resize(scene->lightCount() + 1);
+    if (use_light_tree) { shadows.lanes.resize(scene->lightCount()); }
+  }
+
+  // Tiles start at multiples of TILE_SIZE, and so of the step.
+  for (int y = bounds.y0; y < bounds.y1; y += step) {
+    // Rows the coarser pass went through have every other pixel left.
+    bool coarse_row = refining && y % (2 * step) == 0;
+    int spacing = coarse_row ? 2 * step : step;
+    for (int x = bounds.x0 + (coarse_row ? step : 0); x < bounds.x1;) {
+      if (use_packets) {
+        int lanes = std::min(packets->width, (bounds.x1 - x + spacing - 1) / spacing);
+        tracePacket<F>(frame, x, y, lanes, spacing, sin_theta, cos_theta, shadows, stats, nullptr);
+        x += lanes * spacing;
+      } else {
+        Vect d = primaryDirection(x, y, sin_theta, cos_theta);
+        stats.primary++;
+        frame.setColor(x, y, rayCast<F>(origin, d, bounces, stats));
+        x += spacing;
+      }
+    }
+  }
+
+  // Each traced pixel stands in for the step x step block it is the corner
+  // of; the coarser pass's pixels already fill theirs.
+  if (step == 1) { return; }
+  for (int y = bounds.y0; y < bounds.y1; y += step) {
+    for (int x = bounds.x0; x < bounds.x1; x += step) {
+      const uint16_t *source = frame.pixel(x, y);
+      for (int by = y; by < std::min(y + step, bounds.y1); by++) {
+        for (int bx = x; bx < std::min(x + step, bounds.x1); bx++) {
+          std::copy(source, source + Frame::CHANNELS, frame.pixel(bx, by));
+        }
+      }
+    }
+  }
+}
+
+bool Raytracer::renderPass(Frame &frame, int step, bool refining, const std::atomic<bool> *cancel) {
+  typedef void (Raytracer::*PassRenderer)(Frame &, const Region &, int, int, bool, float, float, RayStats &);
+  static const PassRenderer pass_renderers[SHADING_FEATURES + 1] = {
+      &Raytracer::passTile<0>, &Raytracer::passTile<1>, &Raytracer::passTile<2>, &Raytracer::passTile<3>,
+      &Raytracer::passTile<4>, &Raytracer::passTile<5>, &Raytracer::passTile<6>, &Raytracer::passTile<7>};
+
+  step = std::max(1, std::min(step, (int)TILE_SIZE));
+  Region region = {0, 0, frame.width(), frame.height()};
+  std::vector<View> views = {makeView(&frame, theta, nullptr)};
+  const View &view = views[0];
+  unsigned features = beginRender(frame);
+  PassRenderer pass_tile = pass_renderers[features & SHADING_FEATURES];
+  auto cancelled = [&]() { return cancel != nullptr && cancel->load(); };
+
+  // Tiles not yet started when the pass is called off are skipped.
+  pool.run(tileCount(region), [&](int task, int worker) {
+    if (cancelled()) { return; }
+    (this->*pass_tile)(frame, region, task, step, refining, view.sin_theta, view.cos_theta,
+                       worker_stats[worker].stats);
+  });
+  if (step == 1 && aa_samples > 1 && !cancelled()) { refineViews(views, region, features); }
+  return !cancelled();
+}
+
+void Raytracer::render(Frame &frame) { render(frame, frameRegion(frame)); }
+
+void Raytracer::render(Frame &frame, const Region &region) {
+  Frame *frames[] = {&frame};
+  renderViews(frames, &theta, 1, region);
+}
+
+void Raytracer::renderBatch(Frame *const *frames, const float *thetas, int count) {
+  if (count > 0) { renderViews(frames, thetas, count, frameRegion(*frames[0])); }
+}
+
+void Raytracer::render(Frame &frame, CostMap &costs) {
+  Frame *frames[] = {&frame};
+  CostMap *cost_maps[] = {&costs};
+  renderBatch(frames, &theta, 1, cost_maps);
+}
+
+void Raytracer::renderBatch(Frame *const *frames, const float *thetas, int count, CostMap *const *costs) {
+  if (count <= 0) { return; }
+  for (int i = 0; i < count; i++) {
+    if (costs[i]->width() != frames[i]->width() || costs[i]->height() != frames[i]->height()) {
+      costs[i]->reshape(frames[i]->width(), frames[i]->height());
+    }
+  }
+  renderViews(frames, thetas, count, frameRegion(*frames[0]), costs);
+}
+
+void Raytracer::renderViews(Frame *const *frames, const float *thetas, int count, const Region &region,
+                            CostMap *const *costs) {
+  if (region.width() <= 0 || region.height() <= 0 || count <= 0) { return; }
+  std::vector<View> views(count);
+  for (int i = 0; i < count; i++) {
+    views[i] = makeView(frames[i], thetas[i], costs != nullptr ? costs[i] : nullptr);
+  }
+  unsigned features = beginRender(*frames[0]);
+  if (wavefront && costs == nullptr) {
+    renderWaves(views, region, features);
+  } else {
+    renderTiles(views, region, features);
+  }
+  if (aa_samples > 1) { refineViews(views, region, features); }
+}
 
+Raytracer::View Raytracer::makeView(Frame *frame, float theta, CostMap *costs) {
   float rad = theta * 3.1415926f / 180.0f;
   float sin_theta = sin(rad);
   float cos_theta = cos(rad);
+  return {frame, sin_theta, cos_theta, costs};
+}
 
-  for(int y = 0; y < HEIGHT; y++){
-    for(int x = 0; x < WIDTH; x++){
-      float pixel_x = min + (max - min) * ((float)x / WIDTH);
-      float pixel_y = min + (max - min) * ((float)y / HEIGHT);
-      pixel_y /= aspect_ratio;
-      
-      float z = info->focal_length;
-      pixel_x = cos_theta * pixel_x - sin_theta * z;
-      z = sin_theta * pixel_x + cos_theta * z;
+unsigned Raytracer::beginRender(const Frame &frame) {
+  image_width = frame.width();
+  image_height = frame.height();
+  use_light_tree = light_samples > 0 || scene->lightCount() >= LIGHT_TREE_MIN_LIGHTS;
+  unsigned features = sceneFeatures();
+  selectKernels(features);
+  return features;
+}
 
-      Vect d = Vect{pixel_x, pixel_y, z };
-      Color c = rayCast(origin, d, bounces);
+void Raytracer::renderTiles(const std::vector<View> &views, const Region &region, unsigned features) {
+  typedef void (Raytracer::*TileRenderer)(Frame &, const Region &, int, float, float, RayStats &, CostMap *);
+  static const TileRenderer tile_renderers[SHADING_FEATURES + 1] = {
+      &Raytracer::renderTile<0>, &Raytracer::renderTile<1>, &Raytracer::renderTile<2>, &Raytracer::renderTile<3>,
+      &Raytracer::renderTile<4>, &Raytracer::renderTile<5>, &Raytracer::renderTile<6>, &Raytracer::renderTile<7>};
+  TileRenderer render_tile = tile_renderers[features & SHADING_FEATURES];
+
+  // Tiles are small enough that expensive regions (mirrors, dense geometry)
+  // split over many tasks and get balanced by work stealing. The tiles of
+  // all views are one run, so threads done with one frame go on with the
+  // next instead of waiting for its last tile.
+  int tiles = tileCount(region);
+  pool.run(tiles * (int)views.size(), [&](int task, int worker) {
+    const View &view = views[task / tiles];
+    (this->*render_tile)(*view.frame, region, task % tiles, view.sin_theta, view.cos_theta,
+                         worker_stats[worker].stats, view.costs);
+  });
+}
 
-      frame.setColor(x, y, c);
+unsigned Raytracer::sceneFeatures() const {
+  unsigned features = 0;
+  if (scene->shadows) { features |= FEATURE_SHADOWS; }
+  if (scene->has_dir_light) { features |= FEATURE_DIR_LIGHT; }
+  for (const ShadingMaterial &material : scene->materials) {
+    if (material.mirror > 0.0f) {
+      features |= FEATURE_MIRRORS;
+      break;
+    }
+  }
+  if (scene->sphereCount() > 0) { features |= FEATURE_SPHERES; }
+  if (scene->worldTriangleCount() > 0) { features |= FEATURE_TRIANGLES; }
+  // Instances of empty objects are left out of the BVH.
+  for (const SceneInstance &instance : scene->instances) {
+    if (scene->objects[instance.object].triangle_count > 0) {
+      features |= FEATURE_INSTANCES;
+      break;
     }
   }
+  return features;
+}
+
+void Raytracer::selectKernels(unsigned features) {
+  typedef bool (Raytracer::*ClosestHitKernel)(Vect &, Vect &, HitRecord &);
+  typedef bool (Raytracer::*ShadowKernel)(Vect &, Vect &, float);
+  // Indexed by the TRACE_FEATURES bits; without any primitive the BVH is
+  // empty and the linear versions find nothing just as fast.
+  static const ClosestHitKernel closest_hit_kernels[8] = {
+      &Raytracer::closestHitLinear,
+      &Raytracer::closestHitBVH<FEATURE_SPHERES>,
+      &Raytracer::closestHitBVH<FEATURE_TRIANGLES>,
+      &Raytracer::closestHitBVH<FEATURE_SPHERES | FEATURE_TRIANGLES>,
+      &Raytracer::closestHitBVH<FEATURE_INSTANCES>,
+      &Raytracer::closestHitBVH<FEATURE_SPHERES | FEATURE_INSTANCES>,
+      &Raytracer::closestHitBVH<FEATURE_TRIANGLES | FEATURE_INSTANCES>,
+      &Raytracer::closestHitBVH<FEATURE_SPHERES | FEATURE_TRIANGLES | FEATURE_INSTANCES>};
+  static const ShadowKernel shadow_kernels[8] = {
+      &Raytracer::inShadowLinear,
+      &Raytracer::inShadowBVH<FEATURE_SPHERES>,
+      &Raytracer::inShadowBVH<FEATURE_TRIANGLES>,
+      &Raytracer::inShadowBVH<FEATURE_SPHERES | FEATURE_TRIANGLES>,
+      &Raytracer::inShadowBVH<FEATURE_INSTANCES>,
+      &Raytracer::inShadowBVH<FEATURE_SPHERES | FEATURE_INSTANCES>,
+      &Raytracer::inShadowBVH<FEATURE_TRIANGLES | FEATURE_INSTANCES>,
+      &Raytracer::inShadowBVH<FEATURE_SPHERES | FEATURE_TRIANGLES | FEATURE_INSTANCES>};
+
+  unsigned index = (features & TRACE_FEATURES) / FEATURE_SPHERES;
+  if (!accelerated || bvh.empty()) { index = 0; }
+  closest_hit_kernel = closest_hit_kernels[index];
+  shadow_kernel = shadow_kernels[index];
+}
+
+RayStats Raytracer::rayStats() const {
+  RayStats total;
+  for (const WorkerStats &worker : worker_stats) {
+    total += worker.stats;
+  }
+  return total;
+}
+
+void Raytracer::resetRayStats() {
+  for (WorkerStats &worker : worker_stats) {
+    worker.stats = RayStats();
+  }
+}
+
+void Raytracer::setAccelerated(bool accelerated) {
+  this->accelerated = accelerated;
+  selectKernels(sceneFeatures());
+}
+
+void Raytracer::setWavefront(bool wavefront) { this->wavefront = wavefront; }
+
+void Raytracer::setLightSampling(float cutoff, int samples) {
+  light_cutoff = cutoff;
+  light_samples = samples;
+}
+
+void Raytracer::setAntialiasing(int max_samples, float threshold) {
+  aa_samples = std::max(1, max_samples);
+  aa_threshold = threshold;
+}
+
+void Raytracer::setBounces(int bounces) { this->bounces = std::max(0, std::min(bounces, MAX_BOUNCES)); }
+
+SimdLevel Raytracer::setSimdLevel(SimdLevel level) {
+  // Fall back to the widest kernels below `level` that were compiled in.
+  packets = nullptr;
+  while (level != SIMD_SCALAR && (packets = packetKernels(level)) == nullptr) {
+    level = (SimdLevel)(level - 1);
+  }
+  return level;
+}
+
+SceneUpdate Raytracer::updateScene() {
+  PROFILE_SCOPE("refit");
+  SceneUpdate update;
+  auto start = std::chrono::steady_clock::now();
+  bvh.refit(scene);
+  auto refitted = std::chrono::steady_clock::now();
+  update.refit_ms = std::chrono::duration<double, std::milli>(refitted - start).count();
+  update.degradation = bvh.degradation();
+
+  if (update.degradation > REBUILD_DEGRADATION) {
+    bvh.rebuildTopLevel(scene);
+    update.rebuilt = true;
+    update.rebuild_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - refitted).count();
+  }
+  // Refitting copies cached arrays into memory of their own, and animate()
+  // does the same for the scene's, so the packet view is taken anew.
+  packet_scene = makePacketScene(scene, &bvh);
+  return update;
 }
 
 //void Raytracer::setOrigin(Vect origin) { this->origin = origin; }
 
-void Raytracer::setTheta(float theta) { this->theta = theta; }
\ No newline at end of file
+void Raytracer::setTheta(float theta) { this->theta = theta; }
+
+// shadeWave in wavefront.cpp shades through these.
+template Color Raytracer::shadeDirect<0>(Vect &, Vect &, HitRecord &, const uint32_t *, int, RayStats &, Vect &, Vect &,
+                                         float &);
+template Color Raytracer::shadeDirect<FEATURE_SHADOWS>(Vect &, Vect &, HitRecord &, const uint32_t *, int, RayStats &,
+                                                       Vect &, Vect &, float &);
+template Color Raytracer::shadeDirect<FEATURE_DIR_LIGHT>(Vect &, Vect &, HitRecord &, const uint32_t *, int,
+                                                         RayStats &, Vect &, Vect &, float &);
+template Color Raytracer::shadeDirect<FEATURE_SHADOWS | FEATURE_DIR_LIGHT>(Vect &, Vect &, HitRecord &,
+                                                                           const uint32_t *, int, RayStats &, Vect &,
+                                                                           Vect &, float &);
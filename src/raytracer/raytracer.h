@@ -1,19 +1,353 @@
 #pragma once
-#include "../configfile/scenedata.h"
+#include "bvh.h"
+#include "compiledscene.h"
+#include "lighttree.h"
+#include "packet.h"
+#include "profile.h"
+#include "threadpool.h"
+
+// Difference between neighboring pixels (in any color channel) above which
+// adaptive anti-aliasing takes more samples.
+const float DEFAULT_AA_THRESHOLD = 0.03f;
+// Most mirror bounces traced after the primary hit, and the default.
+const int MAX_BOUNCES = 3;
+
+struct HitRecord {
+  float t;
+  PrimitiveRef primitive;
+  // Instance the primitive was reached through, or NO_INSTANCE.
+  uint32_t instance;
+};
+
+// Rays traced, by kind. Each worker counts into its own copy.
+struct RayStats {
+  uint64_t primary = 0;
+  uint64_t shadow = 0;
+  uint64_t reflection = 0;
+
+  uint64_t total() const { return primary + shadow + reflection; }
+  RayStats &operator+=(const RayStats &other) {
+    primary += other.primary;
+    shadow += other.shadow;
+    reflection += other.reflection;
+    return *this;
+  }
+};
+
+// Properties of a scene that hold for a whole frame. The shading and
+// traversal code is instantiated for each combination and the matching
+// instance picked once per frame, so none of them is tested per ray.
+enum SceneFeature : unsigned {
+  // Shading: Raytracer::renderTile and everything below it.
+  FEATURE_SHADOWS = 1,
+  FEATURE_DIR_LIGHT = 2,
+  FEATURE_MIRRORS = 4,
+  // Traversal: which primitive types the top level of the BVH holds.
+  FEATURE_SPHERES = 8,
+  FEATURE_TRIANGLES = 16,
+  FEATURE_INSTANCES = 32
+};
+const unsigned SHADING_FEATURES = FEATURE_SHADOWS | FEATURE_DIR_LIGHT | FEATURE_MIRRORS;
+const unsigned TRACE_FEATURES = FEATURE_SPHERES | FEATURE_TRIANGLES | FEATURE_INSTANCES;
+
+// Pixels [x0, x1) x [y0, y1) of a frame.
+struct Region {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+
+  int width() const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+};
+
+// What Raytracer::updateScene did to follow the scene.
+struct SceneUpdate {
+  double refit_ms = 0.0;
+  double rebuild_ms = 0.0;
+  bool rebuilt = false;
+  // BVH::degradation() after the refit, before any rebuild.
+  float degradation = 1.0f;
+};
 
 class Raytracer {
 private:
   Vect origin;
-  RenderingInfo *info;
+  const CompiledScene *scene;
   float theta = 0.0f;
+  // Size of the image being rendered, which the primary rays span.
+  int image_width = WIDTH;
+  int image_height = HEIGHT;
+  BVH bvh;
+  LightTree light_tree;
+  float light_cutoff = DEFAULT_LIGHT_CUTOFF;
+  int light_samples = 0;
+  // Set by render(): lights are chosen through light_tree, and shadow rays
+  // go one at a time since the chosen lights differ from hit to hit.
+  bool use_light_tree = false;
+  bool accelerated = true;
+  bool wavefront = false;
+  // Most samples an anti-aliased pixel takes; 1 for none.
+  int aa_samples = 1;
+  float aa_threshold = DEFAULT_AA_THRESHOLD;
+  // Mirror bounces traced after the primary hit.
+  int bounces = MAX_BOUNCES;
+  // Frames as the first pass left them, which the refining pass compares
+  // neighbors in while it overwrites the frames themselves.
+  std::vector<Frame> aa_bases;
+  ThreadPool pool;
+  const PacketKernelTable *packets = nullptr;
+  PacketScene packet_scene;
+
+  // Closest-hit and shadow traversal for the scene's primitive types, or
+  // the linear versions; see selectKernels().
+  bool (Raytracer::*closest_hit_kernel)(Vect &origin, Vect &direction, HitRecord &record) = nullptr;
+  bool (Raytracer::*shadow_kernel)(Vect &origin, Vect &direction, float t_max) = nullptr;
+
+  // Counting must never bounce cache lines between cores. The vector's
+  // storage is only aligned for uint64_t, so each worker's counts are
+  // followed by a full line of padding: then no 64-byte line can hold
+  // counts of two workers, wherever the storage starts.
+  struct WorkerStats {
+    RayStats stats;
+    char padding[128 - sizeof(RayStats)];
+  };
+  static_assert(sizeof(RayStats) <= 64, "a worker's counts must fit in one cache line");
+  std::vector<WorkerStats> worker_stats;
+
+  static const int TILE_SIZE = 16;
+  // Tiles a worker takes through the wavefront stages at once.
+  static const int WAVE_TILES = 16;
+  // Anti-aliasing samples taken between checks of whether a pixel has
+  // enough.
+  static const int AA_ROUND = 4;
+  // Below this many point lights, visiting them all is cheaper than the
+  // light tree, and the lights are summed in scene order as always.
+  static const uint32_t LIGHT_TREE_MIN_LIGHTS = 16;
+
+  // Ray queues of one worker in wavefront mode, kept from wave to wave so
+  // steady-state rendering does not allocate. A path is one pixel's chain
+  // of primary and mirror rays; paths are numbered in generation order.
+  struct Wave {
+    struct Ray {
+      Vect origin;
+      Vect direction;
+      uint32_t path;
+    };
+    // Consecutive primary rays traced as one packet, as tracePacket would.
+    struct Group {
+      uint32_t first;
+      int lanes;
+    };
+    // Shading of one hit, added to the reflection it casts once that is
+    // known, deepest first, just as rayCast's recursion unwinds.
+    struct Segment {
+      Color direct;
+      float mirror;
+      uint32_t path;
+      bool reflected;
+    };
+
+    std::vector<Group> groups;
+    std::vector<Ray> rays;
+    std::vector<Ray> next_rays;
+    std::vector<HitRecord> hits;
+    std::vector<uint8_t> hit;
+    // Per ray, one mask per light laid out as shade() expects.
+    std::vector<uint32_t> occlusion;
+    std::vector<Segment> segments[MAX_BOUNCES + 1];
+    // Per path: hits along it, then its color.
+    std::vector<uint8_t> path_hits;
+    std::vector<Color> colors;
+  };
+  std::vector<Wave> waves;
+
+  friend class RaytracerBenchmark;
+
+  bool hitsSphere(Vect &origin, Vect &direction, uint32_t sphere, float min_t, float max_t, float &return_t);
+  bool hitsTriangle(Vect &origin, Vect &direction, uint32_t triangle, float min_t, float max_t, float &return_t);
+  bool closestHit(Vect &origin, Vect &direction, HitRecord &record) {
+    bool hit = (this->*closest_hit_kernel)(origin, direction, record);
+    if (hit) { PROFILE_COUNT(hits, 1); }
+    return hit;
+  }
+  // F holds the TRACE_FEATURES of the tree being traversed.
+  template <unsigned F>
+  bool closestHitBVH(Vect &origin, Vect &direction, HitRecord &record);
+  // Closest hit below BVH node `root` nearer than t: lowers t and fills in
+  // record. Instance leaves continue in their object's tree.
+  template <unsigned F>
+  void closestHitFrom(uint32_t root, Vect &origin, Vect &direction, uint32_t instance, float &t, HitRecord &record);
+  bool closestHitLinear(Vect &origin, Vect &direction, HitRecord &record);
+  bool inShadow(Vect &origin, Vect &direction, float t_max) {
+    bool blocked = (this->*shadow_kernel)(origin, direction, t_max);
+    if (blocked) { PROFILE_COUNT(shadow_early_exits, 1); }
+    return blocked;
+  }
+  template <unsigned F>
+  bool inShadowBVH(Vect &origin, Vect &direction, float t_max);
+  template <unsigned F>
+  bool inShadowFrom(uint32_t root, Vect &origin, Vect &direction, float t_max);
+  bool inShadowLinear(Vect &origin, Vect &direction, float t_max);
+  // Points the traversal kernels at the instances for the TRACE_FEATURES in
+  // `features` and for the accelerated setting.
+  void selectKernels(unsigned features);
+  // The shading functions below take the SHADING_FEATURES of the scene as F.
+  template <unsigned F>
+  Color rayCast(Vect &origin, Vect &direction, int bounces, RayStats &stats);
+  // Calls visit(light, weight) for each point light to shade `hit` with:
+  // all of them in order, or those the light tree picks.
+  template <class Visit>
+  void forEachLight(const Vect &hit, Visit visit);
+  // Shades a known hit. occlusion, when given, holds one lane mask per light
+  // (point lights, then the directional light) from a packet shadow pass.
+  template <unsigned F>
+  Color shade(Vect &origin, Vect &direction, HitRecord &record, int bounces, const uint32_t *occlusion, int lane,
+              RayStats &stats);
+  // Ambient, diffuse and specular light at a hit, without reflections.
+  // Returns the hit point, the normal facing the ray and the mirror factor.
+  // Only the FEATURE_SHADOWS and FEATURE_DIR_LIGHT bits of F matter.
+  template <unsigned F>
+  Color shadeDirect(Vect &origin, Vect &direction, HitRecord &record, const uint32_t *occlusion, int lane,
+                    RayStats &stats, Vect &hit, Vect &n, float &mirror);
+  // Ray through point (x, y) of the image plane, in pixels; a pixel's single
+  // sample goes through its corner (x, y).
+  Vect primaryDirection(float x, float y, float sin_theta, float cos_theta);
+  // Per-tile scratch of tracePacket: one lane mask of blocked shadow rays
+  // per light (point lights, then the directional light), and with the
+  // light tree, the lanes shading with each light and the lights some lane
+  // picked.
+  struct PacketShadows {
+    std::vector<uint32_t> occlusion;
+    std::vector<uint32_t> lanes;
+    std::vector<uint32_t> lights;
+  };
+  // Traces pixels (x + lane * spacing, y) for lanes [0, lanes). With
+  // `costs`, each lane's pixel is charged its own tests, rays and shading
+  // time, and an equal share of the packet traversal time.
+  template <unsigned F>
+  void tracePacket(Frame &frame, int x, int y, int lanes, int spacing, float sin_theta, float cos_theta,
+                   PacketShadows &shadows, RayStats &stats, CostMap *costs);
+  // A frame being rendered, the camera rotation it is seen with and where
+  // its pixel costs go, if anywhere.
+  struct View {
+    Frame *frame;
+    float sin_theta;
+    float cos_theta;
+    CostMap *costs;
+  };
+  static View makeView(Frame *frame, float theta, CostMap *costs);
+  // Sets up for rendering into frames of this one's size: picks the light
+  // selection and the traversal kernels, and returns the scene's features.
+  unsigned beginRender(const Frame &frame);
+  // Renders `region` of frames[i] at thetas[i] for every i as one pool run.
+  // costs is nullptr or holds a cost map per frame.
+  void renderViews(Frame *const *frames, const float *thetas, int count, const Region &region,
+                   CostMap *const *costs = nullptr);
+  // Tiles are numbered row by row within the region being rendered.
+  static Region tileRegion(const Region &region, int tile);
+  static int tileCount(const Region &region);
+  // Renders the region of every view a tile at a time.
+  void renderTiles(const std::vector<View> &views, const Region &region, unsigned features);
+  template <unsigned F>
+  void renderTile(Frame &frame, const Region &region, int tile, float sin_theta, float cos_theta, RayStats &stats,
+                  CostMap *costs);
+
+  // One tile of renderPass().
+  template <unsigned F>
+  void passTile(Frame &frame, const Region &region, int tile, int step, bool refining, float sin_theta,
+                float cos_theta, RayStats &stats);
+  // Adaptive anti-aliasing, run over the region after the first pass.
+  void refineViews(const std::vector<View> &views, const Region &region, unsigned features);
+  template <unsigned F>
+  void refineTile(Frame &frame, const Frame &base, const Region &region, int tile, float sin_theta, float cos_theta,
+                  RayStats &stats, CostMap *costs);
 
-  bool hits(Vect &origin, Vect &direction, Sphere *sphere, float min_t, float max_t, float &return_t);
-  bool hits(Vect &origin, Vect &direction, Triangle *triangle, float min_t, float max_t, float &return_t);
-  bool inShadow(Vect &origin, Vect &direction, float t_max);
-  Color rayCast(Vect &origin, Vect &direction, int bounces);
+  // Wavefront mode, in wavefront.cpp.
+  void renderWaves(const std::vector<View> &views, const Region &region, unsigned features);
+  template <unsigned F>
+  void renderWave(Frame &frame, const Region &region, int wave_index, float sin_theta, float cos_theta, Wave &wave,
+                  RayStats &stats);
+  void extendWave(Wave &wave, bool use_packets);
+  template <unsigned F>
+  void shadowWave(Wave &wave, bool use_packets);
+  template <unsigned F>
+  void shadeWave(Wave &wave, int depth, RayStats &stats);
+  static void sumWave(Wave &wave);
 public:
-  Raytracer(Vect origin, RenderingInfo *info) : origin(origin), info(info) {}
+  // thread_count <= 0 renders with one thread per hardware core. A prebuilt
+  // BVH for the scene (e.g. from a SceneCache) skips the build.
+  Raytracer(Vect origin, const CompiledScene *scene, int thread_count = 0, const BVH *prebuilt = nullptr)
+      : origin(origin), scene(scene), bvh(prebuilt ? *prebuilt : BVH(scene)), light_tree(scene), pool(thread_count),
+        worker_stats(pool.size()), waves(pool.size()) {
+    packet_scene = makePacketScene(scene, &bvh);
+    setSimdLevel(detectSimdLevel());
+    selectKernels(sceneFeatures());
+  }
+  // Renders the rows the frame holds, at the frame's image size.
   void render(Frame &frame);
+  // Renders only the pixels in `region`, exactly as render() would, and
+  // leaves the rest of the frame alone.
+  void render(Frame &frame, const Region &region);
+  // Renders frames[i] as render() would at theta thetas[i], all frames
+  // together: threads that run out of work on one frame carry on with the
+  // next. The scene is only read, so the frames share it and the BVH. The
+  // frames must all be the same size.
+  void renderBatch(Frame *const *frames, const float *thetas, int count);
+  // Render and renderBatch that also record what each pixel cost into
+  // costs (one per frame, reshaped to the image; frames must hold whole
+  // images). Recording adds little to the frame time, but wavefront mode
+  // has no per-pixel timing, so frames are traced recursively while it is
+  // on. The image is the same.
+  void render(Frame &frame, CostMap &costs);
+  void renderBatch(Frame *const *frames, const float *thetas, int count, CostMap *const *costs);
+  // Progressive rendering for interactive use. Traces the pixels at
+  // multiples of `step` (a power of two up to 16) in x and y, and fills the
+  // step x step block each is the corner of with its color; with
+  // `refining`, the pixels a pass with twice the step already traced into
+  // the frame are kept. Passes with steps 4, 2 and 1 show the image at
+  // 1/16, 1/4 and full detail, trace each pixel once and leave the frame
+  // exactly as render() would. Once *cancel is set, tiles not yet started
+  // are skipped and false is returned. The frame must hold its whole image.
+  bool renderPass(Frame &frame, int step, bool refining, const std::atomic<bool> *cancel = nullptr);
   void setTheta(float theta);
+  // Switches between BVH traversal and testing every primitive (for comparisons).
+  void setAccelerated(bool accelerated);
+  // Renders in stages over queues of rays (generate, extend, shadow, shade,
+  // then the mirror rays as the next wave) instead of following each ray to
+  // the end. The image is the same either way.
+  void setWavefront(bool wavefront);
+  // Scenes with many point lights shade each hit with only the lights
+  // whose irradiance there may reach `cutoff`, found through a light tree.
+  // With samples > 0, each hit instead takes that many lights at random,
+  // chosen by their likely contribution and weighted to keep the estimate
+  // unbiased; this costs the same for any number of lights but adds noise.
+  void setLightSampling(float cutoff, int samples);
+  // Adaptive anti-aliasing. After one ray per pixel, pixels that differ
+  // from a neighbor by more than `threshold` take more samples spread over
+  // their area, a few at a time, until the mean is known to within half the
+  // threshold or they have `max_samples`. Flat areas keep their one ray, so
+  // edges come out close to uniform supersampling at a fraction of its
+  // cost. Every pixel decides alike in a whole frame, a band or a tile, so
+  // banded and distributed renders match. max_samples <= 1 turns it off;
+  // the primary rays in rayStats() count the samples taken.
+  void setAntialiasing(int max_samples, float threshold);
+  // Mirror bounces after the primary hit, up to MAX_BOUNCES; fewer trade
+  // the depth of reflections in reflections for time.
+  void setBounces(int bounces);
+  // Picks the packet kernels for primary and shadow rays; SIMD_SCALAR traces
+  // every ray on its own. Returns the level actually in use.
+  SimdLevel setSimdLevel(SimdLevel level);
+  // Rays traced by all workers since construction or the last reset.
+  RayStats rayStats() const;
+  void resetRayStats();
+  const BVH &getBVH() const { return bvh; }
+  int threadCount() const { return pool.size(); }
+  // The scene's SceneFeature flags, which pick the code render() runs.
+  unsigned sceneFeatures() const;
+  // Brings the BVH up to date after the scene's spheres or instances moved
+  // (CompiledScene::animate). The top level is refitted, and rebuilt when
+  // the refit has degraded it too far. Not to be called during render().
+  SceneUpdate updateScene();
   //void setOrigin(Vect origin);
 };
\ No newline at end of file
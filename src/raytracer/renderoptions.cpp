@@ -0,0 +1,52 @@
+#include "renderoptions.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+const char *RENDER_OPTIONS_USAGE = "[--threads N] [--simd auto|scalar|sse|avx2|avx512] [--no-bvh] [--wavefront] [--no-cache]"
+    " [--light-cutoff X] [--light-samples N] [--aa MAX_SAMPLES] [--aa-threshold X]"
+    " [--bounces N]";
+
+bool parseRenderOption(int argc, char **argv, int &i, RenderOptions &options) {
+  if (strcmp(argv[i], "--no-bvh") == 0) {
+    options.accelerated = false;
+  } else if (strcmp(argv[i], "--wavefront") == 0) {
+    options.wavefront = true;
+  } else if (strcmp(argv[i], "--no-cache") == 0) {
+    options.use_cache = false;
+  } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+    options.threads = atoi(argv[++i]);
+  } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+    options.simd = argv[++i];
+  } else if (strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < argc) {
+    options.light_cutoff = (float)atof(argv[++i]);
+  } else if (strcmp(argv[i], "--light-samples") == 0 && i + 1 < argc) {
+    options.light_samples = atoi(argv[++i]);
+  } else if (strcmp(argv[i], "--aa") == 0 && i + 1 < argc) {
+    options.aa_samples = atoi(argv[++i]);
+  } else if (strcmp(argv[i], "--aa-threshold") == 0 && i + 1 < argc) {
+    options.aa_threshold = (float)atof(argv[++i]);
+  } else if (strcmp(argv[i], "--bounces") == 0 && i + 1 < argc) {
+    options.bounces = atoi(argv[++i]);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void applyRenderOptions(Raytracer &raytracer, const RenderOptions &options) {
+  raytracer.setAccelerated(options.accelerated);
+  raytracer.setWavefront(options.wavefront);
+  raytracer.setLightSampling(options.light_cutoff, options.light_samples);
+  raytracer.setAntialiasing(options.aa_samples, options.aa_threshold);
+  raytracer.setBounces(options.bounces);
+  if (strcmp(options.simd, "auto") != 0) {
+    SimdLevel level = SIMD_SCALAR;
+    for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++) {
+      if (strcmp(options.simd, simdLevelName((SimdLevel)l)) == 0) { level = (SimdLevel)l; }
+    }
+    // Never go past what the CPU supports.
+    raytracer.setSimdLevel(std::min(level, detectSimdLevel()));
+  }
+}
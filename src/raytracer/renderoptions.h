@@ -0,0 +1,29 @@
+#pragma once
+#include "raytracer.h"
+
+// Tracing options shared by the viewer and the headless renderer.
+struct RenderOptions {
+  bool accelerated = true;
+  bool wavefront = false;
+  int threads = 0;
+  const char *simd = "auto";
+  float light_cutoff = DEFAULT_LIGHT_CUTOFF;
+  // Lights sampled per hit; 0 uses every light above the cutoff.
+  int light_samples = 0;
+  // Adaptive anti-aliasing: most samples per pixel (1 for none) and the
+  // neighbor contrast that calls for them.
+  int aa_samples = 1;
+  float aa_threshold = DEFAULT_AA_THRESHOLD;
+  int bounces = MAX_BOUNCES;
+  // Load <scene>.bin instead of parsing when it is up to date.
+  bool use_cache = true;
+};
+
+// Consumes argv[i] (and its value, advancing i) if it is one of
+// --threads N, --simd LEVEL, --no-bvh, --wavefront, --no-cache, --light-cutoff X,
+// --light-samples N, --aa N, --aa-threshold X or --bounces N. Returns false for anything else.
+bool parseRenderOption(int argc, char **argv, int &i, RenderOptions &options);
+
+void applyRenderOptions(Raytracer &raytracer, const RenderOptions &options);
+
+extern const char *RENDER_OPTIONS_USAGE;
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Read-only array for scene data that either owns its elements (filled with
+// push_back while a scene or BVH is built) or views memory it does not own,
+// such as a memory-mapped scene cache. Copying a view copies the pointer.
+template <class T>
+class SceneArray {
+ private:
+  std::vector<T> storage;
+  const T *items = nullptr;
+  size_t count = 0;
+  bool owned = true;
+
+ public:
+  SceneArray() {}
+  SceneArray(const SceneArray &other)
+      : storage(other.storage), items(other.owned ? storage.data() : other.items), count(other.count),
+        owned(other.owned) {}
+  SceneArray &operator=(const SceneArray &other) {
+    storage = other.storage;
+    items = other.owned ? storage.data() : other.items;
+    count = other.count;
+    owned = other.owned;
+    return *this;
+  }
+
+  // Points at `count` elements owned elsewhere; they must outlive the array.
+  void view(const T *data, size_t count) {
+    storage.clear();
+    items = data;
+    this->count = count;
+    owned = false;
+  }
+
+  void reserve(size_t n) {
+    storage.reserve(n);
+    items = storage.data();
+  }
+  void push_back(const T &value) {
+    storage.push_back(value);
+    items = storage.data();
+    count = storage.size();
+  }
+  // Copies the elements of a view into owned storage, so they can be
+  // changed; does nothing for an owned array.
+  void detach() {
+    if (owned) { return; }
+    storage.assign(items, items + count);
+    items = storage.data();
+    owned = true;
+  }
+  // Drops the elements past the first n of an owned array.
+  void truncate(size_t n) {
+    storage.resize(n);
+    items = storage.data();
+    count = n;
+  }
+  // Writable access while the array owns its elements (during a build, or
+  // after detach()).
+  T &operator[](size_t i) { return storage[i]; }
+
+  const T &operator[](size_t i) const { return items[i]; }
+  const T *data() const { return items; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T *begin() const { return items; }
+  const T *end() const { return items + count; }
+};
@@ -0,0 +1,475 @@
+#include "scenecache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+#include "../configfile/meshloader.h"
+#include "../configfile/parser.h"
+#include "profile.h"
+
+namespace {
+// Bump whenever the layout below or of any stored struct changes.
+const uint32_t SCENE_CACHE_VERSION = 5;
+const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const size_t ARRAY_ALIGNMENT = 64;
+// Traversal stacks hold 64 entries, and a tree of depth d needs d + 1.
+const int MAX_TREE_DEPTH = 63;
+
+enum CacheArray {
+  ARRAY_MATERIALS,
+  ARRAY_LIGHT_X, ARRAY_LIGHT_Y, ARRAY_LIGHT_Z, ARRAY_LIGHT_INTENSITY,
+  ARRAY_SPHERE_X, ARRAY_SPHERE_Y, ARRAY_SPHERE_Z, ARRAY_SPHERE_R2, ARRAY_SPHERE_MATERIAL,
+  ARRAY_VERTICES, ARRAY_TRI_INDICES, ARRAY_TRI_RANGES,
+  ARRAY_OBJECTS, ARRAY_INSTANCES,
+  ARRAY_SPHERE_KEYS, ARRAY_INSTANCE_KEYS,
+  ARRAY_BVH_NODES, ARRAY_BVH_PRIMITIVES, ARRAY_BVH_OBJECT_ROOTS,
+  ARRAY_DEPENDENCIES,
+  ARRAY_COUNT
+};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t material_size;
+  uint32_t node_size;
+  uint64_t file_size;
+
+  // Stamp of the .scene file this was compiled from. The stamps of the mesh
+  // files it names are in ARRAY_DEPENDENCIES.
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+
+  float ambient;
+  float focal_length;
+  uint32_t shadows;
+  uint32_t has_dir_light;
+  float dir_light_direction[3];
+  float dir_light_intensity;
+  uint32_t has_bvh;
+  uint32_t bvh_root;
+
+  struct {
+    uint64_t offset;
+    uint64_t count;
+  } arrays[ARRAY_COUNT];
+};
+
+struct SourceStamp {
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+bool sourceStamp(const std::string &path, SourceStamp &stamp) {
+#ifdef _WIN32
+  struct _stat64 info;
+  if (_stat64(path.c_str(), &info) != 0) { return false; }
+  stamp.mtime_nsec = 0;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) { return false; }
+#if defined(__APPLE__)
+  stamp.mtime_nsec = info.st_mtimespec.tv_nsec;
+#else
+  stamp.mtime_nsec = info.st_mtim.tv_nsec;
+#endif
+#endif
+  stamp.size = (uint64_t)info.st_size;
+  stamp.mtime_sec = (int64_t)info.st_mtime;
+  return true;
+}
+
+// Element size and data of every stored array, in CacheArray order.
+struct ArrayRef {
+  size_t element_size;
+  const void *data;
+  size_t count;
+};
+
+template <class T>
+ArrayRef arrayRef(const SceneArray<T> &array) {
+  return {sizeof(T), array.data(), array.size()};
+}
+
+// Per mesh file: its SourceStamp, the uint32_t length of its name and the
+// name as written in the scene.
+std::string dependencyRecords(const CompiledScene &scene, const std::string &source) {
+  std::string records;
+  for (const std::string &mesh_file : scene.mesh_files) {
+    SourceStamp stamp;
+    if (!sourceStamp(resolveScenePath(source, mesh_file), stamp)) { return std::string(); }
+    uint32_t length = (uint32_t)mesh_file.size();
+    records.append((const char *)&stamp, sizeof(stamp));
+    records.append((const char *)&length, sizeof(length));
+    records.append(mesh_file);
+  }
+  return records;
+}
+
+// Checks every mesh file recorded by dependencyRecords against the disk.
+bool dependenciesCurrent(const char *records, size_t size, const std::string &source,
+                         std::vector<std::string> &mesh_files) {
+  const char *end = records + size;
+  while (records != end) {
+    SourceStamp recorded, stamp;
+    uint32_t length;
+    if ((size_t)(end - records) < sizeof(recorded) + sizeof(length)) { return false; }
+    memcpy(&recorded, records, sizeof(recorded));
+    memcpy(&length, records + sizeof(recorded), sizeof(length));
+    records += sizeof(recorded) + sizeof(length);
+    if ((size_t)(end - records) < length) { return false; }
+    std::string mesh_file(records, length);
+    records += length;
+    if (!sourceStamp(resolveScenePath(source, mesh_file), stamp) || stamp.size != recorded.size ||
+        stamp.mtime_sec != recorded.mtime_sec || stamp.mtime_nsec != recorded.mtime_nsec) {
+      return false;
+    }
+    mesh_files.push_back(mesh_file);
+  }
+  return true;
+}
+
+void sceneArrays(const CompiledScene &scene, const BVH *bvh, const std::string &dependencies,
+                 ArrayRef refs[ARRAY_COUNT]) {
+  refs[ARRAY_MATERIALS] = arrayRef(scene.materials);
+  refs[ARRAY_LIGHT_X] = arrayRef(scene.light_x);
+  refs[ARRAY_LIGHT_Y] = arrayRef(scene.light_y);
+  refs[ARRAY_LIGHT_Z] = arrayRef(scene.light_z);
+  refs[ARRAY_LIGHT_INTENSITY] = arrayRef(scene.light_intensity);
+  refs[ARRAY_SPHERE_X] = arrayRef(scene.sphere_x);
+  refs[ARRAY_SPHERE_Y] = arrayRef(scene.sphere_y);
+  refs[ARRAY_SPHERE_Z] = arrayRef(scene.sphere_z);
+  refs[ARRAY_SPHERE_R2] = arrayRef(scene.sphere_r2);
+  refs[ARRAY_SPHERE_MATERIAL] = arrayRef(scene.sphere_material);
+  refs[ARRAY_VERTICES] = arrayRef(scene.vertices);
+  refs[ARRAY_TRI_INDICES] = arrayRef(scene.tri_indices);
+  refs[ARRAY_TRI_RANGES] = arrayRef(scene.tri_ranges);
+  refs[ARRAY_OBJECTS] = arrayRef(scene.objects);
+  refs[ARRAY_INSTANCES] = arrayRef(scene.instances);
+  refs[ARRAY_SPHERE_KEYS] = arrayRef(scene.sphere_keys);
+  refs[ARRAY_INSTANCE_KEYS] = arrayRef(scene.instance_keys);
+  refs[ARRAY_BVH_NODES] = bvh ? arrayRef(bvh->getNodes()) : ArrayRef{sizeof(BVHNode), nullptr, 0};
+  refs[ARRAY_BVH_PRIMITIVES] = bvh ? arrayRef(bvh->getPrimitives()) : ArrayRef{sizeof(PrimitiveRef), nullptr, 0};
+  refs[ARRAY_BVH_OBJECT_ROOTS] = bvh ? arrayRef(bvh->getObjectRoots()) : ArrayRef{sizeof(uint32_t), nullptr, 0};
+  refs[ARRAY_DEPENDENCIES] = {1, dependencies.data(), dependencies.size()};
+}
+
+size_t alignUp(size_t offset) { return (offset + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT; }
+
+template <class T>
+void viewArray(SceneArray<T> &array, const MappedFile &file, const CacheHeader &header, int index) {
+  array.view((const T *)(file.data() + header.arrays[index].offset), header.arrays[index].count);
+}
+// Every material, object, triangle and vertex index the scene holds is in
+// range, and the triangle runs start at triangle 0 and go up.
+bool sceneIndicesValid(const CompiledScene &scene) {
+  uint64_t material_count = scene.materials.size();
+  for (uint32_t material : scene.sphere_material) {
+    if (material >= material_count) { return false; }
+  }
+  uint64_t vertex_count = scene.vertices.size() / 3;
+  for (uint32_t index : scene.tri_indices) {
+    if (index >= vertex_count) { return false; }
+  }
+  const SceneArray<TriangleRange> &ranges = scene.tri_ranges;
+  if (scene.triangleCount() > 0 && (ranges.empty() || ranges[0].first_triangle != 0)) { return false; }
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (ranges[i].material >= material_count || ranges[i].first_triangle >= scene.triangleCount() ||
+        (i > 0 && ranges[i].first_triangle <= ranges[i - 1].first_triangle)) {
+      return false;
+    }
+  }
+  for (const SceneObject &object : scene.objects) {
+    if ((uint64_t)object.first_triangle + object.triangle_count > scene.triangleCount()) { return false; }
+  }
+  for (const SceneInstance &instance : scene.instances) {
+    if (instance.object >= scene.objectCount() || instance.material >= material_count) { return false; }
+  }
+  return true;
+}
+
+// Whether traversal may meet `primitive` in the top level or, for
+// `object_tree`, in an object's tree. The kernels are picked by what the
+// scene holds (see Raytracer::traceFeatures), so the top level may only
+// name world triangles and instances of objects that have triangles.
+bool primitiveValid(const PrimitiveRef &primitive, bool object_tree, const CompiledScene &scene) {
+  switch (primitive.type) {
+    case PRIMITIVE_SPHERE:
+      return !object_tree && primitive.index < scene.sphereCount();
+    case PRIMITIVE_TRIANGLE:
+      return primitive.index < (object_tree ? scene.triangleCount() : scene.worldTriangleCount());
+    case PRIMITIVE_INSTANCE:
+      return !object_tree && primitive.index < scene.instanceCount() &&
+             scene.objects[scene.instances[primitive.index].object].triangle_count > 0;
+    default:
+      return false;
+  }
+}
+
+// Walks the tree at `root` as traversal would: no deeper than the stacks
+// allow and over nothing but the primitives it may hold. The trees share
+// no nodes, so `visits` over all of them stays within the node count.
+bool treeValid(const BVH &bvh, uint32_t root, bool object_tree, const CompiledScene &scene, uint64_t &visits) {
+  const SceneArray<BVHNode> &nodes = bvh.getNodes();
+  const SceneArray<PrimitiveRef> &primitives = bvh.getPrimitives();
+  std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(root, 0));
+  while (!stack.empty()) {
+    uint32_t index = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+    if (index >= nodes.size() || depth > MAX_TREE_DEPTH || ++visits > nodes.size()) { return false; }
+    const BVHNode &node = nodes[index];
+    if (!node.isLeaf()) {
+      stack.push_back(std::make_pair(index + 1, depth + 1));
+      stack.push_back(std::make_pair(node.offset, depth + 1));
+      continue;
+    }
+    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+      if (!primitiveValid(primitives[i], object_tree, scene)) { return false; }
+    }
+  }
+  return true;
+}
+
+// Every node's children come after it and its primitives exist, which
+// refit() relies on for all nodes, inner nodes split along x, y or z (the
+// packet kernels order children by it), and every tree reached from a root
+// is one traversal can walk.
+bool bvhValid(const BVH &bvh, const CompiledScene &scene) {
+  const SceneArray<BVHNode> &nodes = bvh.getNodes();
+  const SceneArray<PrimitiveRef> &primitives = bvh.getPrimitives();
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const BVHNode &node = nodes[i];
+    bool children_valid = node.offset > i + 1 && node.offset < nodes.size() && node.axis < 3;
+    if (node.isLeaf() ? (uint64_t)node.offset + node.count > primitives.size() : !children_valid) { return false; }
+  }
+
+  // The BVH is only empty when the top level would be, and
+  // rebuildTopLevel() takes the top level off the end of the primitives.
+  uint64_t top_level_count = scene.sphereCount() + scene.worldTriangleCount();
+  for (const SceneInstance &instance : scene.instances) {
+    top_level_count += scene.objects[instance.object].triangle_count != 0;
+  }
+  if (bvh.empty()) { return top_level_count == 0; }
+  if (top_level_count > primitives.size()) { return false; }
+
+  uint64_t visits = 0;
+  for (uint32_t o = 0; o < scene.objectCount(); o++) {
+    if (scene.objects[o].triangle_count == 0) { continue; }
+    if (!treeValid(bvh, bvh.getObjectRoots()[o], true, scene, visits)) { return false; }
+  }
+  return treeValid(bvh, bvh.getRoot(), false, scene, visits);
+}
+}  // namespace
+
+std::string SceneCache::pathFor(const std::string &source) { return source + ".bin"; }
+
+bool SceneCache::write(const std::string &path, const std::string &source, const CompiledScene &scene,
+                       const BVH *bvh) {
+  SourceStamp stamp;
+  if (!sourceStamp(source, stamp)) {
+    std::cout << "File " << source << " failed to open" << std::endl;
+    return false;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_CACHE_VERSION;
+  header.byte_order = BYTE_ORDER_MARK;
+  header.material_size = sizeof(ShadingMaterial);
+  header.node_size = sizeof(BVHNode);
+  header.source_size = stamp.size;
+  header.source_mtime_sec = stamp.mtime_sec;
+  header.source_mtime_nsec = stamp.mtime_nsec;
+  header.ambient = scene.ambient;
+  header.focal_length = scene.focal_length;
+  header.shadows = scene.shadows;
+  header.has_dir_light = scene.has_dir_light;
+  header.dir_light_direction[0] = scene.dir_light_direction.x;
+  header.dir_light_direction[1] = scene.dir_light_direction.y;
+  header.dir_light_direction[2] = scene.dir_light_direction.z;
+  header.dir_light_intensity = scene.dir_light_intensity;
+  header.has_bvh = bvh != nullptr;
+  header.bvh_root = bvh ? bvh->getRoot() : 0;
+
+  std::string dependencies = dependencyRecords(scene, source);
+  if (dependencies.empty() && !scene.mesh_files.empty()) {
+    std::cout << "Mesh files of " << source << " failed to open" << std::endl;
+    return false;
+  }
+
+  ArrayRef refs[ARRAY_COUNT];
+  sceneArrays(scene, bvh, dependencies, refs);
+  size_t offset = alignUp(sizeof(header));
+  for (int i = 0; i < ARRAY_COUNT; i++) {
+    header.arrays[i].offset = offset;
+    header.arrays[i].count = refs[i].count;
+    offset = alignUp(offset + refs[i].count * refs[i].element_size);
+  }
+  header.file_size = offset;
+
+  // Written under a temporary name and renamed, so a reader never maps a
+  // half-written file.
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    if (!file.is_open()) {
+      std::cout << "File " << temporary << " failed to open" << std::endl;
+      return false;
+    }
+    static const char zeros[ARRAY_ALIGNMENT] = {0};
+    file.write((const char *)&header, sizeof(header));
+    size_t written = sizeof(header);
+    for (int i = 0; i < ARRAY_COUNT; i++) {
+      file.write(zeros, header.arrays[i].offset - written);
+      size_t bytes = refs[i].count * refs[i].element_size;
+      if (bytes != 0) { file.write((const char *)refs[i].data, bytes); }
+      written = header.arrays[i].offset + bytes;
+    }
+    file.write(zeros, header.file_size - written);
+    if (!file.good()) {
+      std::cout << "Failed to write " << temporary << std::endl;
+      return false;
+    }
+  }
+  std::remove(path.c_str());
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cout << "Failed to write " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool SceneCache::open(const std::string &path, const std::string &source) {
+  bvh.reset();
+  scene = CompiledScene();
+  if (!file.open(path)) { return false; }
+
+  const CacheHeader *header = (const CacheHeader *)file.data();
+  SourceStamp stamp;
+  bool valid = file.size() >= sizeof(CacheHeader) && memcmp(header->magic, SCENE_CACHE_MAGIC, 8) == 0 &&
+               header->version == SCENE_CACHE_VERSION && header->byte_order == BYTE_ORDER_MARK &&
+               header->material_size == sizeof(ShadingMaterial) && header->node_size == sizeof(BVHNode) &&
+               header->file_size == file.size() && sourceStamp(source, stamp) &&
+               header->source_size == stamp.size && header->source_mtime_sec == stamp.mtime_sec &&
+               header->source_mtime_nsec == stamp.mtime_nsec;
+
+  ArrayRef refs[ARRAY_COUNT];
+  sceneArrays(scene, nullptr, std::string(), refs);
+  for (int i = 0; valid && i < ARRAY_COUNT; i++) {
+    uint64_t offset = header->arrays[i].offset;
+    uint64_t count = header->arrays[i].count;
+    valid = offset % ARRAY_ALIGNMENT == 0 && offset <= file.size() &&
+            count <= (file.size() - offset) / refs[i].element_size;
+  }
+  uint64_t sphere_count = valid ? header->arrays[ARRAY_SPHERE_X].count : 0;
+  for (int i = ARRAY_SPHERE_X; valid && i <= ARRAY_SPHERE_MATERIAL; i++) {
+    valid = header->arrays[i].count == sphere_count;
+  }
+  valid = valid && header->arrays[ARRAY_VERTICES].count % 3 == 0 && header->arrays[ARRAY_TRI_INDICES].count % 3 == 0 &&
+          header->arrays[ARRAY_TRI_INDICES].count / 3 <= UINT32_MAX;
+  for (int i = ARRAY_LIGHT_X; valid && i <= ARRAY_LIGHT_INTENSITY; i++) {
+    valid = header->arrays[i].count == header->arrays[ARRAY_LIGHT_X].count;
+  }
+  // An empty BVH has no primitives or object trees either.
+  valid = valid && (!header->has_bvh ||
+                    (header->arrays[ARRAY_BVH_NODES].count == 0 && header->arrays[ARRAY_BVH_PRIMITIVES].count == 0) ||
+                    (header->arrays[ARRAY_BVH_OBJECT_ROOTS].count == header->arrays[ARRAY_OBJECTS].count &&
+                     header->bvh_root < header->arrays[ARRAY_BVH_NODES].count));
+  // animate() writes to the spheres and instances the keys name.
+  const SphereKey *sphere_keys = (const SphereKey *)(file.data() + header->arrays[ARRAY_SPHERE_KEYS].offset);
+  for (uint64_t i = 0; valid && i < header->arrays[ARRAY_SPHERE_KEYS].count; i++) {
+    valid = sphere_keys[i].sphere < sphere_count;
+  }
+  const InstanceKey *instance_keys = (const InstanceKey *)(file.data() + header->arrays[ARRAY_INSTANCE_KEYS].offset);
+  for (uint64_t i = 0; valid && i < header->arrays[ARRAY_INSTANCE_KEYS].count; i++) {
+    valid = instance_keys[i].instance < header->arrays[ARRAY_INSTANCES].count;
+  }
+  valid = valid && dependenciesCurrent(file.data() + header->arrays[ARRAY_DEPENDENCIES].offset,
+                                       header->arrays[ARRAY_DEPENDENCIES].count, source, scene.mesh_files);
+  if (!valid) {
+    file.close();
+    return false;
+  }
+
+  scene.ambient = header->ambient;
+  scene.focal_length = header->focal_length;
+  scene.shadows = header->shadows != 0;
+  scene.has_dir_light = header->has_dir_light != 0;
+  scene.dir_light_direction = Vect{header->dir_light_direction[0], header->dir_light_direction[1],
+                                   header->dir_light_direction[2]};
+  scene.dir_light_intensity = header->dir_light_intensity;
+
+  viewArray(scene.materials, file, *header, ARRAY_MATERIALS);
+  viewArray(scene.light_x, file, *header, ARRAY_LIGHT_X);
+  viewArray(scene.light_y, file, *header, ARRAY_LIGHT_Y);
+  viewArray(scene.light_z, file, *header, ARRAY_LIGHT_Z);
+  viewArray(scene.light_intensity, file, *header, ARRAY_LIGHT_INTENSITY);
+  viewArray(scene.sphere_x, file, *header, ARRAY_SPHERE_X);
+  viewArray(scene.sphere_y, file, *header, ARRAY_SPHERE_Y);
+  viewArray(scene.sphere_z, file, *header, ARRAY_SPHERE_Z);
+  viewArray(scene.sphere_r2, file, *header, ARRAY_SPHERE_R2);
+  viewArray(scene.sphere_material, file, *header, ARRAY_SPHERE_MATERIAL);
+  viewArray(scene.vertices, file, *header, ARRAY_VERTICES);
+  viewArray(scene.tri_indices, file, *header, ARRAY_TRI_INDICES);
+  viewArray(scene.tri_ranges, file, *header, ARRAY_TRI_RANGES);
+  viewArray(scene.objects, file, *header, ARRAY_OBJECTS);
+  viewArray(scene.instances, file, *header, ARRAY_INSTANCES);
+  viewArray(scene.sphere_keys, file, *header, ARRAY_SPHERE_KEYS);
+  viewArray(scene.instance_keys, file, *header, ARRAY_INSTANCE_KEYS);
+
+  if (header->has_bvh) {
+    bvh.reset(new BVH((const BVHNode *)(file.data() + header->arrays[ARRAY_BVH_NODES].offset),
+                      header->arrays[ARRAY_BVH_NODES].count,
+                      (const PrimitiveRef *)(file.data() + header->arrays[ARRAY_BVH_PRIMITIVES].offset),
+                      header->arrays[ARRAY_BVH_PRIMITIVES].count,
+                      (const uint32_t *)(file.data() + header->arrays[ARRAY_BVH_OBJECT_ROOTS].offset),
+                      header->arrays[ARRAY_BVH_OBJECT_ROOTS].count, header->bvh_root));
+  }
+  // Checked once here, so that tracing and shading never have to.
+  if (!sceneIndicesValid(scene) || (bvh && !bvhValid(*bvh, scene))) {
+    bvh.reset();
+    scene = CompiledScene();
+    file.close();
+    return false;
+  }
+  return true;
+}
+
+bool LoadedScene::load(const std::string &path, bool use_cache) {
+  {
+    PROFILE_SCOPE("load cache");
+    cached = use_cache && cache.open(SceneCache::pathFor(path), path);
+  }
+  if (cached) { return true; }
+
+  std::unique_ptr<RenderingInfo> info;
+  {
+    PROFILE_SCOPE("parse");
+    Parser parser;
+    try {
+      info = parser.parseFile(path);
+    } catch (const std::string &error) {
+      std::cout << error << std::endl;
+    } catch (const std::exception &error) {
+      // Running out of memory on a huge scene, say; a daemon must outlive it.
+      std::cout << "Failed to parse " << path << ": " << error.what() << std::endl;
+    }
+  }
+  if (!info) { return false; }
+  PROFILE_SCOPE("compile scene");
+  // The compiled scene copies what it needs, so the parse tree, with the
+  // vertex and index buffers of its meshes, goes as soon as it is built.
+  compiled.reset(new CompiledScene(info.get()));
+  return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "bvh.h"
+#include "compiledscene.h"
+#include "mappedfile.h"
+
+// Binary, versioned snapshot of a CompiledScene and optionally its BVH. The
+// file is memory-mapped and its arrays are used in place, so loading does no
+// parsing and no per-object allocation. Each file records the size and
+// modification time of the .scene it was compiled from; if the source has
+// changed since, or the file comes from another version or platform, open()
+// refuses it.
+class SceneCache {
+ private:
+  MappedFile file;
+  CompiledScene scene;
+  std::unique_ptr<BVH> bvh;
+
+ public:
+  // Where the cache for a .scene file lives: next to it, with ".bin" added.
+  static std::string pathFor(const std::string &source);
+
+  // Writes `scene` (and `bvh`, if given) compiled from `source` to `path`.
+  static bool write(const std::string &path, const std::string &source, const CompiledScene &scene, const BVH *bvh);
+
+  // Maps `path`; false if it is missing, malformed or stale for `source`.
+  bool open(const std::string &path, const std::string &source);
+
+  const CompiledScene &getScene() const { return scene; }
+  CompiledScene &getScene() { return scene; }
+  // The stored BVH, or nullptr if the cache was written without one.
+  const BVH *getBVH() const { return bvh.get(); }
+};
+
+// The scene a front end renders: the cache next to the .scene file when it
+// is current, the text parser otherwise.
+class LoadedScene {
+ private:
+  SceneCache cache;
+  std::unique_ptr<CompiledScene> compiled;
+  bool cached = false;
+
+ public:
+  // Prints the parser's error and returns false if the scene can't be read.
+  bool load(const std::string &path, bool use_cache);
+
+  const CompiledScene *getScene() const { return cached ? &cache.getScene() : compiled.get(); }
+  // For animate(); the cached arrays it changes are copied first.
+  CompiledScene *getScene() { return cached ? &cache.getScene() : compiled.get(); }
+  const BVH *getBVH() const { return cached ? cache.getBVH() : nullptr; }
+  bool fromCache() const { return cached; }
+};
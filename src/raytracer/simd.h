@@ -0,0 +1,122 @@
+#pragma once
+// Thin wrappers giving SSE, AVX2 and AVX-512 registers one interface so the
+// packet kernels can be written once as templates. Each wrapper is only
+// available in translation units compiled for its instruction set.
+
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+
+struct Float4 {
+  typedef __m128 Reg;
+  typedef __m128 Mask;
+  static const int LANES = 4;
+
+  static Reg load(const float *p) { return _mm_load_ps(p); }
+  static void store(float *p, Reg v) { _mm_store_ps(p, v); }
+  static Reg set1(float f) { return _mm_set1_ps(f); }
+
+  static Reg add(Reg a, Reg b) { return _mm_add_ps(a, b); }
+  static Reg sub(Reg a, Reg b) { return _mm_sub_ps(a, b); }
+  static Reg mul(Reg a, Reg b) { return _mm_mul_ps(a, b); }
+  static Reg div(Reg a, Reg b) { return _mm_div_ps(a, b); }
+  static Reg sqrt(Reg a) { return _mm_sqrt_ps(a); }
+  static Reg neg(Reg a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+  // (a < b) ? a : b and (a > b) ? a : b, lane-wise
+  static Reg min(Reg a, Reg b) { return _mm_min_ps(a, b); }
+  static Reg max(Reg a, Reg b) { return _mm_max_ps(a, b); }
+
+  static Mask lt(Reg a, Reg b) { return _mm_cmplt_ps(a, b); }
+  static Mask le(Reg a, Reg b) { return _mm_cmple_ps(a, b); }
+  static Mask gt(Reg a, Reg b) { return _mm_cmpgt_ps(a, b); }
+  static Mask ge(Reg a, Reg b) { return _mm_cmpge_ps(a, b); }
+
+  static Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+  static Mask maskOr(Mask a, Mask b) { return _mm_or_ps(a, b); }
+  // a & ~b
+  static Mask maskAndNot(Mask a, Mask b) { return _mm_andnot_ps(b, a); }
+  static Reg select(Mask m, Reg a, Reg b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+
+  static uint32_t bits(Mask m) { return (uint32_t)_mm_movemask_ps(m); }
+  static Mask fromBits(uint32_t bits) {
+    __m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i set = _mm_and_si128(_mm_set1_epi32((int)bits), lanes);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(set, lanes));
+  }
+};
+#endif
+
+#if defined(__AVX2__)
+struct Float8 {
+  typedef __m256 Reg;
+  typedef __m256 Mask;
+  static const int LANES = 8;
+
+  static Reg load(const float *p) { return _mm256_load_ps(p); }
+  static void store(float *p, Reg v) { _mm256_store_ps(p, v); }
+  static Reg set1(float f) { return _mm256_set1_ps(f); }
+
+  static Reg add(Reg a, Reg b) { return _mm256_add_ps(a, b); }
+  static Reg sub(Reg a, Reg b) { return _mm256_sub_ps(a, b); }
+  static Reg mul(Reg a, Reg b) { return _mm256_mul_ps(a, b); }
+  static Reg div(Reg a, Reg b) { return _mm256_div_ps(a, b); }
+  static Reg sqrt(Reg a) { return _mm256_sqrt_ps(a); }
+  static Reg neg(Reg a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+  static Reg min(Reg a, Reg b) { return _mm256_min_ps(a, b); }
+  static Reg max(Reg a, Reg b) { return _mm256_max_ps(a, b); }
+
+  static Mask lt(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static Mask le(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+  static Mask gt(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static Mask ge(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+
+  static Mask maskAnd(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+  static Mask maskOr(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+  static Mask maskAndNot(Mask a, Mask b) { return _mm256_andnot_ps(b, a); }
+  static Reg select(Mask m, Reg a, Reg b) { return _mm256_blendv_ps(b, a, m); }
+
+  static uint32_t bits(Mask m) { return (uint32_t)_mm256_movemask_ps(m); }
+  static Mask fromBits(uint32_t bits) {
+    __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i set = _mm256_and_si256(_mm256_set1_epi32((int)bits), lanes);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lanes));
+  }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Float16 {
+  typedef __m512 Reg;
+  typedef __mmask16 Mask;
+  static const int LANES = 16;
+
+  static Reg load(const float *p) { return _mm512_load_ps(p); }
+  static void store(float *p, Reg v) { _mm512_store_ps(p, v); }
+  static Reg set1(float f) { return _mm512_set1_ps(f); }
+
+  static Reg add(Reg a, Reg b) { return _mm512_add_ps(a, b); }
+  static Reg sub(Reg a, Reg b) { return _mm512_sub_ps(a, b); }
+  static Reg mul(Reg a, Reg b) { return _mm512_mul_ps(a, b); }
+  static Reg div(Reg a, Reg b) { return _mm512_div_ps(a, b); }
+  static Reg sqrt(Reg a) { return _mm512_sqrt_ps(a); }
+  static Reg neg(Reg a) {
+    return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32((int)0x80000000)));
+  }
+  static Reg min(Reg a, Reg b) { return _mm512_min_ps(a, b); }
+  static Reg max(Reg a, Reg b) { return _mm512_max_ps(a, b); }
+
+  static Mask lt(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static Mask le(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+  static Mask gt(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+  static Mask ge(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+
+  static Mask maskAnd(Mask a, Mask b) { return (Mask)(a & b); }
+  static Mask maskOr(Mask a, Mask b) { return (Mask)(a | b); }
+  static Mask maskAndNot(Mask a, Mask b) { return (Mask)(a & ~b); }
+  static Reg select(Mask m, Reg a, Reg b) { return _mm512_mask_blend_ps(m, b, a); }
+
+  static uint32_t bits(Mask m) { return (uint32_t)m; }
+  static Mask fromBits(uint32_t bits) { return (Mask)bits; }
+};
+#endif
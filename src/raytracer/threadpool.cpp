@@ -0,0 +1,100 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int thread_count) {
+  if (thread_count <= 0) {
+    thread_count = (int)std::thread::hardware_concurrency();
+    if (thread_count <= 0) { thread_count = 1; }
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    queues.push_back(new WorkerQueue());
+  }
+  for (int i = 1; i < thread_count; i++) {
+    threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  job_ready.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (auto queue : queues) {
+    delete queue;
+  }
+}
+
+bool ThreadPool::popLocal(int worker, int &index) {
+  WorkerQueue *queue = queues[worker];
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  if (queue->tasks.empty()) { return false; }
+  index = queue->tasks.back();
+  queue->tasks.pop_back();
+  return true;
+}
+
+bool ThreadPool::steal(int worker, int &index) {
+  int count = (int)queues.size();
+  for (int i = 1; i < count; i++) {
+    WorkerQueue *victim = queues[(worker + i) % count];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (victim->tasks.empty()) { continue; }
+    index = victim->tasks.front();
+    victim->tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::drain(int worker) {
+  int index;
+  while (popLocal(worker, index) || steal(worker, index)) {
+    (*task)(index, worker);
+  }
+}
+
+void ThreadPool::workerLoop(int worker) {
+  unsigned seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job_ready.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) { return; }
+      seen = generation;
+    }
+
+    drain(worker);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy_workers--;
+    }
+    job_done.notify_all();
+  }
+}
+
+void ThreadPool::run(int count, const std::function<void(int, int)> &task) {
+  int workers = (int)queues.size();
+  // Queues are filled back to front so owners pop indices in ascending order.
+  for (int i = count - 1; i >= 0; i--) {
+    queues[i % workers]->tasks.push_back(i);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &task;
+    busy_workers = workers - 1;
+    generation++;
+  }
+  job_ready.notify_all();
+
+  drain(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  job_done.wait(lock, [&] { return busy_workers == 0; });
+  this->task = nullptr;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. Each call to run() deals the task
+// indices round-robin onto per-worker queues; a worker that drains its own
+// queue steals from the front of the others, so expensive tasks clustered
+// in one part of the index range still spread across all threads.
+class ThreadPool {
+ private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<int> tasks;
+  };
+
+  std::vector<std::thread> threads;
+  std::vector<WorkerQueue *> queues;
+
+  std::mutex mutex;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+  const std::function<void(int, int)> *task = nullptr;
+  unsigned generation = 0;
+  int busy_workers = 0;
+  bool stopping = false;
+
+  void workerLoop(int worker);
+  void drain(int worker);
+  bool popLocal(int worker, int &index);
+  bool steal(int worker, int &index);
+
+ public:
+  // thread_count <= 0 uses one thread per hardware core.
+  explicit ThreadPool(int thread_count);
+  ~ThreadPool();
+
+  int size() const { return (int)queues.size(); }
+
+  // Calls task(index, worker) for every index in [0, count) and blocks until
+  // all of them have finished. The calling thread takes part as worker 0.
+  void run(int count, const std::function<void(int, int)> &task);
+};
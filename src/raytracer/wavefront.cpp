@@ -0,0 +1,221 @@
+// Wavefront mode: a worker takes WAVE_TILES tiles at a time through
+// separate stages, each run over the whole queue before the next starts.
+//
+//   generate  primary rays for every pixel of the wave
+//   extend    closest hit of every queued ray
+//   shadow    any-hit test of every shadow ray of every hit
+//   shade     direct light at every hit; mirror rays form the next queue
+//
+// Extend, shadow and shade repeat until no ray is left, then each pixel's
+// path is summed. The same packet and single-ray routines as the recursive
+// path are used for the same rays, so the image is identical.
+#include "raytracer.h"
+
+#include <algorithm>
+#include <limits>
+
+void Raytracer::renderWaves(const std::vector<View> &views, const Region &region, unsigned features) {
+  typedef void (Raytracer::*WaveRenderer)(Frame &, const Region &, int, float, float, Wave &, RayStats &);
+  static const WaveRenderer wave_renderers[SHADING_FEATURES + 1] = {
+      &Raytracer::renderWave<0>, &Raytracer::renderWave<1>, &Raytracer::renderWave<2>, &Raytracer::renderWave<3>,
+      &Raytracer::renderWave<4>, &Raytracer::renderWave<5>, &Raytracer::renderWave<6>, &Raytracer::renderWave<7>};
+  WaveRenderer render_wave = wave_renderers[features & SHADING_FEATURES];
+
+  int wave_count = (tileCount(region) + WAVE_TILES - 1) / WAVE_TILES;
+  pool.run(wave_count * (int)views.size(), [&](int task, int worker) {
+    const View &view = views[task / wave_count];
+    (this->*render_wave)(*view.frame, region, task % wave_count, view.sin_theta, view.cos_theta, waves[worker],
+                         worker_stats[worker].stats);
+  });
+}
+
+template <unsigned F>
+void Raytracer::renderWave(Frame &frame, const Region &region, int wave_index, float sin_theta, float cos_theta,
+                           Wave &wave, RayStats &stats) {
+  PROFILE_SCOPE("trace wave");
+  int first_tile = wave_index * WAVE_TILES;
+  int last_tile = std::min(first_tile + WAVE_TILES, tileCount(region));
+  bool use_packets = packets != nullptr && accelerated;
+  int width = use_packets ? packets->width : 1;
+
+  wave.groups.clear();
+  wave.rays.clear();
+  for (int tile = first_tile; tile < last_tile; tile++) {
+    Region bounds = tileRegion(region, tile);
+    for (int y = bounds.y0; y < bounds.y1; y++) {
+      for (int x = bounds.x0; x < bounds.x1; x += width) {
+        int lanes = std::min(width, bounds.x1 - x);
+        wave.groups.push_back({(uint32_t)wave.rays.size(), lanes});
+        for (int lane = 0; lane < lanes; lane++) {
+          uint32_t path = (uint32_t)wave.rays.size();
+          wave.rays.push_back({origin, primaryDirection(x + lane, y, sin_theta, cos_theta), path});
+        }
+      }
+    }
+  }
+  size_t path_count = wave.rays.size();
+  stats.primary += path_count;
+  wave.path_hits.assign(path_count, 0);
+
+  // Primary rays take the packet kernels when tracePacket would; mirror rays
+  // always go one at a time, as in rayCast.
+  for (int depth = 0; depth <= MAX_BOUNCES; depth++) {
+    wave.segments[depth].clear();
+    if (wave.rays.empty()) { continue; }
+    extendWave(wave, use_packets && depth == 0);
+    shadowWave<F>(wave, use_packets && depth == 0);
+    shadeWave<F>(wave, depth, stats);
+    std::swap(wave.rays, wave.next_rays);
+  }
+  sumWave(wave);
+
+  // Paths were numbered in the order the loops above visit pixels.
+  uint32_t path = 0;
+  for (int tile = first_tile; tile < last_tile; tile++) {
+    Region bounds = tileRegion(region, tile);
+    for (int y = bounds.y0; y < bounds.y1; y++) {
+      for (int x = bounds.x0; x < bounds.x1; x++) {
+        frame.setColor(x, y, wave.colors[path++]);
+      }
+    }
+  }
+}
+
+void Raytracer::extendWave(Wave &wave, bool use_packets) {
+  size_t count = wave.rays.size();
+  wave.hits.resize(count);
+  wave.hit.resize(count);
+
+  if (!use_packets) {
+    for (size_t i = 0; i < count; i++) {
+      Wave::Ray &ray = wave.rays[i];
+      wave.hit[i] = closestHit(ray.origin, ray.direction, wave.hits[i]);
+    }
+    return;
+  }
+
+  RayPacket packet;
+  for (const Wave::Group &group : wave.groups) {
+    for (int lane = 0; lane < packets->width; lane++) {
+      // Lanes past the group get finite rays but stay inactive.
+      const Wave::Ray *ray = lane < group.lanes ? &wave.rays[group.first + lane] : nullptr;
+      packet.ox[lane] = ray ? ray->origin.x : 0.0f;
+      packet.oy[lane] = ray ? ray->origin.y : 0.0f;
+      packet.oz[lane] = ray ? ray->origin.z : 0.0f;
+      packet.dx[lane] = ray ? ray->direction.x : 1.0f;
+      packet.dy[lane] = ray ? ray->direction.y : 1.0f;
+      packet.dz[lane] = ray ? ray->direction.z : 1.0f;
+    }
+    float t[MAX_PACKET_WIDTH];
+    PrimitiveRef primitives[MAX_PACKET_WIDTH];
+    uint32_t instances[MAX_PACKET_WIDTH];
+    uint32_t hit = packets->closestHit(packet_scene, packet, (1u << group.lanes) - 1, t, primitives, instances,
+                                       PROFILE_COUNTERS, nullptr);
+    for (int lane = 0; lane < group.lanes; lane++) {
+      uint32_t i = group.first + lane;
+      wave.hit[i] = (hit >> lane) & 1;
+      if (wave.hit[i]) { wave.hits[i] = {t[lane], primitives[lane], instances[lane]}; }
+    }
+  }
+}
+
+template <unsigned F>
+void Raytracer::shadowWave(Wave &wave, bool use_packets) {
+  // With the light tree each hit picks its own lights; shadeDirect then
+  // traces their shadow rays itself.
+  if (!(F & FEATURE_SHADOWS) || use_light_tree) { return; }
+
+  size_t count = wave.rays.size();
+  uint32_t light_count = scene->lightCount();
+  size_t stride = light_count + 1;
+  wave.occlusion.assign(count * stride, 0);
+
+  RayPacket packet;
+  uint32_t queued[MAX_PACKET_WIDTH];
+  for (uint32_t light = 0; light <= light_count; light++) {
+    bool is_dir_light = light == light_count;
+    if (is_dir_light && !(F & FEATURE_DIR_LIGHT)) { break; }
+    Vect dir_light_direction = scene->dir_light_direction;
+    Vect light_position = is_dir_light ? Vect() : Vect{scene->light_x[light], scene->light_y[light], scene->light_z[light]};
+    float t_max = is_dir_light ? std::numeric_limits<float>::max() : 1.0f;
+
+    // Every hit's ray towards this light, with the origin and direction
+    // shade() would test; they share t_max and so fill packets freely.
+    int lanes = 0;
+    for (size_t i = 0; i <= count; i++) {
+      bool flush = use_packets && (lanes == packets->width || (i == count && lanes > 0));
+      if (flush) {
+        for (int lane = lanes; lane < packets->width; lane++) {
+          packet.ox[lane] = packet.oy[lane] = packet.oz[lane] = 0.0f;
+          packet.dx[lane] = packet.dy[lane] = packet.dz[lane] = 1.0f;
+        }
+        uint32_t blocked = packets->occluded(packet_scene, packet, t_max, (1u << lanes) - 1, PROFILE_COUNTERS,
+                                             nullptr);
+        for (int lane = 0; lane < lanes; lane++) {
+          wave.occlusion[queued[lane] * stride + light] = (blocked >> lane) & 1;
+        }
+        lanes = 0;
+      }
+      if (i == count || !wave.hit[i]) { continue; }
+
+      Wave::Ray &ray = wave.rays[i];
+      Vect hit = ray.origin + ray.direction * wave.hits[i].t;
+      Vect direction = is_dir_light ? -dir_light_direction : (light_position - hit);
+      if (!use_packets) {
+        wave.occlusion[i * stride + light] = inShadow(hit, direction, t_max);
+        continue;
+      }
+      packet.ox[lanes] = hit.x;
+      packet.oy[lanes] = hit.y;
+      packet.oz[lanes] = hit.z;
+      packet.dx[lanes] = direction.x;
+      packet.dy[lanes] = direction.y;
+      packet.dz[lanes] = direction.z;
+      queued[lanes++] = (uint32_t)i;
+    }
+  }
+}
+
+template <unsigned F>
+void Raytracer::shadeWave(Wave &wave, int depth, RayStats &stats) {
+  size_t stride = scene->lightCount() + 1;
+  wave.next_rays.clear();
+  for (size_t i = 0; i < wave.rays.size(); i++) {
+    if (!wave.hit[i]) { continue; }
+
+    Wave::Ray &ray = wave.rays[i];
+    const uint32_t *occlusion = (F & FEATURE_SHADOWS) && !use_light_tree ? &wave.occlusion[i * stride] : nullptr;
+    Vect hit, n;
+    float mirror;
+    Color direct = shadeDirect<F & (FEATURE_SHADOWS | FEATURE_DIR_LIGHT)>(ray.origin, ray.direction, wave.hits[i], occlusion, 0, stats, hit, n, mirror);
+
+    bool reflected = (F & FEATURE_MIRRORS) && depth < bounces && mirror > 0.0f;
+    wave.segments[depth].push_back({direct, mirror, ray.path, reflected});
+    wave.path_hits[ray.path]++;
+    if (reflected) {
+      Vect r = ray.direction - n * 2.0f * (ray.direction * n);
+      stats.reflection++;
+      wave.next_rays.push_back({hit, r, ray.path});
+    }
+  }
+}
+
+void Raytracer::sumWave(Wave &wave) {
+  // Deepest hits first, each added to the reflection it cast exactly as
+  // shade() adds it on the way back out of the recursion. A mirror ray that
+  // hit nothing brings back black; a path with no hit at all stays black.
+  wave.colors.assign(wave.path_hits.size(), Color());
+  for (int depth = MAX_BOUNCES; depth >= 0; depth--) {
+    for (const Wave::Segment &segment : wave.segments[depth]) {
+      Color reflection;
+      if (segment.reflected) {
+        bool bounce_hit = wave.path_hits[segment.path] > depth + 1;
+        Color bounced = bounce_hit ? wave.colors[segment.path] : Color{0.0f, 0.0f, 0.0f};
+        reflection = bounced * segment.mirror;
+      }
+      Color &color = wave.colors[segment.path];
+      color = segment.direct;
+      color += reflection;
+    }
+  }
+}
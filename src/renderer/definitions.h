@@ -1,4 +1,5 @@
 #pragma once
 
+// Default image size; frames can be any size (see Frame).
 #define WIDTH 800
 #define HEIGHT 600
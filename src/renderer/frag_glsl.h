@@ -6,11 +6,15 @@ const char *FRAGMENT_SHADER = R"(
 
 in vec2 texCoord;
 uniform sampler2D tex;
+// Part of the texture the image fills, and the centers of its last column
+// and row, past which filtering would pick up texels outside it.
+uniform vec2 scale;
+uniform vec2 limit;
 
 out vec4 fColor;
 
 void main() {
-	fColor = texture(tex, texCoord);
+	fColor = texture(tex, min(texCoord * scale, limit));
 }
 
 
@@ -0,0 +1,34 @@
+#include "framequeue.h"
+
+void FrameQueue::push(int buffer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.push_back(buffer);
+  }
+  available.notify_one();
+}
+
+bool FrameQueue::pop(int &buffer) {
+  std::unique_lock<std::mutex> lock(mutex);
+  available.wait(lock, [this] { return closed || !buffers.empty(); });
+  if (closed) { return false; }
+  buffer = buffers.front();
+  buffers.pop_front();
+  return true;
+}
+
+bool FrameQueue::tryPop(int &buffer) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (closed || buffers.empty()) { return false; }
+  buffer = buffers.front();
+  buffers.pop_front();
+  return true;
+}
+
+void FrameQueue::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+  }
+  available.notify_all();
+}
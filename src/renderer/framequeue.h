@@ -0,0 +1,24 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking queue of frame buffer indices passed between the tracing thread
+// and the display thread. It never holds more entries than there are
+// buffers, which is what bounds how far tracing can run ahead.
+class FrameQueue {
+ private:
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<int> buffers;
+  bool closed = false;
+
+ public:
+  void push(int buffer);
+  // Waits for a buffer; returns false once the queue is closed.
+  bool pop(int &buffer);
+  // Returns false straight away if no buffer is waiting.
+  bool tryPop(int &buffer);
+  // Wakes every waiting pop() and makes later ones fail.
+  void close();
+};
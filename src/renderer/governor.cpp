@@ -0,0 +1,100 @@
+#include "governor.h"
+
+#include <algorithm>
+
+namespace {
+
+// Frames at a level before its time counts, for stepping down or for
+// recording what the step to it cost.
+const int SETTLE_FRAMES = 2;
+// Range of frames waited before stepping up.
+const int MIN_UP_HOLD = 4;
+const int MAX_UP_HOLD = 128;
+// Over budget means slower than this fraction of the target. A step whose
+// cost was never seen is assumed to cost 1 / UP_FRACTION.
+const double DOWN_FRACTION = 1.1;
+const double UP_FRACTION = 0.6;
+// Weight of the newest frame in the smoothed time.
+const double SMOOTHING = 0.3;
+
+// Below full resolution, with one sample per pixel. Each step has about 70%
+// of the pixels of the one before. Bounces are capped at the given count.
+struct ScaleStep {
+  float scale;
+  int max_bounces;
+};
+const ScaleStep SCALE_STEPS[] = {{1.0f, 3},  {1.0f, 2},  {0.85f, 2}, {0.7f, 1}, {0.6f, 1},
+                                 {0.5f, 1},  {0.42f, 1}, {0.35f, 1}, {0.3f, 1}, {0.25f, 0}};
+
+bool sameQuality(const QualityLevel &a, const QualityLevel &b) {
+  return a.scale == b.scale && a.aa_samples == b.aa_samples && a.bounces == b.bounces;
+}
+
+}  // namespace
+
+FrameGovernor::FrameGovernor(double target_ms, int aa_samples, int bounces)
+    : target_ms(target_ms), up_hold(MIN_UP_HOLD) {
+  aa_samples = std::max(1, aa_samples);
+  levels.push_back({1.0f, aa_samples, bounces});
+  // A quarter of the samples at a time, down to none.
+  for (int samples = aa_samples / 4; samples > 1; samples /= 4) {
+    levels.push_back({1.0f, samples, bounces});
+  }
+  for (const ScaleStep &step : SCALE_STEPS) {
+    QualityLevel level = {step.scale, 1, std::min(bounces, step.max_bounces)};
+    if (!sameQuality(level, levels.back())) { levels.push_back(level); }
+  }
+  step_cost.assign(levels.size(), 0.0);
+}
+
+double FrameGovernor::stepCost(int level) const {
+  return step_cost[level] > 0.0 ? step_cost[level] : 1.0 / UP_FRACTION;
+}
+
+void FrameGovernor::changeLevel(int level) {
+  left_level = current;
+  left_ms = average_ms;
+  stepped_up = level < current;
+  current = level;
+  average_ms = 0.0;
+  frames_at_level = 0;
+}
+
+bool FrameGovernor::frameDone(double ms) {
+  average_ms = frames_at_level == 0 ? ms : average_ms + SMOOTHING * (ms - average_ms);
+  frames_at_level++;
+  if (frames_at_level < SETTLE_FRAMES) { return false; }
+
+  if (left_level >= 0 && (left_level == current - 1 || left_level == current + 1)) {
+    int upper = std::min(left_level, current);
+    step_cost[upper] = left_level < current ? left_ms / average_ms : average_ms / left_ms;
+  }
+  left_level = -1;
+
+  if (average_ms > target_ms * DOWN_FRACTION && current + 1 < levelCount()) {
+    // A step up that did not hold: wait longer before the next.
+    if (stepped_up) { up_hold = std::min(up_hold * 2, MAX_UP_HOLD); }
+    // Far over budget, skip the levels that would be too.
+    int level = current + 1;
+    double predicted_ms = average_ms / stepCost(current);
+    while (predicted_ms > target_ms && level + 1 < levelCount()) {
+      predicted_ms /= stepCost(level);
+      level++;
+    }
+    changeLevel(level);
+    return true;
+  }
+  if (stepped_up && frames_at_level >= up_hold) {
+    // The last step up held.
+    up_hold = MIN_UP_HOLD;
+    stepped_up = false;
+  }
+
+  if (current > 0 && frames_at_level >= up_hold) {
+    if (average_ms * stepCost(current - 1) < target_ms) {
+      changeLevel(current - 1);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+
+// Settings for one step of the viewer's quality ladder.
+struct QualityLevel {
+  // Fraction of the window's width and height traced; the display scales
+  // the image up to the window.
+  float scale;
+  int aa_samples;
+  int bounces;
+};
+
+// Picks the render quality that keeps the viewer's frames near a target
+// time, from the times of the frames it has rendered. Levels run from the
+// best quality (0) down: anti-aliasing samples go first, then mirror
+// bounces and resolution, each level costing roughly two thirds of the one
+// above. Over budget for two frames, it steps down, past as many levels as
+// it takes to fit. Under budget, it steps up once the level above is
+// predicted to fit, from what that step was seen to cost the last time it
+// was crossed. A step up that has to be taken back doubles the wait before
+// the next try, so the level settles instead of flipping between two.
+class FrameGovernor {
+ private:
+  std::vector<QualityLevel> levels;
+  double target_ms;
+  int current = 0;
+  // Smoothed time of the frames at the current level; 0 before the first.
+  double average_ms = 0.0;
+  int frames_at_level = 0;
+  // step_cost[i]: time at level i over time at level i + 1, as last seen on
+  // crossing between them; 0 until then.
+  std::vector<double> step_cost;
+  // The level left last and its smoothed time then, until the level
+  // reached has settled.
+  int left_level = -1;
+  double left_ms = 0.0;
+  // Frames to stay at a level before trying the one above.
+  int up_hold;
+  bool stepped_up = false;
+
+  // Time at `level` over time at the level below it, or a guess.
+  double stepCost(int level) const;
+  void changeLevel(int level);
+
+ public:
+  // Starts at the best level: `aa_samples` and `bounces` as configured and
+  // full resolution.
+  FrameGovernor(double target_ms, int aa_samples, int bounces);
+
+  // Takes the time the last frame at quality() took. Returns true if the
+  // level changed, so the next frame should use the new quality().
+  bool frameDone(double ms);
+
+  const QualityLevel &quality() const { return levels[current]; }
+  // Levels never change after construction, so any thread may read them.
+  const QualityLevel &quality(int level) const { return levels[level]; }
+  int level() const { return current; }
+  int levelCount() const { return (int)levels.size(); }
+  double averageTime() const { return average_ms; }
+};
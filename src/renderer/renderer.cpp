@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "frag_glsl.h"
+#include "raytracer/profile.h"
 #include "vert_glsl.h"
 
 GLenum error;
@@ -16,6 +17,10 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action,
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
     glfwSetWindowShouldClose(window, GLFW_TRUE);
   }
+  if ((key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT) && action != GLFW_RELEASE) {
+    Renderer *renderer = static_cast<Renderer *>(glfwGetWindowUserPointer(window));
+    renderer->orbit += key == GLFW_KEY_RIGHT ? 1 : -1;
+  }
 }
 
 void glCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
@@ -23,7 +28,7 @@ void glCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
   std::cerr << message << std::endl;
 };
 
-bool Renderer::initGL(GLfloat *tex_data) {
+bool Renderer::initGL(const uint16_t *tex_data) {
   GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
 
   glShaderSource(vertexShader, 1, V_SHADER, NULL);
@@ -71,6 +76,9 @@ bool Renderer::initGL(GLfloat *tex_data) {
 
   GLint sampler_uniform_loc = glGetUniformLocation(shaderProgram, "tex");
   glUniform1i(sampler_uniform_loc, 0);
+  scale_uniform = glGetUniformLocation(shaderProgram, "scale");
+  limit_uniform = glGetUniformLocation(shaderProgram, "limit");
+  setImageSize(width, height);
 
   /*********************/
   /*  set up textures  */
@@ -81,8 +89,8 @@ bool Renderer::initGL(GLfloat *tex_data) {
 
   glGenTextures(1, &tex);
   glBindTexture(GL_TEXTURE_2D, tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, WIDTH, HEIGHT, 0, GL_RGBA,
-               GL_FLOAT, tex_data);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA,
+               GL_HALF_FLOAT, tex_data);
 
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -128,25 +136,79 @@ bool Renderer::initGL(GLfloat *tex_data) {
   return true;
 }
 
-std::vector<GLfloat> Renderer::getTextureData(const Frame &frame) {
-  std::vector<GLfloat> tex_data;
-  for (int y = 0; y < HEIGHT; y++) {
-    for (int x = 0; x < WIDTH; x++) {
-      Color c = frame.getColor(x, y);
-      tex_data.push_back(c.r);
-      tex_data.push_back(c.g);
-      tex_data.push_back(c.b);
-      tex_data.push_back(1.0f);
+void Renderer::setImageSize(int image_width, int image_height) {
+  this->image_width = image_width;
+  this->image_height = image_height;
+  glUniform2f(scale_uniform, (float)image_width / width, (float)image_height / height);
+  glUniform2f(limit_uniform, (image_width - 0.5f) / width, (image_height - 0.5f) / height);
+}
+
+void Renderer::initUploadBuffers() {
+  persistent = GLEW_ARB_buffer_storage;
+  for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+    if (!persistent) {
+      upload_frames[i].reset(new Frame(width, height));
+      continue;
+    }
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &pbo[i]);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, Frame::bytesFor(width, height), NULL, flags);
+    void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, Frame::bytesFor(width, height), flags);
+    upload_frames[i].reset(new Frame((uint16_t *)mapped, width, height));
+    upload_frames[i]->clear();
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void Renderer::releaseUploadBuffers() {
+  for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+    if (fences[i]) {
+      glDeleteSync(fences[i]);
+      fences[i] = 0;
+    }
+    upload_frames[i].reset();
+    if (pbo[i]) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      glDeleteBuffers(1, &pbo[i]);
+      pbo[i] = 0;
     }
   }
-  return tex_data;
+}
+
+bool Renderer::uploadDone(int buffer) {
+  GLsync &fence = fences[buffer];
+  if (fence) {
+    if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) { return false; }
+    glDeleteSync(fence);
+    fence = 0;
+  }
+  return true;
 }
 
 void Renderer::changeFrame(const Frame &frame) {
-  std::vector<GLfloat> tex_data = getTextureData(frame);
+  PROFILE_SCOPE("upload");
   glBindTexture(GL_TEXTURE_2D, tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, WIDTH, HEIGHT, 0, GL_RGBA,
-               GL_FLOAT, tex_data.data());
+  if (frame.width() != image_width || frame.height() != image_height) {
+    setImageSize(frame.width(), frame.height());
+  }
+
+  int buffer = -1;
+  for (int i = 0; i < UPLOAD_BUFFERS; i++) {
+    if (persistent && frame.data() == upload_frames[i]->data()) { buffer = i; }
+  }
+  if (buffer >= 0) {
+    // The copy out of the pixel buffer runs asynchronously; the fence tells
+    // uploadDone() when the buffer may be written again.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[buffer]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA, GL_HALF_FLOAT, (void *)0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA, GL_HALF_FLOAT, frame.data());
+  }
   glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -162,7 +224,9 @@ bool Renderer::init(const Frame &frame) {
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
   /* Create a windowed mode window and its OpenGL context */
-  window = glfwCreateWindow(WIDTH, HEIGHT, "Line Drawing Exercise", NULL, NULL);
+  width = frame.width();
+  height = frame.height();
+  window = glfwCreateWindow(width, height, "Line Drawing Exercise", NULL, NULL);
 
   if (!window) {
     glfwTerminate();
@@ -171,6 +235,9 @@ bool Renderer::init(const Frame &frame) {
 
   /* Make the window's context current */
   glfwMakeContextCurrent(window);
+  // Presentation waits for vsync instead of spinning against the tracer.
+  glfwSwapInterval(1);
+  glfwSetWindowUserPointer(window, this);
   glfwSetKeyCallback(window, key_callback);
 
   glewExperimental = GL_TRUE;
@@ -182,14 +249,12 @@ bool Renderer::init(const Frame &frame) {
   // glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL,
   // GL_TRUE);
 
-  //   turn the colors in the frame into gl format
-  std::vector<GLfloat> tex_data = getTextureData(frame);
-
-  if (!initGL(tex_data.data())) {
+  if (!initGL(frame.data())) {
     glfwDestroyWindow(window);
     glfwTerminate();
     return false;
   }
+  initUploadBuffers();
   return true;
 }
 
@@ -238,8 +303,14 @@ bool Renderer::render() {
     glfwPollEvents();
     return true;
   } else {
-    glfwDestroyWindow(window);
-    glfwTerminate();
     return false;
   }
 }
+
+void Renderer::setTitle(const char *title) { glfwSetWindowTitle(window, title); }
+
+void Renderer::shutdown() {
+  releaseUploadBuffers();
+  glfwDestroyWindow(window);
+  glfwTerminate();
+}
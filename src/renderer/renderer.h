@@ -3,7 +3,7 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#include <vector>
+#include <memory>
 
 #include "renderer_types.h"
 
@@ -14,12 +14,61 @@ class Renderer {
   GLuint vao;
   GLuint vbo;
   GLuint tex;
+  // Size of the window and the texture, from the frame given to init().
+  int width = 0;
+  int height = 0;
+  // Size of the image shown, which may fill only part of the texture.
+  int image_width = 0;
+  int image_height = 0;
+  GLint scale_uniform = -1;
+  GLint limit_uniform = -1;
 
-  bool initGL(GLfloat *tex_data);
-  std::vector<GLfloat> getTextureData(const Frame &frame);
+  // Upload frames that are rendered into and then displayed. With
+  // ARB_buffer_storage they live in persistently mapped pixel buffers and the
+  // texture is filled from the buffer; otherwise they are plain frames
+  // uploaded from client memory. Three let one be traced while another waits
+  // to be shown and the GPU still copies from the third.
+  static const int UPLOAD_BUFFERS = 3;
+  bool persistent = false;
+  GLuint pbo[UPLOAD_BUFFERS] = {};
+  GLsync fences[UPLOAD_BUFFERS] = {};
+  std::unique_ptr<Frame> upload_frames[UPLOAD_BUFFERS];
+
+  // Right arrow presses (and repeats) less left ones not yet taken.
+  int orbit = 0;
+
+  bool initGL(const uint16_t *tex_data);
+  // Stretches the top left image_width x image_height texels over the window.
+  void setImageSize(int image_width, int image_height);
+  void initUploadBuffers();
+  void releaseUploadBuffers();
+
+  friend void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
 
  public:
+  int uploadFrameCount() const { return UPLOAD_BUFFERS; }
+  // Frames that may be written from any thread while they are not being
+  // uploaded.
+  Frame &uploadFrame(int buffer) { return *upload_frames[buffer]; }
+  // Makes `frame` the displayed image. Upload frames are copied from their
+  // pixel buffer asynchronously; any other frame is uploaded from its memory.
+  // A frame smaller than the window is scaled up to fill it; an upload frame
+  // takes the size of any smaller frame assigned to it.
   void changeFrame(const Frame &frame);
+  // Whether the GPU has finished copying an upload frame passed to
+  // changeFrame(), so it can be rendered into again. Never blocks.
+  bool uploadDone(int buffer);
   bool init(const Frame &frame);
+  // Draws the current image and polls events. Returns false once the window
+  // has been asked to close; call shutdown() after that.
   bool render();
+  void setTitle(const char *title);
+  // Arrow key steps since the last call, right positive; read on the thread
+  // that calls render().
+  int takeOrbit() {
+    int steps = orbit;
+    orbit = 0;
+    return steps;
+  }
+  void shutdown();
 };
\ No newline at end of file
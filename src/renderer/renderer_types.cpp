@@ -1,5 +1,12 @@
 #include "renderer_types.h"
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
+
+namespace {
+const uint16_t HALF_ONE = 0x3c00;
+}
 
 Color operator"" _c(unsigned long long inc) {
   int r = (inc & 0xFF0000) >> 16;
@@ -22,4 +29,170 @@ Color operator+=(Color &p1, Color p2) {
 std::ostream& operator<<(std::ostream& os, const Color& obj) {
     os << "[ r: " << obj.r << ", g: " << obj.g << ", b: " << obj.b << " ]";
     return os;
-}
\ No newline at end of file
+}
+
+uint16_t floatToHalf(float value) {
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  uint16_t sign = (uint16_t)((f >> 16) & 0x8000);
+  f &= 0x7fffffff;
+
+  if (f >= 0x47800000) {
+    // Too large for a half (or already inf/NaN).
+    return sign | (f > 0x7f800000 ? 0x7e00 : 0x7c00);
+  }
+  if (f < 0x38800000) {
+    // Subnormal or zero: adding 0.5 lines the half mantissa up with the low
+    // float bits and lets the FPU do the rounding.
+    uint32_t magic_bits = 126u << 23;
+    float magic, abs_value;
+    memcpy(&magic, &magic_bits, sizeof(magic));
+    memcpy(&abs_value, &f, sizeof(abs_value));
+    abs_value += magic;
+    memcpy(&f, &abs_value, sizeof(f));
+    return sign | (uint16_t)(f - magic_bits);
+  }
+  // Rebias the exponent and round the 13 dropped bits to nearest even.
+  uint32_t odd = (f >> 13) & 1;
+  f += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+  return sign | (uint16_t)(f >> 13);
+}
+
+float halfToFloat(uint16_t value) {
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1f;
+  uint32_t mantissa = value & 0x3ff;
+
+  uint32_t f;
+  if (exponent == 0x1f) {
+    f = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0) {
+    float subnormal = std::ldexp((float)mantissa, -24);
+    return sign ? -subnormal : subnormal;
+  } else {
+    f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float result;
+  memcpy(&result, &f, sizeof(result));
+  return result;
+}
+
+Frame::Frame(int width, int height, int first_row, int rows)
+    : image_width(width), image_height(height), first_row(first_row), row_count(rows),
+      storage((size_t)width * rows * CHANNELS), pixels(storage.data()) {
+  clear();
+}
+
+Frame::Frame(const Frame &other)
+    : image_width(other.image_width), image_height(other.image_height), first_row(other.first_row),
+      row_count(other.row_count), storage(other.pixels, other.pixels + other.bytes() / sizeof(uint16_t)),
+      pixels(storage.data()) {}
+
+Frame &Frame::operator=(const Frame &other) {
+  if (this == &other) { return *this; }
+  bool owned = pixels == storage.data();
+  image_width = other.image_width;
+  image_height = other.image_height;
+  first_row = other.first_row;
+  row_count = other.row_count;
+  if (owned) {
+    storage.resize(bytes() / sizeof(uint16_t));
+    pixels = storage.data();
+  }
+  std::copy(other.pixels, other.pixels + bytes() / sizeof(uint16_t), pixels);
+  return *this;
+}
+
+void Frame::reshape(int width, int height, int first_row, int rows) {
+  image_width = width;
+  image_height = height;
+  this->first_row = first_row;
+  row_count = rows;
+  if (storage.size() < bytes() / sizeof(uint16_t)) {
+    storage.resize(bytes() / sizeof(uint16_t));
+    pixels = storage.data();
+  }
+}
+
+Color Frame::getColor(int x, int y) const {
+  const uint16_t *p = pixel(x, y);
+  return {halfToFloat(p[0]), halfToFloat(p[1]), halfToFloat(p[2])};
+}
+
+void Frame::setColor(int x, int y, Color c) {
+  uint16_t *p = pixel(x, y);
+  p[0] = floatToHalf(c.r);
+  p[1] = floatToHalf(c.g);
+  p[2] = floatToHalf(c.b);
+  p[3] = HALF_ONE;
+}
+
+void Frame::clear() {
+  uint16_t *end = pixels + bytes() / sizeof(uint16_t);
+  for (uint16_t *p = pixels; p != end; p += CHANNELS) {
+    p[0] = p[1] = p[2] = 0;
+    p[3] = HALF_ONE;
+  }
+}
+
+static_assert(sizeof(PixelCost) == 3 * sizeof(float), "cost maps are read as float triples");
+
+void CostMap::reshape(int width, int height) {
+  image_width = width;
+  image_height = height;
+  costs.assign((size_t)width * height, PixelCost());
+}
+
+bool CostMap::metricFor(const std::string &name, CostMetric &metric) {
+  if (name == "tests") {
+    metric = COST_TESTS;
+  } else if (name == "rays") {
+    metric = COST_RAYS;
+  } else if (name == "time") {
+    metric = COST_TIME;
+  } else {
+    std::cout << "Unknown cost metric: " << name << " (use tests, rays or time)" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+double CostMap::total(CostMetric metric) const {
+  double sum = 0.0;
+  for (const PixelCost &cost : costs) {
+    sum += value(cost, metric);
+  }
+  return sum;
+}
+
+void CostMap::heatmap(CostMetric metric, Frame &frame) const {
+  frame.reshape(image_width, image_height, 0, image_height);
+  // Logarithms of the costs, with free pixels left at the bottom.
+  std::vector<float> values(costs.size());
+  for (size_t i = 0; i < costs.size(); i++) {
+    float v = value(costs[i], metric);
+    values[i] = v > 0.0f ? std::log(v) : -std::numeric_limits<float>::infinity();
+  }
+  std::vector<float> sorted = values;
+  auto percentile = [&](size_t per_mille) {
+    size_t i = std::min(sorted.size() - 1, sorted.size() * per_mille / 1000);
+    std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+    return sorted[i];
+  };
+  float high = percentile(999);
+  float low = percentile(10);
+  if (!(low > -std::numeric_limits<float>::infinity())) { low = high - 1.0f; }
+  float scale = high > low ? 1.0f / (high - low) : 0.0f;
+
+  static const Color ramp[] = {{0.0f, 0.0f, 0.0f}, {0.1f, 0.1f, 0.8f}, {0.9f, 0.1f, 0.1f},
+                               {1.0f, 0.9f, 0.0f}, {1.0f, 1.0f, 1.0f}};
+  const int steps = sizeof(ramp) / sizeof(ramp[0]) - 1;
+  for (int y = 0; y < image_height; y++) {
+    for (int x = 0; x < image_width; x++) {
+      float v = std::min(1.0f, std::max(0.0f, (values[(size_t)y * image_width + x] - low) * scale)) * steps;
+      int step = std::min((int)v, steps - 1);
+      float f = v - step;
+      frame.setColor(x, y, ramp[step] * (1.0f - f) + ramp[step + 1] * f);
+    }
+  }
+}
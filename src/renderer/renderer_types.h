@@ -1,5 +1,8 @@
 #pragma once
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <iostream>
 
@@ -31,14 +34,104 @@ Color operator+=(Color &p1, Color p2);
 
 Color operator"" _c(unsigned long long inc);
 
+// IEEE half precision, rounded to nearest even.
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
+
+// Pixels are kept as RGBA16F, the format the viewer uploads, so a finished
+// frame goes to the GPU without any conversion pass. A frame either owns its
+// pixels or renders into memory it is handed, such as a mapped pixel buffer.
+// It may hold only a band of rows of its image, so very large images can be
+// rendered and written a band at a time; pixels are addressed by their row
+// in the whole image either way.
 struct Frame {
-  std::vector<Color> colors;
+  static const int CHANNELS = 4;
+
+  Frame(int width = WIDTH, int height = HEIGHT) : Frame(width, height, 0, height) {}
+  // Rows [first_row, first_row + rows) of a width x height image.
+  Frame(int width, int height, int first_row, int rows);
+  Frame(uint16_t *external, int width = WIDTH, int height = HEIGHT)
+      : image_width(width), image_height(height), first_row(0), row_count(height), pixels(external) {}
+  Frame(const Frame &other);
+  // An external frame must already have room for the other's pixels.
+  Frame &operator=(const Frame &other);
+
+  static size_t bytesFor(int width, int rows) { return (size_t)width * rows * CHANNELS * sizeof(uint16_t); }
+
+  // Size of the whole image, and the rows of it the frame holds.
+  int width() const { return image_width; }
+  int height() const { return image_height; }
+  int firstRow() const { return first_row; }
+  int rows() const { return row_count; }
+  size_t bytes() const { return bytesFor(image_width, row_count); }
+  // Makes an owned frame hold rows [first_row, first_row + rows) of a
+  // width x height image, allocating only when it needs more room than it
+  // has. Pixels are left as they were.
+  void reshape(int width, int height, int first_row, int rows);
+
+  Color getColor(int x, int y) const;
+
+  void setColor(int x, int y, Color p);
+
+  // Black with opaque alpha, filled in place.
+  void clear();
+
+  const uint16_t *data() const { return pixels; }
+  // RGBA of pixel (x, y), followed by the rest of its row.
+  uint16_t *pixel(int x, int y) { return pixels + ((size_t)(y - first_row) * image_width + x) * CHANNELS; }
+  const uint16_t *pixel(int x, int y) const {
+    return pixels + ((size_t)(y - first_row) * image_width + x) * CHANNELS;
+  }
+
+ private:
+  int image_width;
+  int image_height;
+  int first_row;
+  int row_count;
+  std::vector<uint16_t> storage;
+  uint16_t *pixels;
+};
+
+// What one pixel cost to trace, with all its shadow and mirror rays.
+// Floats, so a cost map is written out as a float image as it is.
+struct PixelCost {
+  // Sphere and triangle intersection tests.
+  float tests = 0.0f;
+  float rays = 0.0f;
+  float nanoseconds = 0.0f;
+};
+
+enum CostMetric { COST_TESTS, COST_RAYS, COST_TIME };
 
-  Frame() { colors.resize(WIDTH * HEIGHT); }
+// Per-pixel render cost of a frame, recorded by Raytracer::render when
+// asked for, for finding which parts of an image are expensive.
+struct CostMap {
+  CostMap(int width = WIDTH, int height = HEIGHT) { reshape(width, height); }
 
-  Color getColor(int x, int y) const { return colors[y * WIDTH + x]; }
+  int width() const { return image_width; }
+  int height() const { return image_height; }
+  // Resizes to width x height and zeroes every pixel.
+  void reshape(int width, int height);
 
-  void setColor(int x, int y, Color p) { colors[y * WIDTH + x] = p; }
+  PixelCost &at(int x, int y) { return costs[(size_t)y * image_width + x]; }
+  const PixelCost &at(int x, int y) const { return costs[(size_t)y * image_width + x]; }
+  // Tests, rays and nanoseconds of each pixel in turn, row by row.
+  const float *data() const { return &costs[0].tests; }
+
+  static bool metricFor(const std::string &name, CostMetric &metric);
+  static float value(const PixelCost &cost, CostMetric metric) {
+    return metric == COST_TESTS ? cost.tests : metric == COST_RAYS ? cost.rays : cost.nanoseconds;
+  }
+  // Sum of `metric` over the frame.
+  double total(CostMetric metric) const;
+  // Paints `metric` into `frame` in false color, from black through blue,
+  // red and yellow to white, on a log scale so both the cheap background
+  // and the worst pixels stay readable. The scale runs from the 1st to the
+  // 99.9th percentile, so one preempted pixel does not darken the rest.
+  void heatmap(CostMetric metric, Frame &frame) const;
 
-  void clear() { colors = std::vector<Color>(WIDTH * HEIGHT); }
+ private:
+  int image_width = 0;
+  int image_height = 0;
+  std::vector<PixelCost> costs;
 };